@@ -1,23 +1,43 @@
 #ifndef _KALEIDOSCOPE_DEBUG
-#define _KALEIDOSCOPE_DEBUG 
+#define _KALEIDOSCOPE_DEBUG
 #include <iostream>
+#include <atomic>
 
 
-//#define DEBUG_TOKEN_ON
-#ifdef DEBUG_TOKEN_ON
-#define DEBUG_TOKEN(x) std::cout<<(x)<<std::endl;
-#else
-#define DEBUG_TOKEN(x)
-#endif // DEBUG_TOKEN_ON
+//leveled logging to stderr
+//	KPP_LOG(LOG_DEBUG, "creating %s", name.c_str());
+//a level above KPP_LOG_MAX_LEVEL is compiled out, arguments included; the others cost a load and a branch when disabled
+enum LogLevel{
+	LOG_OFF,
+	LOG_ERROR,
+	LOG_WARN,
+	LOG_INFO,		//the values of the expressions of a script, statistics at exit
+	LOG_DEBUG,		//what the code generator and the JIT do with every function
+	LOG_TRACE,		//every token and every codegen step, only with -DKPP_LOG_MAX_LEVEL=LOG_TRACE
+};
 
+#ifndef KPP_LOG_MAX_LEVEL
+#define KPP_LOG_MAX_LEVEL LOG_DEBUG
+#endif
 
+//the level of the process, set by --log=<level> and :log
+extern std::atomic<int> kpp_log_level;
 
-#define DEBUG_CERR_ON
-#ifdef DEBUG_CERR_ON
-#define DEBUG_CERR(x) std::cerr<<(x)<<std::endl;
-#else
-#define DEBUG_CERR(X)
+//one line, the newline is added
+void kpp_log(int level, const char* format, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 3)))
 #endif
+	;
+
+#define KPP_LOG_ENABLED(level) ((level) <= KPP_LOG_MAX_LEVEL && (level) <= kpp_log_level.load(std::memory_order_relaxed))
+
+#define KPP_LOG(level, ...) do { if (KPP_LOG_ENABLED(level)) kpp_log((level), __VA_ARGS__); } while (0)
+
+
+//the old trace macros, at LOG_TRACE
+#define DEBUG_TOKEN(x) do { if (KPP_LOG_ENABLED(LOG_TRACE)) std::cerr << (x) << std::endl; } while (0)
+#define DEBUG_CERR(x) do { if (KPP_LOG_ENABLED(LOG_TRACE)) std::cerr << (x) << std::endl; } while (0)
 
 
-#endif	//_KALEIDOSCOPE_DEBUG
\ No newline at end of file
+#endif	//_KALEIDOSCOPE_DEBUG
@@ -1,29 +1,87 @@
 #include <cctype>
 #include <cstdio>
 #include <map>
+#include <unordered_map>
 #include <cstdint>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <istream>
+#include <fstream>
+#include <sstream>
 #include <set>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <cmath>
+#include <random>
+#include <cstdarg>
 #include "Debug.h"
+#include "kpp.h"
 #include "llvm/ADT/APInt.h"
 #include <llvm/IR/Value.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/Target/TargetMachine.h>
-#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/PassManager.h>
 #include <llvm/IR/Function.h>
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/IR/DebugInfo.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/CodeGen.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/CachePruning.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/Process.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/ExecutionEngine/RTDyldMemoryManager.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/Support/Memory.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
-#include <llvm/Analysis/Passes.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/Support/Format.h>
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/Object/SymbolSize.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 using namespace llvm;
 
 enum TOK{
@@ -45,6 +103,7 @@ enum TOK{
 	THEN_TOK,
 	ELSE_TOK,
 	FOR_TOK,
+	PARFOR_TOK,
 
 };
 
@@ -58,143 +117,261 @@ namespace{
 }
 
 
-struct DebugInfo {
-	DICompileUnit *TheCU;
-	DIType *DblTy;
-	std::vector<DIScope *> LexicalBlocks;
-	std::map<const PrototypeAST *, DIScope *> FnScopeMap;
-	void emitLocation(ExprAST *AST);
-	DIType *getDoubleTy();
-} KSDbgInfo;
-
 struct SourceCodeLocation{
 	int line, col;
 };
 
-static SourceCodeLocation CurLoc;
-static SourceCodeLocation LexLoc = { 1, 0 };
-
+//the DWARF line table of -g, perf reads it from the jitdump of --jitdump, gdb from a kppc object
+//the first function of a module creates its compile unit, every function gets a DISubprogram, every expression a location
+struct DebugInfo {
+	bool enabled;
+	std::string file;		//the script, <input> for the REPL, pipes, kpp::Engine and the server
+	std::string directory;
+
+	DebugInfo() :enabled(false), file("<input>"){}
+	void beginFunction(Function* func, const PrototypeAST* proto);
+	void finishFunction(Function* func);
+	void emitLocation(ExprAST* AST);
+};
 
-static std::string getUniqueAnonyName(const char* ss){
-	static int index = 0;
+//unique in the process, the sessions on other threads take names too
+static std::string getUniqueMCJITName(const char* ss){
+	static std::atomic<int> index(0);
 	char ret_name[32];
 
 	sprintf(ret_name, "%s%d", ss, index++);
 	return std::string(ret_name);
 }
 
-static std::string getUniqueMCJITName(const char* ss){
-	static int index = 0;
+
+namespace{
+	class Object;
+	class FunctionAST;
+	class OptPipeline;
+	class JITHelper;
+	class JITSlabAllocator;
+	class AOTCompiler;
+	class CodegenHelper;
+	class DiskObjectCache;
+	class ProfileData;
+
+	//an array of doubles read by a[i] and the reduction builtins, created by :array or bound to host memory by kpp::Engine
+	//the code has the address of view as a constant, so an array keeps its address for the whole session,
+	//creating or binding it again only changes the view
+	struct KppArray{
+		struct View{
+			const double* data;
+			uint64_t length;
+		} view;
+		std::vector<double> storage;	//the elements of an array created by :array, empty for host memory
+	};
+
+	//out[i] = f(col0[i], col1[i], ...) for every i < n, with the body of f inlined into the loop
+	struct BatchKernel{
+		std::string symbol;		//f.batch<k>
+		void* rows;				//void f.batch<k>(const double* col0, ..., double* out, i64 n)
+		void(*columns)(const double* const* cols, double* out, uint64_t n);	//f.batch<k>.columns, the columns in an array
+		unsigned arity;
+		FunctionAST* definition;	//the definition the body was compiled from
+	};
+}
+
+//everything a kpp program works on: the LLVM context, the lexer and parser state, the code generator and the JIT
+//the kpp command line runs in one session, every kpp::Engine owns one; theSession is the one being worked on
+struct kpp::Session{
+	orc::ThreadSafeContext context;
+	IRBuilder<> Builder;
+	std::map<std::string, AllocaInst*> namedValues;
+
+	//lexer and parser
+	std::string cur_identifier;
+	int32_t cur_integer;
+	double cur_double;
+	int32_t cur_tok;
+	int32_t cur_char;		//lookahead character of the lexer
+	SourceCodeLocation CurLoc;
+	SourceCodeLocation LexLoc;
+	std::map<char, int32_t> binary_op_precedence;
+	int anony_index;
+	DebugInfo debug_info;
+	std::map<Object*, int32_t> exprast_pool;	//every AST node of the session, deleted with it
+
+	OptPipeline* pipeline;
+	JITHelper* helper;
+	JITSlabAllocator* jit_memory;
+	AOTCompiler* compiler;		//kppc mode, nullptr when running with the JIT
+	CodegenHelper* codegen;		//helper or compiler
+	DiskObjectCache* object_cache;
+	ProfileData* profile;		//--profile-in, nullptr without it
+	std::map<std::string, FunctionAST*> definitions;	//the last definition of every function
+	std::map<std::string, BatchKernel> kernels;
+	std::map<std::string, KppArray*> arrays;
+	unsigned vector_doubles;	//doubles in a vector register of the target, for the reduction builtins, 0 until the first one
+	bool batch_mode;			//input is a script file, top-level expressions are batched
+	bool echo;					//interactive REPL: print the prompt and the values of the expressions
+	bool keep_results;			//kpp::Engine and the server read the values from results, a script logs them at LOG_INFO
+	bool profile_calls;			//--profile, the functions defined call kpp_profile_enter and kpp_profile_exit
+	bool capture_output;		//kpp::Engine, the log lines and the output of the commands go to output instead of stderr
+
+	std::vector<double> results;	//values of the top-level expressions run since the last kpp::Engine call
+	std::string last_error;
+	std::string output;			//written since the last kpp::Engine call, with capture_output
+	std::atomic<unsigned> error_count;	//--pipeline reports errors from the parser thread and the main thread
+	std::mutex error_lock;
+
+	Session();
+	~Session();
+	void stopJIT();
+};
+
+//every thread works on its own session, sessions on different threads share nothing but the parfor pool
+static thread_local kpp::Session* theSession;
+
+
+kpp::Session::Session() :context(std::make_unique<LLVMContext>()), Builder(*context.getContext()), cur_integer(0), cur_double(0),
+	cur_tok(0), cur_char(' '), anony_index(0), pipeline(nullptr), helper(nullptr), jit_memory(nullptr), compiler(nullptr),
+	codegen(nullptr), object_cache(nullptr), profile(nullptr), vector_doubles(0), batch_mode(false), echo(true), keep_results(false), profile_calls(false), capture_output(false), error_count(0){
+	CurLoc = { 0, 0 };
+	LexLoc = { 1, 0 };
+	//the built-in binary operators, a binary operator definition adds its own
+	binary_op_precedence['='] = 2;
+	binary_op_precedence['<'] = 10;
+	binary_op_precedence['+'] = 20;
+	binary_op_precedence['-'] = 20;
+	binary_op_precedence['*'] = 40;
+	binary_op_precedence['/'] = 40;
+}
+
+//makes session the one theSession points to, until the end of the scope
+class SessionScope{
+	kpp::Session* previous;
+public:
+	explicit SessionScope(kpp::Session* session) :previous(theSession){ theSession = session; }
+	~SessionScope(){ theSession = previous; }
+};
+
+
+static std::string getUniqueAnonyName(const char* ss){
 	char ret_name[32];
 
-	sprintf(ret_name, "%s%d", ss, index++);
+	sprintf(ret_name, "%s%d", ss, theSession->anony_index++);
 	return std::string(ret_name);
 }
 
 static inline int advance(std::istream& input){
 	int ch = input.get();
-	if (ch == '\n' || ch == '\r'){
-		++LexLoc.line;
+	if (ch == '\n'){
+		++theSession->LexLoc.line;
+		theSession->LexLoc.col = 0;
 	}
 	else{
-		++LexLoc.col;
+		++theSession->LexLoc.col;
 	}
 	return ch;
 }
 
 
-std::string cur_identifier;
-int32_t cur_integer;
-double cur_double;
-
-int32_t cur_tok;
-
-
 int32_t get_tok(std::istream& input){
-	static int32_t cur_char = ' ';
-
-	while (isspace(cur_char)) cur_char = advance(input);
+	while (isspace(theSession->cur_char)) theSession->cur_char = advance(input);
+	theSession->CurLoc = theSession->LexLoc;
 
 	//ͬC/C++, identifierĸ'_'ʼ
-	if (isalpha(cur_char) || cur_char == '_'){
-		cur_identifier = cur_char;
+	if (isalpha(theSession->cur_char) || theSession->cur_char == '_'){
+		theSession->cur_identifier = theSession->cur_char;
 
-		while (cur_char = advance(input))
-			if (isalnum(cur_char) || cur_char == '_')
-				cur_identifier += cur_char;
+		while (theSession->cur_char = advance(input))
+			if (isalnum(theSession->cur_char) || theSession->cur_char == '_')
+				theSession->cur_identifier += theSession->cur_char;
 			else
 				break;
 
-		if (cur_identifier == "def")
+		if (theSession->cur_identifier == "def")
 			return TOK::DEF_TOK;
-		else if (cur_identifier == "extern")
+		else if (theSession->cur_identifier == "extern")
 			return TOK::EXTERN_TOK;
-		else if (cur_identifier == "var")
+		else if (theSession->cur_identifier == "var")
 			return TOK::VAR_TOK;
-		else if (cur_identifier == "in")
-			return TOK::INT_TOK;
-		else if (cur_identifier == "if")
+		else if (theSession->cur_identifier == "in")
+			return TOK::IN_TOK;
+		else if (theSession->cur_identifier == "if")
 			return TOK::IF_TOK;
-		else if (cur_identifier == "else")
+		else if (theSession->cur_identifier == "else")
 			return TOK::ELSE_TOK;
-		else if (cur_identifier == "then")
+		else if (theSession->cur_identifier == "then")
 			return TOK::THEN_TOK;
-		else if (cur_identifier == "for")
+		else if (theSession->cur_identifier == "for")
 			return TOK::FOR_TOK;
-		else if (cur_identifier == "unary")
+		else if (theSession->cur_identifier == "parfor")
+			return TOK::PARFOR_TOK;
+		else if (theSession->cur_identifier == "unary")
 			return TOK::UNARY_TOK;
-		else if (cur_identifier == "binary")
+		else if (theSession->cur_identifier == "binary")
 			return TOK::BINARY_TOK;
 		else
 			return TOK::IDENTIFIER_TOK;
 	}
 
 
-	if (isdigit(cur_char) || cur_char == '.'){
+	if (isdigit(theSession->cur_char) || theSession->cur_char == '.'){
 		std::string num_str;
 		int32_t is_double = 0;
 		do {
-			if (cur_char == '.'){
+			if (theSession->cur_char == '.'){
 				++is_double;
 			}
-			num_str += cur_char;
-			cur_char = advance(input);
-		} while (isdigit(cur_char) || cur_char == '.');
+			num_str += theSession->cur_char;
+			theSession->cur_char = advance(input);
+		} while (isdigit(theSession->cur_char) || theSession->cur_char == '.');
 
 		if (is_double == 0){
-			cur_integer = std::stoi(num_str);
+			theSession->cur_integer = std::stoi(num_str);
 			//std::cout << "current integer is "<< cur_integer << std::endl;
 			return TOK::INT_TOK;
 		}
 		else if (is_double == 1){
 			//std::cout << "current double is " << cur_double << std::endl;
-			cur_double = std::stod(num_str);
+			theSession->cur_double = std::stod(num_str);
 			return TOK::DOUBLE_TOK;
 		}
 		else{
-			fprintf(stderr, "Invalid number input\n");
+			KPP_LOG(LOG_ERROR, "Invalid number input");
 			return get_tok(input);
 		}
 	}
 
-	if (cur_char == '#'){
+	if (theSession->cur_char == '#'){
 		do {
-			cur_char = advance(input);
-		} while (cur_char != '\n' && cur_char != EOF && cur_char != '\r');
+			theSession->cur_char = advance(input);
+		} while (theSession->cur_char != '\n' && theSession->cur_char != EOF && theSession->cur_char != '\r');
 
-		if (cur_char != EOF)
+		if (theSession->cur_char != EOF)
 			return get_tok(input);
 	}
 
-	if (cur_char == EOF)
+	if (theSession->cur_char == EOF)
 		return TOK::EOF_TOK;
 
-	int32_t this_char = cur_char;
-	cur_char = advance(input);
+	int32_t this_char = theSession->cur_char;
+	theSession->cur_char = advance(input);
 
 	return this_char;
 }
 
+//read the rest of current line as raw text, used by the REPL commands
+static std::string get_line_rest(std::istream& input){
+	std::string line;
+	while (theSession->cur_char != '\n' && theSession->cur_char != '\r' && theSession->cur_char != EOF){
+		line += theSession->cur_char;
+		theSession->cur_char = advance(input);
+	}
+	theSession->cur_char = ' ';
+
+	size_t first = line.find_first_not_of(" \t");
+	if (first == std::string::npos)
+		return std::string();
+	return line.substr(first, line.find_last_not_of(" \t") - first + 1);
+}
+
 std::string get_tok_name(int32_t _tok){
 	switch (_tok)
 	{
@@ -203,7 +380,7 @@ std::string get_tok_name(int32_t _tok){
 	case TOK::DEF_TOK:
 		return "def";
 	case TOK::DOUBLE_TOK:
-		return std::to_string(cur_double);
+		return std::to_string(theSession->cur_double);
 	case TOK::ELSE_TOK:
 		return "else";
 	case TOK::EOF_TOK:
@@ -212,14 +389,16 @@ std::string get_tok_name(int32_t _tok){
 		return "extern";
 	case TOK::FOR_TOK:
 		return "for";
+	case TOK::PARFOR_TOK:
+		return "parfor";
 	case TOK::IDENTIFIER_TOK:
-		return cur_identifier;
+		return theSession->cur_identifier;
 	case TOK::IF_TOK:
 		return "if";
 	case TOK::IN_TOK:
 		return "in";
 	case TOK::INT_TOK:
-		return std::to_string(static_cast<int64_t>(cur_integer));
+		return std::to_string(static_cast<int64_t>(theSession->cur_integer));
 	case TOK::THEN_TOK:
 		return "then";
 	case TOK::UNARY_TOK:
@@ -234,23 +413,88 @@ std::string get_tok_name(int32_t _tok){
 
 
 
-ExprAST* Error(const char* mesg){
-	fprintf(stderr, "Error: %s\n", mesg);
+std::atomic<int> kpp_log_level(LOG_WARN);
+
+//an engine keeps what its session writes, see kpp::Engine::getOutput; the threads without a session write to stderr
+static bool capture_output(const char* text, size_t length){
+	if (!theSession || !theSession->capture_output)
+		return false;
+	std::lock_guard<std::mutex> lock(theSession->error_lock);
+	theSession->output.append(text, length);
+	return true;
+}
+
+void kpp_log(int level, const char* format, ...){
+	//a line is written at once, the lines of different threads do not mix
+	char line[1024];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line) - 1, format, args);
+	va_end(args);
+	if (length < 0)
+		return;
+	length = std::min(length, (int)sizeof(line) - 2);
+	line[length] = '\n';
+	if (!capture_output(line, length + 1))
+		fwrite(line, 1, length + 1, stderr);
+}
+
+//the output of the ':' commands and the statistics, to stderr or to the engine
+static void kpp_print(const char* format, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 1, 2)))
+#endif
+	;
+
+static void kpp_print(const char* format, ...){
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(nullptr, 0, format, args);
+	va_end(args);
+	if (length < 0)
+		return;
+	std::vector<char> text(length + 1);
+	va_start(args, format);
+	vsnprintf(text.data(), text.size(), format, args);
+	va_end(args);
+	if (!capture_output(text.data(), length))
+		fwrite(text.data(), 1, length, stderr);
+}
+
+static const char* log_level_names[] = { "off", "error", "warn", "info", "debug", "trace" };
+
+//the level of --log=<level> and :log <level>, -1 if there is none of that name
+static int parse_log_level(const std::string& name){
+	for (int level = LOG_OFF; level <= LOG_TRACE; ++level) {
+		if (name == log_level_names[level])
+			return level;
+	}
+	return -1;
+}
+
+
+ExprAST* ErrorE(const char* mesg){
+	KPP_LOG(LOG_ERROR, "Error: %s", mesg);
+	if (theSession){
+		std::lock_guard<std::mutex> lock(theSession->error_lock);
+		theSession->last_error = mesg;
+		++theSession->error_count;
+	}
 	return nullptr;
 }
 
 PrototypeAST* ErrorP(const char *mesg){
-	Error(mesg);
+	ErrorE(mesg);
 	return nullptr;
 }
 
 FunctionAST* ErrorF(const char* mesg){
-	Error(mesg);
+	ErrorE(mesg);
 	return nullptr;
 }
 
 Value* ErrorV(const char* mesg){
-	Error(mesg);
+	ErrorE(mesg);
 	return nullptr;
 }
 
@@ -260,8 +504,6 @@ namespace {
 	class ExprAST;
 	class Object;
 
-	static std::map<Object*, int32_t> exprast_pool;
-
 	class Object{
 	public:
 		virtual ~Object(){}
@@ -269,7 +511,11 @@ namespace {
 
 	//ASTڵ
 	class ExprAST : public Object{
+		SourceCodeLocation loc;		//of the token the parser was at when it made the node
 	public:
+		ExprAST() :loc(theSession->CurLoc){}
+		int getLine()const{ return loc.line; }
+		int getCol()const{ return loc.col; }
 		virtual Value *Codegen() = 0;
 	};
 
@@ -280,7 +526,7 @@ namespace {
 	public:
 		static DoubleValue* factory(double _x){
 			DoubleValue* ret = new DoubleValue(_x);
-			exprast_pool[ret] = 1;
+			theSession->exprast_pool[ret] = 1;
 			return ret;
 		}
 
@@ -295,7 +541,7 @@ namespace {
 	public:
 		static IntegerValue* factory(int32_t _x){
 			IntegerValue *ret = new IntegerValue(_x);
-			exprast_pool[ret] = 1;
+			theSession->exprast_pool[ret] = 1;
 			return ret;
 		}
 		Value* Codegen()override;
@@ -310,7 +556,7 @@ namespace {
 	public:
 		static VariableExprAST* factory(std::string _x){
 			VariableExprAST* ret = new VariableExprAST(_x);
-			exprast_pool[ret] = 1;
+			theSession->exprast_pool[ret] = 1;
 			return ret;
 		}
 		std::string getName()const { return name; }
@@ -318,6 +564,21 @@ namespace {
 	};
 
 
+	//a[index], NaN if index is out of the array
+	class ArrayIndexExprAST :public ExprAST{
+		std::string name;
+		ExprAST* index;
+		ArrayIndexExprAST(std::string _x, ExprAST* _y) :name(_x), index(_y){}
+	public:
+		static ArrayIndexExprAST* factory(std::string _x, ExprAST* _y){
+			ArrayIndexExprAST* ret = new ArrayIndexExprAST(_x, _y);
+			theSession->exprast_pool[ret] = 1;
+			return ret;
+		}
+		Value* Codegen()override;
+	};
+
+
 	//represent unary operation, contains unary operator and expression operand
 	class UnaryExpAST :public ExprAST{
 		char unary_op;
@@ -326,7 +587,7 @@ namespace {
 	public:
 		static UnaryExpAST* factory(char _x, ExprAST* _y){
 			UnaryExpAST* ret = new UnaryExpAST(_x, _y);
-			exprast_pool[ret] = 1;
+			theSession->exprast_pool[ret] = 1;
 			return ret;
 		}
 		Value* Codegen()override;
@@ -341,7 +602,7 @@ namespace {
 	public:
 		static BinaryExprAST* factory(char _x, ExprAST* _y, ExprAST* _z){
 			BinaryExprAST* ret = new BinaryExprAST(_x, _y, _z);
-			exprast_pool[ret] = 1;
+			theSession->exprast_pool[ret] = 1;
 			return ret;
 		}
 		Value* Codegen()override;
@@ -355,7 +616,7 @@ namespace {
 	public:
 		static CallExprAST* factory(std::string _x, const std::vector<ExprAST*>& _y){
 			CallExprAST* ret = new CallExprAST(_x, _y);
-			exprast_pool[ret] = 1;
+			theSession->exprast_pool[ret] = 1;
 			return ret;
 		}
 		Value* Codegen()override;
@@ -367,7 +628,7 @@ namespace {
 	public:
 		static IfExprAST* factory(ExprAST* _x, ExprAST* _y, ExprAST* _z){
 			IfExprAST* ret = new IfExprAST(_x, _y, _z);
-			exprast_pool[ret] = 1;
+			theSession->exprast_pool[ret] = 1;
 			return ret;
 		}
 		Value* Codegen()override;
@@ -380,7 +641,34 @@ namespace {
 	public:
 		static ForExprAST* factory(std::string _name, ExprAST* _x, ExprAST* _y, ExprAST* _z, ExprAST* _w){
 			ForExprAST* ret = new ForExprAST(_name, _x, _y, _z, _w);
-			exprast_pool[ret] = 1;
+			theSession->exprast_pool[ret] = 1;
+			return ret;
+		}
+		Value* Codegen()override;
+	};
+
+	//the reduction of a parfor loop, the same numbers are passed to kpp_parfor
+	enum ParforReduction{
+		PARFOR_NONE,
+		PARFOR_ADD,
+		PARFOR_MUL,
+		PARFOR_MIN,
+		PARFOR_MAX,
+	};
+
+	//parfor i = start, end [reduce op] in body
+	//body is outlined into <function>.parfor(double* env, i64 begin, i64 end), run over [begin, end) by kpp_parfor
+	class ParForExprAST :public ExprAST{
+		std::string var_name;
+		ExprAST* start, *end, *body;
+		ParforReduction reduction;
+		ParForExprAST(std::string _name, ExprAST* _x, ExprAST* _y, ExprAST* _z, ParforReduction _r) : var_name(_name), start(_x), end(_y), body(_z), reduction(_r){}
+
+		Function* createBody(const std::vector<std::pair<std::string, AllocaInst*>>& captured);
+	public:
+		static ParForExprAST* factory(std::string _name, ExprAST* _x, ExprAST* _y, ExprAST* _z, ParforReduction _r){
+			ParForExprAST* ret = new ParForExprAST(_name, _x, _y, _z, _r);
+			theSession->exprast_pool[ret] = 1;
 			return ret;
 		}
 		Value* Codegen()override;
@@ -393,7 +681,7 @@ namespace {
 	public:
 		static VarExprAST* factory(const std::vector<std::pair<std::string, ExprAST*>>& _x, ExprAST* _y){
 			VarExprAST* ret = new VarExprAST(_x, _y);
-			exprast_pool[ret] = 1;
+			theSession->exprast_pool[ret] = 1;
 			return ret;
 		}
 		Value* Codegen()override;
@@ -405,19 +693,24 @@ namespace {
 		std::vector<std::string> func_args;
 		int32_t is_operator;	//whether is a function or unary operator or binary operator
 		int32_t precedence;
+		int line;
 
-		PrototypeAST(std::string _name, const std::vector<std::string> _args, int32_t _x, int32_t _y) :func_name(_name), func_args(_args), is_operator(_x), precedence(_y){}
+		PrototypeAST(std::string _name, const std::vector<std::string> _args, int32_t _x, int32_t _y) :func_name(_name), func_args(_args), is_operator(_x), precedence(_y),
+			line(theSession->CurLoc.line){}
 
 	public:
 		static PrototypeAST* factory(std::string _name, const std::vector<std::string> _args, int32_t _x = 0, int32_t _y = 0){
 			PrototypeAST* ret = new PrototypeAST(_name, _args, _x, _y);
-			exprast_pool[ret] = 1;
+			theSession->exprast_pool[ret] = 1;
 			return ret;
 		}
 
 		bool isUnary()const{ return is_operator == 1; }
 		bool isBinary()const{ return is_operator == 2; }
 		bool isFunction()const{ return !is_operator; }
+		const std::string& getName()const{ return func_name; }
+		size_t getArgCount()const{ return func_args.size(); }
+		int getLine()const{ return line; }
 
 		char getOperatorName()const{
 			assert(isUnary() || isBinary());
@@ -443,1358 +736,6641 @@ namespace {
 
 		static FunctionAST* factory(PrototypeAST* _x, ExprAST* _y){
 			FunctionAST* ret = new FunctionAST(_x, _y);
-			exprast_pool[ret] = 1;
+			theSession->exprast_pool[ret] = 1;
 			return ret;
 		}
 
+		PrototypeAST* getPrototype()const{ return func_proto; }
 		Function* Codegen();
 	};
 
 
-	class MCJITHelper{
-	protected:
-		typedef std::vector<ExecutionEngine*> EngineVecType;
-		typedef std::vector<Module*> ModuleVecType;
-
-	private:
-		LLVMContext& context;
-		Module* openModule;
-		EngineVecType engines;
-		ModuleVecType modules;
+	//target of the session, used by the optimizer, the JIT, the AOT compiler and every module
+	//the host triple, CPU and features by default, --mcpu and --mattr override them
+	struct TargetSpec{
+		std::string triple;
+		std::string cpu;
+		std::string features;
 
-	public:
-		MCJITHelper(LLVMContext& ctx) :context(ctx), openModule(nullptr){}
-		Module* getModuleForNewFunction();
-		Function* getFunction(const std::string& name);
-		void* getPointerToFunction(Function* func);
-		void* getSymbolAddress(const std::string& name);
-		void dump();
+		TargetSpec(const std::string& mcpu = "", const std::string& mattr = "");
+		orc::JITTargetMachineBuilder getJITTargetMachineBuilder()const;
 	};
 
-	class HelpingMemoryManage : public SectionMemoryManager{
-		HelpingMemoryManage(const HelpingMemoryManage&) = delete;
-		void operator=(const HelpingMemoryManage&) = delete;
 
-		MCJITHelper* jithelper;
+	TargetSpec::TargetSpec(const std::string& mcpu, const std::string& mattr) :triple(sys::getProcessTriple()){
+		std::vector<std::string> feature_list;
+
+		//the host features only describe the host CPU
+		if (mcpu.empty() || mcpu == "native"){
+			cpu = sys::getHostCPUName().str();
+			StringMap<bool> host_features;
+			if (sys::getHostCPUFeatures(host_features)){
+				for (auto& kv : host_features) {
+					feature_list.push_back((kv.second ? "+" : "-") + kv.first().str());
+				}
+			}
+			//StringMap has no stable order, and the string is part of the object cache key
+			std::sort(feature_list.begin(), feature_list.end());
+		}
+		else{
+			cpu = mcpu;
+		}
+
+		//--mattr=+avx2,-fma, later features override earlier ones
+		SmallVector<StringRef, 8> attrs;
+		StringRef(mattr).split(attrs, ',', -1, false);
+		for (StringRef attr : attrs) {
+			attr = attr.trim();
+			feature_list.push_back(attr.startswith("+") || attr.startswith("-") ? attr.str() : "+" + attr.str());
+		}
+
+		for (size_t i = 0; i != feature_list.size(); ++i) {
+			features += (i ? "," : "") + feature_list[i];
+		}
+	}
+
+	orc::JITTargetMachineBuilder TargetSpec::getJITTargetMachineBuilder()const{
+		orc::JITTargetMachineBuilder jtmb((Triple(triple)));
+		jtmb.setCPU(cpu);
+		jtmb.getFeatures() = SubtargetFeatures(features);
+		return jtmb;
+	}
 
-	public:
-		HelpingMemoryManage(MCJITHelper* given_helper) :jithelper(given_helper){}
-		//jithelperָڴ沢HelpingMemoryManage
-		~HelpingMemoryManage() override{};
 
-		//SectionMemoryManagegetSymbolAddressʱǶHelpingMemoryManageModuleSymbol
-		//ĬϵSectionMemoryManageûҵñʾͨjithelperָMCJITHelperenginers
-		uint64_t getSymbolAddress(const std::string& name) override;
+	//--stats and --trace=<file>: the time of every compile phase of every definition, and of every LLVM pass
+	//the parse phase includes the lexer; in lazy mode lookup and run include the compilation they wait for
+	enum CompilePhase{
+		PHASE_PARSE,
+		PHASE_CODEGEN,
+		PHASE_OPTIMIZE,
+		PHASE_EMIT,			//machine code, or the object from the cache
+		PHASE_LINK,			//RuntimeDyld loads, relocates and finalizes the object
+		PHASE_LOOKUP,
+		PHASE_RUN,			//the top-level expressions
+		PHASE_COUNT,
 	};
 
+	static const char* phase_names[PHASE_COUNT] = { "parse", "codegen", "optimize", "emit", "link", "lookup", "run" };
+
+	class CompileStats{
+		struct Totals{
+			uint64_t count;
+			double total_us;
+			double max_us;
+			Totals() :count(0), total_us(0), max_us(0){}
+			void add(double us){ ++count; total_us += us; max_us = std::max(max_us, us); }
+		};
+
+		//a complete event of the Chrome trace format
+		struct TraceEvent{
+			std::string name;
+			const char* category;
+			double begin_us;
+			double duration_us;
+			unsigned tid;
+		};
+
+		static const size_t max_events = 1 << 20;
+
+		std::chrono::steady_clock::time_point origin;
+		bool tracing;
+		std::mutex mutex;
+		Totals phases[PHASE_COUNT];
+		std::map<std::string, Totals> passes;
+		std::map<std::string, double> definitions;	//parse to link, per definition
+		std::vector<TraceEvent> events;
+		uint64_t dropped_events;
+
+		void addEvent(const std::string& name, const char* category, double begin_us, double end_us);
 
-	uint64_t HelpingMemoryManage::getSymbolAddress(const std::string& name){
-		uint64_t address = SectionMemoryManager::getSymbolAddress(name);
+	public:
+		explicit CompileStats(bool trace) :origin(std::chrono::steady_clock::now()), tracing(trace), dropped_events(0){}
+		//microseconds since the start
+		double now()const{ return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count(); }
+		void record(CompilePhase phase, const std::string& name, double begin_us, double end_us);
+		void recordPass(const std::string& pass, double begin_us, double end_us);
+		void print();
+		void reset();
+		bool writeTrace(const std::string& path);
+	};
 
-		if (address) return address;
+	//nullptr unless --stats or --trace, the timers cost a test of it then
+	static CompileStats* compile_stats = nullptr;
 
-		address = (uint64_t)this->jithelper->getSymbolAddress(name);
+	//the thread ids of the trace
+	static unsigned get_trace_tid(){
+		static std::atomic<unsigned> next_tid(0);
+		static thread_local unsigned tid = ++next_tid;
+		return tid;
+	}
 
-		if (address){
-			return address;
+	void CompileStats::addEvent(const std::string& name, const char* category, double begin_us, double end_us){
+		if (events.size() >= max_events){
+			++dropped_events;
+			return;
 		}
-		else
-			return 0;
+		events.push_back(TraceEvent{ name, category, begin_us, end_us - begin_us, get_trace_tid() });
 	}
 
+	void CompileStats::record(CompilePhase phase, const std::string& name, double begin_us, double end_us){
+		std::lock_guard<std::mutex> lock(mutex);
+		phases[phase].add(end_us - begin_us);
+		if (phase <= PHASE_LINK && !name.empty())
+			definitions[name] += end_us - begin_us;
+		if (tracing)
+			addEvent(name.empty() ? phase_names[phase] : phase_names[phase] + (" " + name), phase_names[phase], begin_us, end_us);
+	}
 
-	Module* MCJITHelper::getModuleForNewFunction(){
-		if (this->openModule)
-			return this->openModule;
-
-		std::string module_name = getUniqueMCJITName("cool_mcjit_module_");
-
-		Module* newModule = new Module(module_name, context);
-		/////////////////////////////////////////////////////////////////////////
-		//****************************** ƽ̨趨 ************************
-		//ԭʼtargettripleΪi686-pc-windows-msvc
-		//The PassManager::run call causes the MC code generation mechanisms to emit a complete relocatable binary object image (either in either ELF or MachO format, depending on the target)
-		//ͨmcjitУҪ趨ɵĿضλĿΪelf
-		//////////////////////////////////////////////////////////////////////////
-		newModule->setTargetTriple("i686-pc-windows-msvc-elf");
-		modules.push_back(newModule);
-		openModule = newModule;
-		return openModule;
+	void CompileStats::recordPass(const std::string& pass, double begin_us, double end_us){
+		std::lock_guard<std::mutex> lock(mutex);
+		passes[pass].add(end_us - begin_us);
+		if (tracing)
+			addEvent(pass, "pass", begin_us, end_us);
 	}
 
-	//еmoduleвָʾFuntion*;
-	Function* MCJITHelper::getFunction(const std::string& name){
-		std::cout << "All the functions in the modules vector" << std::endl;
-		for (auto mod_ptr : this->modules) {
-			for (auto iter = mod_ptr->begin(); iter != mod_ptr->end(); ++iter) {
-				auto strRef = (*iter).getName();
-				std::cout << std::string(strRef.data(), strRef.size()) << " ";
-			}
+	void CompileStats::print(){
+		std::lock_guard<std::mutex> lock(mutex);
+		kpp_print("%-10s %8s %12s %10s %10s\n", "phase", "count", "total ms", "mean us", "max us");
+		for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+			const Totals& totals = phases[phase];
+			kpp_print("%-10s %8llu %12.3f %10.1f %10.1f\n", phase_names[phase], (unsigned long long)totals.count,
+				totals.total_us / 1000, totals.count ? totals.total_us / totals.count : 0.0, totals.max_us);
+		}
 
+		//the 10 slowest passes and definitions
+		std::vector<std::pair<double, const std::string*>> slowest;
+		for (auto& kv : passes) {
+			slowest.push_back(std::make_pair(kv.second.total_us, &kv.first));
+		}
+		std::sort(slowest.rbegin(), slowest.rend());
+		if (!slowest.empty())
+			kpp_print("passes:\n");
+		for (size_t i = 0; i < slowest.size() && i < 10; ++i) {
+			const Totals& totals = passes[*slowest[i].second];
+			kpp_print("  %-40s %8llu runs %10.3f ms\n", slowest[i].second->c_str(), (unsigned long long)totals.count, totals.total_us / 1000);
 		}
-		DEBUG_CERR("Function in modules traverse complete\n");
 
+		slowest.clear();
+		for (auto& kv : definitions) {
+			slowest.push_back(std::make_pair(kv.second, &kv.first));
+		}
+		std::sort(slowest.rbegin(), slowest.rend());
+		if (!slowest.empty())
+			kpp_print("definitions:\n");
+		for (size_t i = 0; i < slowest.size() && i < 10; ++i) {
+			kpp_print("  %-40s %10.3f ms\n", slowest[i].second->c_str(), slowest[i].first / 1000);
+		}
+		if (dropped_events)
+			kpp_print("%llu trace events dropped\n", (unsigned long long)dropped_events);
+	}
 
-		auto from = modules.begin(), to = modules.end();
-		while (from != to) {
-			Function* find_func = (*from)->getFunction(name);
-			fprintf(stderr, "find the position %d for function %s\n", find_func, name.c_str());
-			fprintf(stderr, "openModule is %d\n", openModule);
-			fprintf(stderr, "current Module is %d\n", (*from));
-			if (find_func){
-				if (*from == openModule){
-					return find_func;
-				}
-				assert(openModule != nullptr);
+	void CompileStats::reset(){
+		std::lock_guard<std::mutex> lock(mutex);
+		for (Totals& totals : phases) {
+			totals = Totals();
+		}
+		passes.clear();
+		definitions.clear();
+	}
 
-				Function* pf = openModule->getFunction(name);
+	//the JSON of chrome://tracing and Perfetto
+	bool CompileStats::writeTrace(const std::string& path){
+		std::error_code ec;
+		raw_fd_ostream out(path, ec, sys::fs::OF_Text);
+		if (ec){
+			KPP_LOG(LOG_ERROR, "Could not open %s: %s", path.c_str(), ec.message().c_str());
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		out << "{\"traceEvents\":[\n";
+		for (size_t i = 0; i < events.size(); ++i) {
+			const TraceEvent& event = events[i];
+			out << (i ? ",\n" : "") << "{\"name\":\"";
+			printEscapedString(event.name, out);
+			out << "\",\"cat\":\"" << event.category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.tid
+				<< ",\"ts\":" << format("%.3f", event.begin_us) << ",\"dur\":" << format("%.3f", event.duration_us) << "}";
+		}
+		out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+		KPP_LOG(LOG_INFO, "%zu trace events written to %s", events.size(), path.c_str());
+		return !out.has_error();
+	}
 
-				//ض
-				if (pf && !pf->empty()){
-					ErrorV("redefinition of function across modules");
-					return nullptr;
-				}
+	//times a phase until the end of the scope or stop
+	class PhaseTimer{
+		CompilePhase phase;
+		std::string name;
+		double begin_us;
+		bool running;
 
-				//
-				if (!pf){
-					fprintf(stderr, "creating ExternalLinkage for function %s\n", name.c_str());
-					pf = Function::Create(find_func->getFunctionType(), Function::ExternalLinkage, name, openModule);
-					return pf;
-				}
+	public:
+		explicit PhaseTimer(CompilePhase _phase, StringRef _name = StringRef()) :phase(_phase), begin_us(0), running(compile_stats != nullptr){
+			if (running){
+				name = _name.str();
+				begin_us = compile_stats->now();
 			}
-			++from;
 		}
+		~PhaseTimer(){ stop(); }
+		//a definition is named once it is parsed
+		void setName(StringRef _name){
+			if (running)
+				name = _name.str();
+		}
+		void stop(){
+			if (running)
+				compile_stats->record(phase, name, begin_us, compile_stats->now());
+			running = false;
+		}
+	};
 
-		fprintf(stderr, "Could not find the function %s \n", name.c_str());
-		return nullptr;
+	//the defined functions of a module for the timers, the first one and how many others
+	//the top-level expressions are counted together as <expressions>
+	static std::string describe_module(const Module& module){
+		std::string name;
+		unsigned others = 0;
+		for (const Function& func : module) {
+			if (func.isDeclaration() || func.hasLocalLinkage() || func.getName().startswith("anony_"))
+				continue;
+			if (name.empty())
+				name = func.getName().str();
+			else
+				++others;
+		}
+		if (name.empty())
+			return "<expressions>";
+		if (others)
+			name += " +" + std::to_string(others);
+		return name;
 	}
 
-	void* MCJITHelper::getPointerToFunction(Function* func){
-		auto from = engines.begin(), to = engines.end();
 
-		//ǷѾJIT
-		while (from != to) {
-			void* func_ptr = (void*)(*from)->getFunctionAddress(func->getName());
-			if (func_ptr){
-				return func_ptr;
-			}
+	//the emit phase of --stats, the link phase runs from the end of emit to the NotifyEmitted of the object layer
+	//the object layer links an object on the thread that compiled it
+	class TimedIRCompiler : public orc::IRCompileLayer::IRCompiler{
+		std::unique_ptr<orc::IRCompileLayer::IRCompiler> compiler;
+
+		struct PendingLink{
+			std::string name;
+			double begin_us;
+			bool pending;
+		};
+		static thread_local PendingLink pending_link;
+
+	public:
+		explicit TimedIRCompiler(std::unique_ptr<orc::IRCompileLayer::IRCompiler> _compiler)
+			:IRCompiler(_compiler->getManglingOptions()), compiler(std::move(_compiler)){}
+
+		Expected<std::unique_ptr<MemoryBuffer>> operator()(Module& M)override{
+			std::string name = describe_module(M);
+			double begin_us = compile_stats->now();
+			auto obj = (*compiler)(M);
+			double end_us = compile_stats->now();
+			compile_stats->record(PHASE_EMIT, name, begin_us, end_us);
+			pending_link = PendingLink{ std::move(name), end_us, true };
+			return obj;
+		}
+
+		static void linked(){
+			if (!pending_link.pending)
+				return;
+			compile_stats->record(PHASE_LINK, pending_link.name, pending_link.begin_us, compile_stats->now());
+			pending_link.pending = false;
 		}
+	};
 
-		//ûenginesҵڽopenModule JIT,ȻнѰ
+	thread_local TimedIRCompiler::PendingLink TimedIRCompiler::pending_link;
 
-		if (openModule){
-			//ExcutionEngineʧܵԭ
-			std::string Errstr;
-			ExecutionEngine *newEngine
-				= EngineBuilder(std::unique_ptr <Module>(openModule))
-				.setErrorStr(&Errstr)
-				.setMCJITMemoryManager(std::unique_ptr<HelpingMemoryManage>(new HelpingMemoryManage(this))).create();
-
-			//ʧ
-			if (!newEngine){
-				fprintf(stderr, "Could not creat ExecutionEngine %s\n", Errstr.c_str());
-				return nullptr;
-			}
 
-			//ExcutionEngineɹ򴴽һFunctionPassManageopenModuleڵFunctionŻݸµExcutionEngine
-			auto *theFpm = new legacy::FunctionPassManager(openModule);
-			//typename legacy::FunctionPassManager *current_fpm = new legacy::FunctionPassManager(openModule);
+	//one copy of the pass pipeline
+	//a PassBuilder and its analysis managers are not thread safe, every compile thread optimizes with its own copy
+	class PipelineInstance{
+		PassInstrumentationCallbacks PIC;	//the pass timers of --stats
+		std::unique_ptr<TargetMachine> target_machine;
+		std::unique_ptr<PassBuilder> pass_builder;
+
+		LoopAnalysisManager LAM;
+		FunctionAnalysisManager FAM;
+		CGSCCAnalysisManager CGAM;
+		ModuleAnalysisManager MAM;
+		ModulePassManager MPM;
 
-			//趨Ż
-			//openModulefunctionPassManagenewEngine
-			openModule->setDataLayout(newEngine->getDataLayout());
+		unsigned generation;	//generation of the OptPipeline settings MPM was built for
+
+	public:
+		PipelineInstance(const TargetSpec& spec);
+		unsigned getGeneration()const{ return generation; }
+		bool build(unsigned opt_level, const std::string& custom_pipeline, CodeGenOpt::Level cg_level, unsigned gen);
+		void run(Module* module);
+	};
 
-			theFpm->add(createBasicAliasAnalysisPass());
 
-			theFpm->add(createPromoteMemoryToRegisterPass());
+	//pass managers and adaptors are not timed, only the passes they run
+	static bool is_timed_pass(StringRef pass){
+		static const std::vector<StringRef> containers = { "PassManager", "PassAdaptor", "AnalysisManagerProxy", "DevirtSCCRepeatedPass", "ModuleInlinerWrapperPass" };
+		return !isSpecialPass(pass, containers);
+	}
 
-			theFpm->add(createInstructionCombiningPass());
+	static void register_pass_timers(PassInstrumentationCallbacks& PIC){
+		//the passes of a thread nest, a function pass runs inside a module pass of the same thread
+		static thread_local std::vector<double> begin_stack;
+		PIC.registerBeforeNonSkippedPassCallback([](StringRef pass, Any IR){
+			if (is_timed_pass(pass))
+				begin_stack.push_back(compile_stats->now());
+		});
+		auto after = [](StringRef pass){
+			if (!is_timed_pass(pass) || begin_stack.empty())
+				return;
+			compile_stats->recordPass(pass.str(), begin_stack.back(), compile_stats->now());
+			begin_stack.pop_back();
+		};
+		PIC.registerAfterPassCallback([after](StringRef pass, Any IR, const PreservedAnalyses&){ after(pass); });
+		PIC.registerAfterPassInvalidatedCallback([after](StringRef pass, const PreservedAnalyses&){ after(pass); });
+	}
 
-			theFpm->add(createReassociatePass());
+	PipelineInstance::PipelineInstance(const TargetSpec& spec) :generation(0){
+		auto tm = spec.getJITTargetMachineBuilder().createTargetMachine();
+		if (tm)
+			target_machine = std::move(*tm);
+		else
+			KPP_LOG(LOG_ERROR, "Could not create the target machine: %s", toString(tm.takeError()).c_str());
+		if (compile_stats)
+			register_pass_timers(PIC);
+		pass_builder.reset(new PassBuilder(target_machine.get(), PipelineTuningOptions(), None, &PIC));
+
+		pass_builder->registerModuleAnalyses(MAM);
+		pass_builder->registerCGSCCAnalyses(CGAM);
+		pass_builder->registerFunctionAnalyses(FAM);
+		pass_builder->registerLoopAnalyses(LAM);
+		pass_builder->crossRegisterProxies(LAM, FAM, CGAM, MAM);
+	}
 
-			theFpm->add(createCFGSimplificationPass());
-			theFpm->doInitialization();
+	bool PipelineInstance::build(unsigned opt_level, const std::string& custom_pipeline, CodeGenOpt::Level cg_level, unsigned gen){
+		ModulePassManager new_mpm;
 
-			auto last = openModule->end();
-			for (auto it = openModule->begin(); it != last; ++it) {
-				theFpm->run(*it);
+		if (!custom_pipeline.empty()){
+			if (auto err = pass_builder->parsePassPipeline(new_mpm, custom_pipeline)){
+				KPP_LOG(LOG_ERROR, "Invalid pass pipeline '%s': %s", custom_pipeline.c_str(), toString(std::move(err)).c_str());
+				return false;
+			}
+		}
+		else{
+			switch (opt_level)
+			{
+			case 0:
+				new_mpm = pass_builder->buildO0DefaultPipeline(OptimizationLevel::O0);
+				break;
+			case 1:
+				new_mpm = pass_builder->buildPerModuleDefaultPipeline(OptimizationLevel::O1);
+				break;
+			case 2:
+				new_mpm = pass_builder->buildPerModuleDefaultPipeline(OptimizationLevel::O2);
+				break;
+			default:
+				new_mpm = pass_builder->buildPerModuleDefaultPipeline(OptimizationLevel::O3);
+				break;
 			}
+		}
+
+		MPM = std::move(new_mpm);
+		if (target_machine)
+			target_machine->setOptLevel(cg_level);
+		generation = gen;
+		return true;
+	}
+
+	void PipelineInstance::run(Module* module){
+		PhaseTimer timer(PHASE_OPTIMIZE);
+		if (compile_stats)
+			timer.setName(describe_module(*module));
+		MPM.run(*module, MAM);
+
+		//cached analysis results are keyed by the IR unit, drop them before the module is handed to the JIT
+		LAM.clear();
+		FAM.clear();
+		CGAM.clear();
+		MAM.clear();
+	}
+
+
+	//optimization pipeline of the session, shared by every module
+	//the settings are kept here, the pipeline itself is built by PassBuilder in a PipelineInstance
+	//a thread running the pipeline takes an idle instance, so the compile threads optimize in parallel
+	//an instance is rebuilt only when the level or the custom pipeline has changed since it was built
+	class OptPipeline{
+		TargetSpec target;
+		std::atomic<unsigned> opt_level;	//read by the compilers of the JIT threads
+		std::string custom_pipeline;	//textual pipeline, overrides opt_level when not empty
+		unsigned generation;			//incremented when the settings change
+
+		std::mutex mutex;
+		std::vector<std::unique_ptr<PipelineInstance>> idle_instances;
+
+		std::unique_ptr<PipelineInstance> acquireInstance();
+		void releaseInstance(std::unique_ptr<PipelineInstance> instance);
+		bool updateSettings(unsigned level, const std::string& pipeline);
+
+	public:
+		OptPipeline(unsigned level, const TargetSpec& spec);
+		const TargetSpec& getTarget()const{ return target; }
+		unsigned getVectorBitWidth()const;
+		bool setOptLevel(unsigned level);
+		bool setCustomPipeline(const std::string& pipeline);
+		unsigned getOptLevel()const{ return opt_level; }
+		const std::string& getCustomPipeline()const{ return custom_pipeline; }
+		CodeGenOpt::Level getCodeGenOptLevel()const;
+		void run(Module* module);
+	};
 
-			//ǹڶڴеģ
-			delete theFpm;
 
-			//еopenModuleеFunctionѾŻעᵽnewEngineˣ
-			openModule = nullptr;
+	OptPipeline::OptPipeline(unsigned level, const TargetSpec& spec) :target(spec), opt_level(level > 3 ? 2 : level), generation(1){
+		//build the first instance at once, the REPL would pay for it at the first definition otherwise
+		releaseInstance(acquireInstance());
+	}
 
-			engines.push_back(newEngine);
-			newEngine->finalizeObject();
-			return (void*)newEngine->getFunctionAddress(func->getName());
+	std::unique_ptr<PipelineInstance> OptPipeline::acquireInstance(){
+		std::lock_guard<std::mutex> lock(mutex);
+		std::unique_ptr<PipelineInstance> instance;
+		if (idle_instances.empty()){
+			instance.reset(new PipelineInstance(target));
 		}
-		return nullptr;
+		else{
+			instance = std::move(idle_instances.back());
+			idle_instances.pop_back();
+		}
+		if (instance->getGeneration() != generation)
+			instance->build(opt_level, custom_pipeline, getCodeGenOptLevel(), generation);
+		return instance;
 	}
 
-	void* MCJITHelper::getSymbolAddress(const std::string& name){
-		auto from = engines.begin(), to = engines.end();
+	void OptPipeline::releaseInstance(std::unique_ptr<PipelineInstance> instance){
+		std::lock_guard<std::mutex> lock(mutex);
+		idle_instances.push_back(std::move(instance));
+	}
 
-		while (from != to) {
-			void* func_address = (void*)(*from)->getFunctionAddress(name);
-			if (func_address){
-				return func_address;
-			}
-			++from;
+	//the new settings are checked by building an instance with them, the old ones are kept if that fails
+	bool OptPipeline::updateSettings(unsigned level, const std::string& pipeline){
+		std::unique_ptr<PipelineInstance> instance = acquireInstance();
+		std::lock_guard<std::mutex> lock(mutex);
+		unsigned old_level = opt_level;
+		opt_level = level;
+		bool valid = instance->build(level, pipeline, getCodeGenOptLevel(), generation + 1);
+		if (valid){
+			custom_pipeline = pipeline;
+			++generation;
 		}
-		return nullptr;
+		else{
+			opt_level = old_level;
+		}
+		idle_instances.push_back(std::move(instance));
+		return valid;
 	}
 
-	void MCJITHelper::dump(){
-		for (auto module_ptr : modules) {
-			module_ptr->dump();
+	bool OptPipeline::setOptLevel(unsigned level){
+		if (level > 3){
+			ErrorE("optimization level must be in 0-3");
+			return false;
 		}
+		return updateSettings(level, "");
 	}
 
-}
-//end anonymous namespace
+	bool OptPipeline::setCustomPipeline(const std::string& pipeline){
+		return updateSettings(opt_level, pipeline);
+	}
 
+	CodeGenOpt::Level OptPipeline::getCodeGenOptLevel()const{
+		switch (opt_level)
+		{
+		case 0:
+			return CodeGenOpt::None;
+		case 1:
+			return CodeGenOpt::Less;
+		case 2:
+			return CodeGenOpt::Default;
+		default:
+			return CodeGenOpt::Aggressive;
+		}
+	}
 
-//****************************************
-//GlobalVariabls for llvm
-//****************************************
+	//width of the vector registers the vectorizers target, 0 if unknown
+	unsigned OptPipeline::getVectorBitWidth()const{
+		auto target_machine = target.getJITTargetMachineBuilder().createTargetMachine();
+		if (!target_machine){
+			consumeError(target_machine.takeError());
+			return 0;
+		}
 
-static Module *TheModule;
-static IRBuilder<> Builder(getGlobalContext());
-static std::map<std::string, AllocaInst*> namedValues;
-static legacy::FunctionPassManager *TheFuncPM;
-static ExecutionEngine *TheExecutionEngine;
-static MCJITHelper* theHelper;
+		LLVMContext probe_context;
+		Module probe_module("vector_width_probe", probe_context);
+		Function* probe = Function::Create(FunctionType::get(Type::getVoidTy(probe_context), false),
+			Function::ExternalLinkage, "probe", &probe_module);
+		TargetTransformInfo tti = (*target_machine)->getTargetTransformInfo(*probe);
+		return (unsigned)tti.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector).getFixedSize();
+	}
 
+	void OptPipeline::run(Module* module){
+		std::unique_ptr<PipelineInstance> instance = acquireInstance();
+		instance->run(module);
+		releaseInstance(std::move(instance));
+	}
 
 
+	//the compiler of the JIT, at the codegen level of the current optimization level, so :opt changes both
+	//the hot modules of --pgo, optimized at -O3, are compiled at the aggressive level
+	//the level is recorded in the module as the kpp.codegen flag, the object cache keeps the objects of each level apart
+	class LeveledIRCompiler : public orc::IRCompileLayer::IRCompiler{
+		orc::JITTargetMachineBuilder builder;
+		const OptPipeline* pipeline;
+		ObjectCache* cache;
+		std::unique_ptr<TargetMachine> target_machine;	//null with compile threads, they can not share one
+		std::mutex target_mutex;	//lazy compilation runs on the thread calling the function, the threads of an engine's host too
 
-/******************************************************/
-/*******************   Parser *************************/
-/******************************************************/
-int32_t get_next_tok(std::istream& input){
-	cur_tok = get_tok(input);
-	DEBUG_TOKEN(get_tok_name(cur_tok));
-	return cur_tok;
-}
+	public:
+		LeveledIRCompiler(orc::JITTargetMachineBuilder _builder, const OptPipeline* _pipeline, ObjectCache* _cache, std::unique_ptr<TargetMachine> tm)
+			:IRCompiler(orc::irManglingOptionsFromTargetOptions(_builder.getOptions())), builder(std::move(_builder)), pipeline(_pipeline),
+			cache(_cache), target_machine(std::move(tm)){}
 
-static std::map<char, int32_t> binary_op_precedence;
+		Expected<std::unique_ptr<MemoryBuffer>> operator()(Module& M)override;
+	};
 
-static int32_t get_precedence(char bi_op){
-	//printf("%d\n", bi_op);
-	//assert(isascii(bi_op));
-	int32_t precedence = binary_op_precedence[bi_op];
-	if (precedence <= 0){
-		return -1;
+	Expected<std::unique_ptr<MemoryBuffer>> LeveledIRCompiler::operator()(Module& M){
+		CodeGenOpt::Level level = M.getModuleFlag("kpp.hot") ? CodeGenOpt::Aggressive : pipeline->getCodeGenOptLevel();
+		M.addModuleFlag(Module::Warning, "kpp.codegen", (uint32_t)level);
+		if (!target_machine){
+			orc::JITTargetMachineBuilder leveled(builder);
+			leveled.setCodeGenOptLevel(level);
+			return orc::ConcurrentIRCompiler(std::move(leveled), cache)(M);
+		}
+		std::lock_guard<std::mutex> lock(target_mutex);
+		target_machine->setOptLevel(level);
+		return orc::SimpleCompiler(*target_machine, cache)(M);
 	}
-	return precedence;
-}
 
 
+	//resolve the symbols of the host process, including the ones registered by sys::DynamicLibrary::AddSymbol
+	class ProcessSymbolGenerator : public orc::DefinitionGenerator{
+	public:
+		Error tryToGenerate(orc::LookupState& LS, orc::LookupKind K, orc::JITDylib& JD,
+			orc::JITDylibLookupFlags JDLookupFlags, const orc::SymbolLookupSet& symbols) override;
+	};
 
-static FunctionAST* ParseToplevelExpr(std::istream& input);
-static ExprAST* ParseExpression(std::istream& input);
-static PrototypeAST* ParseExtern(std::istream& input);
-static ExprAST* ParseIdentifierExpr(std::istream& input);
-static ExprAST* ParseUnary(std::istream& input);
-static ExprAST* ParseBinaryopRHS(std::istream& input, int32_t expr_prec, ExprAST* lhs);
-static ExprAST* ParsePrimary(std::istream& input);
-static ExprAST* ParseVarExpr(std::istream& input);
-static ExprAST* ParseForExpr(std::istream& input);
-static ExprAST* ParseIfExpr(std::istream& input);
-static ExprAST* ParseNumber(std::istream& input);
-static ExprAST* ParseParenExpr(std::istream& input);
+	Error ProcessSymbolGenerator::tryToGenerate(orc::LookupState& LS, orc::LookupKind K, orc::JITDylib& JD,
+		orc::JITDylibLookupFlags JDLookupFlags, const orc::SymbolLookupSet& symbols){
+		orc::SymbolMap new_symbols;
+		for (auto& kv : symbols) {
+			StringRef name = *kv.first;
+			if (void* address = sys::DynamicLibrary::SearchForAddressOfSymbol(name.str())){
+				new_symbols[kv.first] = JITEvaluatedSymbol(pointerToJITTargetAddress(address), JITSymbolFlags::Exported);
+			}
+		}
+		if (new_symbols.empty())
+			return Error::success();
+		return JD.define(orc::absoluteSymbols(std::move(new_symbols)));
+	}
 
 
-static PrototypeAST* ParsePrototype(std::istream& input);
-static FunctionAST* ParseDefinition(std::istream& input);
+	//an object cache keyed by the hash of the optimized module IR, the target triple, the CPU features and the codegen level
+	//the module name is left out, the same definition compiled by another session or another run has the same key
+	class KeyedObjectCache : public ObjectCache{
+		std::string key_salt;		//triple, CPU and features of the JIT, the codegen level is the kpp.codegen flag of the module
 
+	protected:
+		//keys of the cache misses, codegen may change the module before notifyObjectCompiled
+		//several compile threads may miss at the same time
+		std::unordered_map<const Module*, std::string> missed_keys;
+		mutable std::mutex mutex;
 
+		unsigned hits, misses, stores, uncached;
 
-//toplevelexpr ::= expression
-//װΪ
-static FunctionAST* ParseToplevelExpr(std::istream& input){
-	srand((unsigned int)time(nullptr));
-	if (ExprAST* expr = ParseExpression(input)){
-		std::string name = getUniqueAnonyName("anony_func_");
-		PrototypeAST* anonymous = PrototypeAST::factory(name, std::vector<std::string>(), 0, 0);
-		return FunctionAST::factory(anonymous, expr);
-	}
-	return nullptr;
-}
+		//code with the address of a host object as a constant, stubs, --pgo counters and array views,
+		//is different in every run and every session, it is neither looked up nor stored
+		static bool hasHostAddresses(const Module* M);
+		std::string getKey(const Module* M);
+		void addMiss(const Module* M, const std::string& key);
+		//the key of a missed module, empty if it was not missed
+		std::string takeMissedKey(const Module* M);
 
+	public:
+		KeyedObjectCache() :hits(0), misses(0), stores(0), uncached(0){}
+		//the JITs sharing a cache have the same target, the salt is set by the first one
+		void setKeySalt(const std::string& salt);
+		virtual void printStats()const = 0;
+	};
 
-//ʾʽunaryʽbinoprhsʽ
-//expression ::= unary binoprhs
-static ExprAST* ParseExpression(std::istream& input){
-	ExprAST* lhs = ParseUnary(input);
-	if (lhs == nullptr){
-		return nullptr;
+	void KeyedObjectCache::setKeySalt(const std::string& salt){
+		std::lock_guard<std::mutex> lock(mutex);
+		if (key_salt.empty())
+			key_salt = salt;
 	}
-	return ParseBinaryopRHS(input, 0, lhs);
-}
 
-//unaryʽǰtokenΪoperator򷵻unaryExpAST, ǰunaryʽΪһprimaryʽûunary operator
-//unary
-//	:: = primary
-//	:: = op unary
-static ExprAST* ParseUnary(std::istream& input){
-	//ǰtokenΪoperatorǰʽΪһPrimaryʽ
-	if (!isascii(cur_tok) || cur_tok == '(' || cur_tok == ','){
-		return ParsePrimary(input);
+	//inttoptr of a constant, possibly inside a getelementptr or a cast
+	static bool is_host_address(const Value* value){
+		const ConstantExpr* expr = dyn_cast<ConstantExpr>(value);
+		if (!expr)
+			return false;
+		if (expr->getOpcode() == Instruction::IntToPtr && isa<ConstantInt>(expr->getOperand(0)))
+			return true;
+		for (const Use& operand : expr->operands()) {
+			if (is_host_address(operand.get()))
+				return true;
+		}
+		return false;
 	}
 
-	char op = cur_tok;
-	get_next_tok(input);
-	std::cout << "unary op is " << (op) << std::endl;
-	if (ExprAST* expr = ParseUnary(input)){
-		return UnaryExpAST::factory(op, expr);
+	bool KeyedObjectCache::hasHostAddresses(const Module* M){
+		for (const Function& func : *M) {
+			for (const Instruction& inst : instructions(func)) {
+				for (const Use& operand : inst.operands()) {
+					if (is_host_address(operand.get()))
+						return true;
+				}
+			}
+		}
+		return false;
 	}
-	return nullptr;
-}
 
+	std::string KeyedObjectCache::getKey(const Module* M){
+		std::string ir;
+		raw_string_ostream ir_stream(ir);
+		M->print(ir_stream, nullptr);
+		ir_stream.flush();
+
+		//the module name depends on the order of the session, not on the code
+		StringRef code(ir);
+		while (code.startswith(";") || code.startswith("source_filename"))
+			code = code.split('\n').second;
+
+		SHA1 hasher;
+		hasher.update(key_salt);
+		hasher.update(code);
+		return toHex(hasher.final(), true);
+	}
 
-//binoprhsԿܴڵbinary operator ExpASTн
-//ǰbinary operatorڻprecedenceСǰһbinary operatorprecedenceֱӷǰһexprAST:lhs
-//ǰbinary operatorprecedenceǰһbinary operatorprecedence
-//binoprhs
-//	:: =
-//	:: = ('bi_op' unary)*
-static ExprAST* ParseBinaryopRHS(std::istream& input, int32_t expr_prec, ExprAST* lhs){
-	while (true)
-	{
-		int32_t cur_prec = get_precedence(cur_tok);
+	void KeyedObjectCache::addMiss(const Module* M, const std::string& key){
+		std::lock_guard<std::mutex> lock(mutex);
+		++misses;
+		missed_keys[M] = key;
+	}
 
-		if (cur_prec < expr_prec){
-			return lhs;
+	std::string KeyedObjectCache::takeMissedKey(const Module* M){
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = missed_keys.find(M);
+		if (iter == missed_keys.end())
+			return std::string();
+		std::string key = std::move(iter->second);
+		missed_keys.erase(iter);
+		return key;
+	}
+
+
+	//on-disk cache of the object code compiled by the JIT
+	//files are written atomically, and the least recently used ones are removed when the cache exceeds its size limit
+	class DiskObjectCache : public KeyedObjectCache{
+		std::string cache_dir;
+		uint64_t size_limit;
+
+		std::string getCachePath(const std::string& key)const{ return cache_dir + "/llvmcache-" + key; }
+
+	public:
+		DiskObjectCache(const std::string& dir, uint64_t limit);
+		void notifyObjectCompiled(const Module* M, MemoryBufferRef Obj) override;
+		std::unique_ptr<MemoryBuffer> getObject(const Module* M) override;
+		void prune();
+		void printStats()const override;
+	};
+
+
+	DiskObjectCache::DiskObjectCache(const std::string& dir, uint64_t limit)
+		:cache_dir(dir), size_limit(limit){
+		if (std::error_code ec = sys::fs::create_directories(cache_dir)){
+			KPP_LOG(LOG_ERROR, "Could not create cache directory %s: %s", cache_dir.c_str(), ec.message().c_str());
 		}
+		prune();
+	}
 
-		int32_t biop = cur_tok;
+	std::unique_ptr<MemoryBuffer> DiskObjectCache::getObject(const Module* M){
+		if (hasHostAddresses(M)){
+			std::lock_guard<std::mutex> lock(mutex);
+			++uncached;
+			return nullptr;
+		}
+		std::string key = getKey(M);
+		std::string path = getCachePath(key);
 
-		get_next_tok(input);
+		auto fd = sys::fs::openNativeFileForRead(path);
+		if (!fd){
+			consumeError(fd.takeError());
+			addMiss(M, key);
+			return nullptr;
+		}
 
-		ExprAST* rhs = ParseUnary(input);
-		if (rhs == nullptr){
+		//the access time drives the LRU cleanup, update it explicitly in case of noatime
+		sys::fs::setLastAccessAndModificationTime(*fd, std::chrono::system_clock::now());
+		auto buffer = MemoryBuffer::getOpenFile(*fd, path, -1);
+		sys::fs::closeFile(*fd);
+		if (!buffer){
+			addMiss(M, key);
 			return nullptr;
 		}
+		std::lock_guard<std::mutex> lock(mutex);
+		++hits;
+		return std::move(*buffer);
+	}
 
-		int32_t nxt_prec = get_precedence(cur_tok);
+	void DiskObjectCache::notifyObjectCompiled(const Module* M, MemoryBufferRef Obj){
+		std::string key = takeMissedKey(M);
+		if (key.empty())
+			return;
+		std::string path = getCachePath(key);
 
-		if (cur_prec < nxt_prec){
-			rhs = ParseBinaryopRHS(input, expr_prec + 1, rhs);
-			if (rhs == nullptr){
-				return nullptr;
+		//write to a temporary file and rename it, readers never see a partial object
+		//the llvmcache- prefix makes prune count the temporary files left by a crash, and remove them as the least recently used
+		int fd;
+		SmallString<128> tmp_path;
+		if (sys::fs::createUniqueFile(cache_dir + "/llvmcache-tmp-%%%%%%%%.o", fd, tmp_path)){
+			return;
+		}
+		{
+			raw_fd_ostream out(fd, true);
+			out << Obj.getBuffer();
+			//an error of the last write shows up at the flush, raw_fd_ostream reports a fatal error if it is left unchecked
+			out.close();
+			if (out.has_error()){
+				out.clear_error();
+				sys::fs::remove(tmp_path);
+				return;
 			}
 		}
-
-		lhs = BinaryExprAST::factory(biop, lhs, rhs);
+		if (sys::fs::rename(tmp_path, path)){
+			sys::fs::remove(tmp_path);
+			return;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		++stores;
 	}
-}
 
-//primaryʽʽ
-//primary
-//	:: = identifierexpr
-//	:: = numberexpr
-//	:: = parenexpr
-//	:: = ifexpr
-//	:: = forexpr
-//	:: = varexpr
-//
+	void DiskObjectCache::prune(){
+		CachePruningPolicy policy;
+		policy.Interval = std::chrono::seconds(0);
+		policy.Expiration = std::chrono::seconds(0);
+		policy.MaxSizePercentageOfAvailableSpace = 0;
+		policy.MaxSizeBytes = size_limit;
+		pruneCache(cache_dir, policy);
+	}
 
-static ExprAST* ParsePrimary(std::istream& input){
-	switch (cur_tok)
-	{
-	case TOK::DOUBLE_TOK:
-	case TOK::INT_TOK:
-		return ParseNumber(input);
-	case '(':
-		return ParseParenExpr(input);
-	case TOK::IDENTIFIER_TOK:
-		return ParseIdentifierExpr(input);
-	case TOK::FOR_TOK:
-		return ParseForExpr(input);
-	case TOK::IF_TOK:
-		return ParseIfExpr(input);
-	case TOK::VAR_TOK:
-		return ParseVarExpr(input);
-	default:
-		get_next_tok(input);	//eat invalid token
-		return Error("ParsePrimary: Invalid tok");
+	void DiskObjectCache::printStats()const{
+		std::lock_guard<std::mutex> lock(mutex);
+		kpp_print("object cache %s: %u hits, %u misses, %u stored, %u not cacheable\n", cache_dir.c_str(), hits, misses, stores, uncached);
 	}
-}
 
-//űʽʽ
-//parenexpr :: = '(' expression ')'
 
-static ExprAST* ParseParenExpr(std::istream& input){
-	get_next_tok(input); //eat '('
-	ExprAST* ret = ParseExpression(input);
-	if (ret == nullptr){
+	//in-memory cache of object code shared by the sessions of kpp --server
+	//a definition compiled by one client is loaded by every other client sending the same definition, without codegen
+	//objects are kept until the process exits, the new ones are dropped once the cache is at its size limit
+	class SharedObjectCache : public KeyedObjectCache{
+		std::unordered_map<std::string, std::unique_ptr<MemoryBuffer>> objects;
+		uint64_t size_limit;
+		uint64_t size;
+
+	public:
+		explicit SharedObjectCache(uint64_t limit) :size_limit(limit), size(0){}
+		void notifyObjectCompiled(const Module* M, MemoryBufferRef Obj) override;
+		std::unique_ptr<MemoryBuffer> getObject(const Module* M) override;
+		void printStats()const override;
+	};
+
+	std::unique_ptr<MemoryBuffer> SharedObjectCache::getObject(const Module* M){
+		if (hasHostAddresses(M)){
+			std::lock_guard<std::mutex> lock(mutex);
+			++uncached;
+			return nullptr;
+		}
+		std::string key = getKey(M);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto iter = objects.find(key);
+			if (iter != objects.end()){
+				++hits;
+				//the JIT gets a view, the object stays in the cache
+				return MemoryBuffer::getMemBuffer(iter->second->getMemBufferRef(), false);
+			}
+		}
+		addMiss(M, key);
 		return nullptr;
 	}
 
-	if (cur_tok != ')'){
-		return Error("ParseParenExpr: expect ')' at last");
+	void SharedObjectCache::notifyObjectCompiled(const Module* M, MemoryBufferRef Obj){
+		std::string key = takeMissedKey(M);
+		if (key.empty())
+			return;
+		std::lock_guard<std::mutex> lock(mutex);
+		//two sessions may miss the same key at the same time, the first object stays
+		if (objects.count(key) || size + Obj.getBufferSize() > size_limit)
+			return;
+		objects[key] = MemoryBuffer::getMemBufferCopy(Obj.getBuffer(), Obj.getBufferIdentifier());
+		size += Obj.getBufferSize();
+		++stores;
 	}
-	get_next_tok(input);//eat ')'
 
-	return ret;
-}
+	void SharedObjectCache::printStats()const{
+		std::lock_guard<std::mutex> lock(mutex);
+		kpp_print("shared object cache: %u hits, %u misses, %u stored, %u not cacheable, %llu KB\n", hits, misses, stores, uncached,
+			(unsigned long long)(size >> 10));
+	}
 
 
-//ǱҲǺ
-//identifer normal form
-//identifierexpr:
-//	::=identifer
-//	::=indeiffer ('expression*')
+	//JIT code memory, shared by the memory managers of all the objects
+	//a large address range is reserved once, slabs are mapped into it on demand and sections are carved out of them,
+	//so every section of the session is within the reach of 32 bit relative relocations
+	//on Linux each slab is a window of a memfd mapped twice: the view in the reserved range has the final permissions
+	//(r-x for code, r-- for read-only data), the sections are written through a second read-write view.
+	//the permissions are set once per slab when it is mapped, a module needs no mprotect at all
+	class JITSlabAllocator{
+	public:
+		enum SectionKind{
+			SECTION_CODE,
+			SECTION_RODATA,
+			SECTION_DATA,
+			SECTION_KIND_COUNT,
+		};
+
+		//a piece of a slab, local is the address to write, target the address the code uses
+		struct Block{
+			uint8_t* local;
+			uint8_t* target;
+			uint64_t size;
+		};
 
-static ExprAST* ParseIdentifierExpr(std::istream& input){
+	private:
+		struct Slab{
+			uint8_t* local;
+			uint8_t* target;
+			uint64_t size;
+			uint64_t offset;	//bump pointer
+		};
+
+		std::mutex mutex;
+		uint64_t slab_size;
+		bool huge_pages;
+		int memfd;
+		uint8_t* range_begin;
+		uint64_t range_size;
+		uint64_t range_used;
+		Slab current[SECTION_KIND_COUNT];
+		std::vector<Block> free_blocks[SECTION_KIND_COUNT];	//released by evicted objects
+
+		//statistics
+		uint64_t reserved_bytes[SECTION_KIND_COUNT];
+		uint64_t used_bytes[SECTION_KIND_COUNT];
+		unsigned slab_count, map_calls;
+
+		bool mapSlab(SectionKind kind, uint64_t min_size);
+		bool allocateFromFreeList(SectionKind kind, uint64_t size, uint64_t align, Block& block);
 
-	std::string var_name = cur_identifier;	//var_name, һܳԵĿǰcur_identifierstring
-	get_next_tok(input);//eat indetifer_tok;
+	public:
+		JITSlabAllocator(uint64_t slab, bool huge);
+		~JITSlabAllocator();
+		bool isValid()const{ return range_begin != nullptr; }
+		bool allocate(SectionKind kind, uint64_t size, unsigned align, Block& block);
+		void release(SectionKind kind, const Block& block);
+		void printStats();
+	};
+
+
+	//address range reserved for the JIT, 1GB keeps every section within the +-2GB of the small code model
+	static const uint64_t jit_range_size = 1ull << 30;
+	static const uint64_t huge_page_size = 2ull << 20;
+
+	JITSlabAllocator::JITSlabAllocator(uint64_t slab, bool huge)
+		:huge_pages(huge), memfd(-1), range_begin(nullptr), range_size(jit_range_size), range_used(0), slab_count(0), map_calls(0){
+		uint64_t page_size = huge_pages ? huge_page_size : sys::Process::getPageSizeEstimate();
+		slab_size = alignTo(std::max<uint64_t>(slab, page_size), page_size);
+		for (unsigned kind = 0; kind != SECTION_KIND_COUNT; ++kind) {
+			current[kind] = Slab{ nullptr, nullptr, 0, 0 };
+			reserved_bytes[kind] = used_bytes[kind] = 0;
+		}
 
-	if (cur_tok != '('){
-		return VariableExprAST::factory(cur_identifier);
+#ifdef __linux__
+		memfd = memfd_create("kpp-jit", MFD_CLOEXEC);
+		if (memfd < 0){
+			KPP_LOG(LOG_ERROR, "Could not create the JIT memory file: %s", strerror(errno));
+			return;
+		}
+		//huge pages need slabs aligned to 2MB
+		void* range = mmap(nullptr, range_size + huge_page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (range == MAP_FAILED){
+			KPP_LOG(LOG_ERROR, "Could not reserve the JIT address range: %s", strerror(errno));
+			return;
+		}
+		range_begin = (uint8_t*)alignAddr(range, Align(huge_page_size));
+		if (huge_pages){
+			std::ifstream shmem_thp("/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+			std::string setting;
+			std::getline(shmem_thp, setting);
+			if (setting.find("[never]") != std::string::npos || setting.find("[deny]") != std::string::npos)
+				KPP_LOG(LOG_WARN, "transparent huge pages are disabled for shared memory, see /sys/kernel/mm/transparent_hugepage/shmem_enabled");
+		}
+#endif
 	}
 
-	std::vector<ExprAST*> func_args;
+	//the slabs are not unmapped, code of the session may still be running when the JIT is destroyed
+	JITSlabAllocator::~JITSlabAllocator(){
+#ifdef __linux__
+		if (memfd >= 0)
+			close(memfd);
+#endif
+	}
 
-	get_next_tok(input);	//eat '('
-	if (cur_tok != ')'){
-		while (1){
-			ExprAST* expr = ParseExpression(input);
+	//map a new slab for kind at the end of the used part of the range
+	bool JITSlabAllocator::mapSlab(SectionKind kind, uint64_t min_size){
+#ifdef __linux__
+		uint64_t size = std::max(slab_size, alignTo(min_size, huge_pages ? huge_page_size : sys::Process::getPageSizeEstimate()));
+		if (!isValid() || range_used + size > range_size){
+			KPP_LOG(LOG_WARN, "JIT address range exhausted, %llu bytes reserved", (unsigned long long)range_used);
+			return false;
+		}
 
-			if (!expr){
-				return Error("ParseIdentifier: Error in parsing function arguments");
-			}
-			func_args.push_back(expr);
+		off_t offset = (off_t)range_used;
+		if (ftruncate(memfd, offset + size) != 0)
+			return false;
+
+		int prot = kind == SECTION_CODE ? PROT_READ | PROT_EXEC : kind == SECTION_RODATA ? PROT_READ : PROT_READ | PROT_WRITE;
+		uint8_t* target = range_begin + range_used;
+		if (mmap(target, size, prot, MAP_SHARED | MAP_FIXED, memfd, offset) == MAP_FAILED)
+			return false;
+		uint8_t* local = target;
+		if (kind != SECTION_DATA){
+			void* alias = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, offset);
+			if (alias == MAP_FAILED)
+				return false;
+			local = (uint8_t*)alias;
+			++map_calls;
+		}
+		++map_calls;
+		if (huge_pages)
+			madvise(target, size, MADV_HUGEPAGE);
+
+		//the rest of the old slab is kept for small sections
+		Slab& slab = current[kind];
+		if (slab.size > slab.offset)
+			free_blocks[kind].push_back(Block{ slab.local + slab.offset, slab.target + slab.offset, slab.size - slab.offset });
+		slab = Slab{ local, target, size, 0 };
+		range_used += size;
+		reserved_bytes[kind] += size;
+		++slab_count;
+		return true;
+#else
+		return false;
+#endif
+	}
 
-			if (cur_tok == ')'){
-				break;
+	//first fit among the released blocks, the rest of a block stays in the list
+	bool JITSlabAllocator::allocateFromFreeList(SectionKind kind, uint64_t size, uint64_t align, Block& block){
+		std::vector<Block>& blocks = free_blocks[kind];
+		for (size_t i = 0; i != blocks.size(); ++i) {
+			Block& free_block = blocks[i];
+			uint64_t padding = alignAddr(free_block.target, Align(align)) - (uintptr_t)free_block.target;
+			if (padding + size > free_block.size)
+				continue;
+			block = Block{ free_block.local + padding, free_block.target + padding, size };
+			free_block.local += padding + size;
+			free_block.target += padding + size;
+			free_block.size -= padding + size;
+			if (free_block.size == 0){
+				blocks[i] = blocks.back();
+				blocks.pop_back();
 			}
-			else if (cur_tok != ','){
-				return Error("ParseIdentifier: Expect ',' in arguments parsing");
-			}
-			get_next_tok(input);	//eat ','
+			return true;
 		}
+		return false;
 	}
 
-	get_next_tok(input);	//eat last ')';
-	CallExprAST* func_call = CallExprAST::factory(var_name, func_args);
-	return func_call;
-}
-
+	bool JITSlabAllocator::allocate(SectionKind kind, uint64_t size, unsigned align, Block& block){
+		std::lock_guard<std::mutex> lock(mutex);
+		uint64_t alignment = std::max(align, 16u);
+		size = std::max<uint64_t>(size, 1);
+		if (!allocateFromFreeList(kind, size, alignment, block)){
+			Slab* slab = &current[kind];
+			uint64_t padding = slab->local ? alignAddr(slab->target + slab->offset, Align(alignment)) - (uintptr_t)(slab->target + slab->offset) : 0;
+			if (!slab->local || slab->offset + padding + size > slab->size){
+				if (!mapSlab(kind, size + alignment))
+					return false;
+				slab = &current[kind];
+				padding = 0;
+			}
+			slab->offset += padding;
+			block = Block{ slab->local + slab->offset, slab->target + slab->offset, size };
+			slab->offset += size;
+		}
+		used_bytes[kind] += block.size;
+		return true;
+	}
 
-static ExprAST* ParseNumber(std::istream& input){
-	if (cur_tok == TOK::INT_TOK){
-		get_next_tok(input);
-		return DoubleValue::factory((double)cur_integer);
-		//return IntegerValue::factory(cur_integer);
+	void JITSlabAllocator::release(SectionKind kind, const Block& block){
+		std::lock_guard<std::mutex> lock(mutex);
+		used_bytes[kind] -= block.size;
+		free_blocks[kind].push_back(block);
 	}
-	else if (cur_tok == TOK::DOUBLE_TOK){
-		get_next_tok(input);
-		return DoubleValue::factory(cur_double);
+
+	void JITSlabAllocator::printStats(){
+		std::lock_guard<std::mutex> lock(mutex);
+		static const char* kind_names[SECTION_KIND_COUNT] = { "code", "rodata", "data" };
+		kpp_print("JIT memory: %u slabs of %llu KB%s, %u mmap calls\n", slab_count,
+			(unsigned long long)(slab_size >> 10), huge_pages ? " (huge pages)" : "", map_calls);
+		for (unsigned kind = 0; kind != SECTION_KIND_COUNT; ++kind) {
+			kpp_print("  %-6s %10llu bytes reserved, %10llu bytes used\n", kind_names[kind],
+				(unsigned long long)reserved_bytes[kind], (unsigned long long)used_bytes[kind]);
+		}
 	}
-	else
-		return Error("ParseNumber: Error token given");
-}
 
 
+	//memory manager of one object linked by ORC, the sections come from the JITSlabAllocator
+	//the blocks go back to the allocator when ORC removes the object
+	class SlabMemoryManager : public RTDyldMemoryManager{
+		JITSlabAllocator* allocator;
+		std::vector<std::pair<JITSlabAllocator::SectionKind, JITSlabAllocator::Block>> blocks;
+		std::vector<std::pair<uint8_t*, size_t>> eh_frames;
 
-//forexpr ѭ
-//
-//forexpr :: = 'for' identifier '=' expr ','  (identifier  =  expr)*; expr(',' expr) ? 'in' expression
-static ExprAST* ParseForExpr(std::istream& input){
-	get_next_tok(input);
-	if (cur_tok != TOK::IDENTIFIER_TOK){
-		return Error("ParseForExpr: error in for expression, expect a variable name");
-	}
-	std::string var_name = cur_identifier;
+		uint8_t* allocate(JITSlabAllocator::SectionKind kind, uintptr_t size, unsigned align);
 
-	get_next_tok(input); //eat identifer
-	if (cur_tok != '='){
-		return Error("ParseForExpr: error in for expression, expect '='");
-	}
+	public:
+		SlabMemoryManager(JITSlabAllocator* slab_allocator) :allocator(slab_allocator){}
+		~SlabMemoryManager();
+		uint8_t* allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, StringRef SectionName) override;
+		uint8_t* allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, StringRef SectionName, bool IsReadOnly) override;
+		void notifyObjectLoaded(RuntimeDyld& RTDyld, const object::ObjectFile& Obj) override;
+		void registerEHFrames(uint8_t* Addr, uint64_t LoadAddr, size_t Size) override;
+		void deregisterEHFrames() override;
+		bool finalizeMemory(std::string* ErrMsg) override;
+	};
 
-	get_next_tok(input);//eat '='
 
+	SlabMemoryManager::~SlabMemoryManager(){
+		deregisterEHFrames();
+		for (auto& block : blocks) {
+			allocator->release(block.first, block.second);
+		}
+	}
 
-	ExprAST *start = ParseExpression(input);
-	if (start == nullptr){
-		return nullptr;
+	uint8_t* SlabMemoryManager::allocate(JITSlabAllocator::SectionKind kind, uintptr_t size, unsigned align){
+		JITSlabAllocator::Block block;
+		if (!allocator->allocate(kind, size, align, block))
+			return nullptr;
+		blocks.push_back(std::make_pair(kind, block));
+		return block.local;
 	}
 
-	if (cur_tok != ','){
-		return Error("ParseForExpr: expect ',' after start expression");
+	uint8_t* SlabMemoryManager::allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, StringRef SectionName){
+		return allocate(JITSlabAllocator::SECTION_CODE, Size, Alignment);
 	}
 
-	get_next_tok(input); //eat ','
+	uint8_t* SlabMemoryManager::allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, StringRef SectionName, bool IsReadOnly){
+		return allocate(IsReadOnly ? JITSlabAllocator::SECTION_RODATA : JITSlabAllocator::SECTION_DATA, Size, Alignment);
+	}
 
-	ExprAST *end = ParseExpression(input);
+	//the sections were written through the read-write view, relocations must use the addresses of the final view
+	void SlabMemoryManager::notifyObjectLoaded(RuntimeDyld& RTDyld, const object::ObjectFile& Obj){
+		for (auto& block : blocks) {
+			if (block.second.local != block.second.target)
+				RTDyld.mapSectionAddress(block.second.local, (uint64_t)(uintptr_t)block.second.target);
+		}
+	}
 
-	if (end == nullptr){
-		return nullptr;
+	//the unwinder reads the frames at the address the relocations were resolved for
+	void SlabMemoryManager::registerEHFrames(uint8_t* Addr, uint64_t LoadAddr, size_t Size){
+		uint8_t* frames = (uint8_t*)(uintptr_t)LoadAddr;
+		registerEHFramesInProcess(frames, Size);
+		eh_frames.push_back(std::make_pair(frames, Size));
 	}
 
-	//step if a optional
-	ExprAST* step = nullptr;
-	if (cur_tok == ','){
-		get_next_tok(input); //eat ','
-		ExprAST* step = ParseExpression(input);
-		if (step == nullptr){
-			return nullptr;
+	void SlabMemoryManager::deregisterEHFrames(){
+		for (auto& frames : eh_frames) {
+			deregisterEHFramesInProcess(frames.first, frames.second);
 		}
+		eh_frames.clear();
 	}
 
-	if (cur_tok != TOK::IN_TOK){
-		return Error("ParseForExpr: expect 'in' in for expression");
+	//the permissions were set when the slabs were mapped
+	//returns true on error, like SectionMemoryManager
+	bool SlabMemoryManager::finalizeMemory(std::string* ErrMsg){
+		for (auto& block : blocks) {
+			if (block.first == JITSlabAllocator::SECTION_CODE)
+				sys::Memory::InvalidateInstructionCache(block.second.target, block.second.size);
+		}
+		return false;
 	}
 
-	get_next_tok(input);	//eat 'in'
 
-	ExprAST* block = ParseExpression(input);
+	//entry of the JIT symbol table
+	struct JITSymbolEntry{
+		std::string module_name;	//module which defines the symbol, or declares it for an extern
+		FunctionType* type;			//used to create the declaration in a new module
+		void* address;				//resolved address, nullptr until the first lookup
+		bool defined;				//false for an extern
+	};
 
-	if (block == nullptr){
-		return nullptr;
-	}
 
-	return ForExprAST::factory(var_name, start, end, step, block);
+	//JIT symbol table, split into shards by the hash of the name, each shard has its own lock
+	//the main thread registers the symbols, the compile threads fill in the addresses when the code is ready
+	class SymbolTable{
+		static const unsigned shard_count = 16;
 
-}
+		struct Shard{
+			std::mutex mutex;
+			std::unordered_map<std::string, JITSymbolEntry> entries;
+		};
+		Shard shards[shard_count];
 
-//'def' 庯
-//definition :: = 'def' prototype expression
-static FunctionAST* ParseDefinition(std::istream& input){
-	get_next_tok(input); //eat 'def'
+		Shard& getShard(StringRef name){ return shards[hash_value(name) % shard_count]; }
 
-	PrototypeAST *func_proto = ParsePrototype(input);
-	if (!func_proto){
-		return nullptr;
+	public:
+		void add(StringRef name, const std::string& module_name, FunctionType* type, bool is_definition);
+		bool find(StringRef name, JITSymbolEntry& entry);
+		void setAddress(StringRef name, void* address);
+	};
+
+
+	//a definition takes the entry over from an extern declaration, never the other way around
+	void SymbolTable::add(StringRef name, const std::string& module_name, FunctionType* type, bool is_definition){
+		Shard& shard = getShard(name);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto result = shard.entries.emplace(name.str(), JITSymbolEntry());
+		JITSymbolEntry& entry = result.first->second;
+		if (result.second || is_definition){
+			entry.module_name = module_name;
+			entry.type = type;
+			entry.address = nullptr;
+			entry.defined = is_definition;
+		}
 	}
 
-	ExprAST* body = ParseExpression(input);
-	if (!body){
-		return nullptr;
+	//copy of the entry, the compile threads may change it in the table
+	bool SymbolTable::find(StringRef name, JITSymbolEntry& entry){
+		Shard& shard = getShard(name);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto iter = shard.entries.find(name.str());
+		if (iter == shard.entries.end())
+			return false;
+		entry = iter->second;
+		return true;
 	}
 
-	return FunctionAST::factory(func_proto, body);
-}
+	void SymbolTable::setAddress(StringRef name, void* address){
+		Shard& shard = getShard(name);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto iter = shard.entries.find(name.str());
+		if (iter != shard.entries.end())
+			iter->second.address = address;
+	}
 
-//ԭͣ unary operator binary operator Ҳͨ
-//prototype
-//	:: = id '('id* ')'
-//	:: = binary LETTER number ? (id, id)
-//	:: = unary LETTER(id)
-static PrototypeAST* ParsePrototype(std::istream& input){
 
-	switch (cur_tok)
-	{
-	case TOK::IDENTIFIER_TOK://
-	{
-		std::string func_name = cur_identifier;
-		get_next_tok(input);//eat identifier;
+	//--perf-map: the functions of every object the JIT loads, in /tmp/perf-<pid>.map for perf report
+	//one file for the process, the sessions of the server and the engines share it
+	//perf keeps the last entry of an address, the code of a removed object stays in the map
+	class PerfMapListener : public JITEventListener{
+		std::mutex mutex;
+		FILE* file;
+		PerfMapListener();
 
-		if (cur_tok != '('){
-			return ErrorP("ParsePrototype: expect '(' at begin of function definition");
-		}
-		get_next_tok(input);
-		std::vector<std::string> func_args;
+	public:
+		static PerfMapListener* get();
+		bool isValid()const{ return file != nullptr; }
+		void notifyObjectLoaded(ObjectKey key, const object::ObjectFile& obj, const RuntimeDyld::LoadedObjectInfo& info)override;
+	};
 
-		if (cur_tok != ')'){
-			while (1) {
-				if (cur_tok == TOK::IDENTIFIER_TOK){
-					func_args.push_back(cur_identifier);
-					get_next_tok(input);
-				}
-				else
-					break;
-			}
-		}
+	PerfMapListener::PerfMapListener() :file(nullptr){
+#ifdef __linux__
+		std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+		file = fopen(path.c_str(), "w");
+		if (!file)
+			KPP_LOG(LOG_ERROR, "Could not open %s: %s", path.c_str(), strerror(errno));
+		else
+			KPP_LOG(LOG_INFO, "writing the JIT symbols to %s", path.c_str());
+#else
+		KPP_LOG(LOG_ERROR, "--perf-map needs Linux");
+#endif
+	}
 
-		if (cur_tok != ')'){
-			return ErrorP("ParsePrototype: expect ')' at end of function prototype");
+	PerfMapListener* PerfMapListener::get(){
+		static PerfMapListener listener;
+		return &listener;
+	}
+
+	//<start> <size> <name>, in hex; the object for debug has the addresses the sections were loaded at
+	void PerfMapListener::notifyObjectLoaded(ObjectKey key, const object::ObjectFile& obj, const RuntimeDyld::LoadedObjectInfo& info){
+		if (!file)
+			return;
+		object::OwningBinary<object::ObjectFile> debug_obj = info.getObjectForDebug(obj);
+		const object::ObjectFile* loaded = debug_obj.getBinary() ? debug_obj.getBinary() : &obj;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const auto& symbol_size : object::computeSymbolSizes(*loaded)) {
+			const object::SymbolRef& symbol = symbol_size.first;
+			auto type = symbol.getType();
+			if (!type || *type != object::SymbolRef::ST_Function){
+				consumeError(type.takeError());
+				continue;
+			}
+			auto name = symbol.getName();
+			auto address = symbol.getAddress();
+			if (!name || !address || !symbol_size.second){
+				consumeError(name.takeError());
+				consumeError(address.takeError());
+				continue;
+			}
+			fprintf(file, "%llx %llx %s\n", (unsigned long long)*address, (unsigned long long)symbol_size.second, name->str().c_str());
 		}
-		get_next_tok(input);
-		return PrototypeAST::factory(func_name, func_args);
+		fflush(file);
 	}
-	case TOK::UNARY_TOK:
-	{
-		get_next_tok(input);//eat unary
 
-		std::string invalid_char = "[](){},/\\";
-		//if the cur_tok is visited and not a alpha or digit or brace, it is valid
-		if (cur_tok < 127 && cur_tok > 32 && !isalnum(cur_tok) && invalid_char.find(cur_tok) == std::string::npos){
-			char op = cur_tok;
-			get_next_tok(input);	//eat op
 
-			if (cur_tok != '('){
-				return ErrorP("ParsePrototype: expect '(' in unary definition");
-			}
+	//receives the generated functions, implemented by the JIT and by the AOT compiler
+	class CodegenHelper{
+	public:
+		virtual ~CodegenHelper(){}
+		virtual Module* getModuleForNewFunction() = 0;
+		virtual Function* getFunction(const std::string& name) = 0;
+	};
 
-			get_next_tok(input);	//eat '('
 
-			if (cur_tok != TOK::IDENTIFIER_TOK){
-				return ErrorP("ParsePrototype: expect indentifier in unary arguments parsing");
-			}
+	//execution counts of a function, collected by the instrumented code of --pgo
+	//branches are numbered in the order of the unoptimized IR, shape tells whether the IR is still the same
+	struct FunctionProfile{
+		uint64_t shape;
+		uint64_t entry_count;
+		std::vector<std::pair<uint64_t, uint64_t>> branches;	//taken and not taken, of every conditional branch
+	};
 
-			std::string func_args = cur_identifier;
+	//the profiles of a session, saved by --profile-out and loaded by --profile-in, by the JIT and by kppc
+	//	# kpp profile
+	//	<function> <shape> <entry count> <branches>
+	//	<taken> <not taken>
+	class ProfileData{
+		std::map<std::string, FunctionProfile> functions;
 
-			get_next_tok(input);	//eat identifer;
+	public:
+		static uint64_t getShape(Function* func);
+		static void getBranches(Function* func, std::vector<BranchInst*>& branches);
+		static void attach(Function* func, const FunctionProfile& profile);
+
+		bool load(const std::string& path);
+		bool save(const std::string& path)const;
+		size_t size()const{ return functions.size(); }
+		void set(const std::string& name, const FunctionProfile& profile){ functions[name] = profile; }
+		const FunctionProfile* find(const std::string& name, Function* func)const;
+		unsigned applyTo(Module* module)const;
+	};
 
 
-			if (cur_tok != ')'){
-				return ErrorP("ParsePrototype: expect ')' at end of unary aguments parsing");
+	//FNV-1a over the opcodes and operand counts, the names of the values do not matter
+	uint64_t ProfileData::getShape(Function* func){
+		uint64_t hash = 14695981039346656037ULL;
+		for (BasicBlock& block : *func) {
+			for (Instruction& inst : block) {
+				hash = (hash ^ inst.getOpcode()) * 1099511628211ULL;
+				hash = (hash ^ inst.getNumOperands()) * 1099511628211ULL;
 			}
-
-			get_next_tok(input);	//eat ')'
-
-			return PrototypeAST::factory(std::string(1, op), std::vector<std::string>(1, func_args), 1);
 		}
-		else
-			return ErrorP("ParsePrototype: Invalid operater character in unary defination");
-
+		return hash;
 	}
-	case TOK::BINARY_TOK:
-	{
-		get_next_tok(input);	//eat binary token;
 
-		std::string invalid_char = "[](){},/\\";
-		//if the cur_tok is visited and not a alpha or digit or brace, it is valid
-		if (cur_tok < 127 && cur_tok > 32 && !isalnum(cur_tok) && invalid_char.find(cur_tok) == std::string::npos){
-			char op = cur_tok;
-			get_next_tok(input);	//eat op
-			if (cur_tok != TOK::INT_TOK){
-				return ErrorP("ParsePrototype: expect a binary opeator precedence");
+	void ProfileData::getBranches(Function* func, std::vector<BranchInst*>& branches){
+		for (BasicBlock& block : *func) {
+			if (BranchInst* branch = dyn_cast<BranchInst>(block.getTerminator())){
+				if (branch->isConditional())
+					branches.push_back(branch);
 			}
+		}
+	}
 
-			int32_t biop_prec = cur_integer;
-
-			get_next_tok(input);	//eat integer;
-
-			if (cur_tok != '('){
-				return ErrorP("ParsePrototype: expect '(' in binary operator definition");
+	//function_entry_count and the branch_weights of every conditional branch
+	void ProfileData::attach(Function* func, const FunctionProfile& profile){
+		std::vector<BranchInst*> branches;
+		getBranches(func, branches);
+		func->setEntryCount(Function::ProfileCount(profile.entry_count, Function::PCT_Real));
+		MDBuilder md(func->getContext());
+		for (size_t i = 0; i < branches.size() && i < profile.branches.size(); ++i) {
+			uint64_t taken = profile.branches[i].first, not_taken = profile.branches[i].second;
+			if (!taken && !not_taken)
+				continue;
+			//the weights are 32 bits
+			while (taken > UINT32_MAX || not_taken > UINT32_MAX) {
+				taken >>= 1;
+				not_taken >>= 1;
 			}
+			branches[i]->setMetadata(LLVMContext::MD_prof, md.createBranchWeights((uint32_t)taken, (uint32_t)not_taken));
+		}
+	}
 
-			get_next_tok(input);	//eat '('
+	const FunctionProfile* ProfileData::find(const std::string& name, Function* func)const{
+		auto iter = functions.find(name);
+		if (iter == functions.end() || iter->second.shape != getShape(func))
+			return nullptr;
+		return &iter->second;
+	}
 
-			std::vector<std::string> func_args;
-			if (cur_tok != TOK::IDENTIFIER_TOK){
-				return ErrorP("ParsePrototype: expect indentifier in binary arguments parser");
+	//attach the profiles to the functions of module with the same name and shape, returns how many
+	unsigned ProfileData::applyTo(Module* module)const{
+		unsigned applied = 0;
+		for (Function& func : *module) {
+			if (func.isDeclaration())
+				continue;
+			if (const FunctionProfile* profile = find(func.getName().str(), &func)){
+				attach(&func, *profile);
+				++applied;
 			}
+		}
+		return applied;
+	}
 
-			func_args.push_back(cur_identifier);
-
-			get_next_tok(input);	//eat identifer;
-
-			if (cur_tok != TOK::IDENTIFIER_TOK){
-				return ErrorP("ParsePrototype: expect indentifier in binary arguments parser");
+	bool ProfileData::load(const std::string& path){
+		std::ifstream in(path);
+		if (!in){
+			KPP_LOG(LOG_ERROR, "Could not open profile %s", path.c_str());
+			return false;
+		}
+		std::string line;
+		while (std::getline(in, line)) {
+			if (line.empty() || line[0] == '#')
+				continue;
+			char name[256];
+			unsigned long long shape, entry_count;
+			unsigned count;
+			if (sscanf(line.c_str(), "%255s %llx %llu %u", name, &shape, &entry_count, &count) != 4){
+				KPP_LOG(LOG_ERROR, "Invalid profile %s: %s", path.c_str(), line.c_str());
+				return false;
 			}
-
-			func_args.push_back(cur_identifier);
-
-			get_next_tok(input);	//eat identifier;
-
-			if (cur_tok != ')'){
-				return ErrorP("ParsePrototype: expect ')' at end of binary operator aguments parser");
+			FunctionProfile profile;
+			profile.shape = shape;
+			profile.entry_count = entry_count;
+			for (unsigned i = 0; i < count; ++i) {
+				unsigned long long taken, not_taken;
+				if (!std::getline(in, line) || sscanf(line.c_str(), "%llu %llu", &taken, &not_taken) != 2){
+					KPP_LOG(LOG_ERROR, "Invalid profile %s: branches of %s", path.c_str(), name);
+					return false;
+				}
+				profile.branches.push_back(std::make_pair(taken, not_taken));
 			}
-
-			get_next_tok(input);	//eat ')'
-
-			return PrototypeAST::factory(std::string(1, op), func_args, 2, biop_prec);
+			functions[name] = profile;
 		}
-		else
-			return ErrorP("ParsePrototype: Invalid operater character in unary defination");
-	}
-	default:
-		return ErrorP("ParsePrototype: Invalid syntax in definition");
+		return true;
 	}
 
-}
+	bool ProfileData::save(const std::string& path)const{
+		std::error_code ec;
+		raw_fd_ostream out(path, ec, sys::fs::OF_Text);
+		if (ec){
+			KPP_LOG(LOG_ERROR, "Could not open %s: %s", path.c_str(), ec.message().c_str());
+			return false;
+		}
+		out << "# kpp profile\n";
+		for (auto& kv : functions) {
+			out << kv.first << " " << format_hex_no_prefix(kv.second.shape, 16) << " " << kv.second.entry_count
+				<< " " << kv.second.branches.size() << "\n";
+			for (auto& branch : kv.second.branches) {
+				out << branch.first << " " << branch.second << "\n";
+			}
+		}
+		return true;
+	}
 
 
-//external ʽⲿ, externؼʿʼ
-//external :: = 'extern' prototype
+	//a function called through a stub, --calls=stub
+	//the stub jumps through slot, a null slot makes it call kpp_jit_resolve, which compiles the current version
+	//the bitcode of the current version is kept, so the code can be evicted and compiled again at the next call
+	struct StubRecord{
+		JITHelper* owner;
+		std::atomic<void*> slot;
+		std::atomic<uint8_t> used;		//set by the stub at every call, cleared by the eviction clock
+		std::string name;
+		FunctionType* type;
+		unsigned version;
+		std::string body_name;			//name.v<version>
+		std::string bitcode;
+		orc::ResourceTrackerSP tracker;	//null when the code is not in the JIT
+		uint64_t code_size;
+		bool compiled;					//compiled once, compiling it again is a recompilation
+
+		//--pgo: the versions compiled before the threshold count their calls and branches
+		//the hot version is compiled with the counts at -O3, as <body_name>.hot
+		std::string code_name;			//the symbol of the code in the JIT, body_name or body_name.hot
+		std::unique_ptr<uint64_t[]> counters;	//calls, then taken and not taken of every conditional branch
+		unsigned branch_count;
+		uint64_t shape;					//ProfileData::getShape of the body counted
+		bool hot;
+	};
 
-static PrototypeAST* ParseExtern(std::istream& input){
-	get_next_tok(input);//eat extern;
-	return ParsePrototype(input);
-}
+	//top-level expressions added to the JIT by submitBatchedExprs, compiled and run by runExprBatch
+	struct ExprBatch{
+		std::string driver_name;		//void anony_batch_<n>(double* results)
+		size_t expr_count;
+		orc::ResourceTrackerSP tracker;	//the code of the batch, removed after the run
+	};
 
+	//code of a stubbed function replaced while it may be running, released at the next safe point
+	struct RetiredCode{
+		orc::ResourceTrackerSP tracker;	//null if the code was not in the JIT
+		uint64_t code_size;
+		std::unique_ptr<uint64_t[]> counters;	//written by the instrumented code
+	};
 
-//ifelseexpr ʽ
-//
-//ifexpr :: = 'if' expression 'then' expression 'else' expression
 
-static ExprAST* ParseIfExpr(std::istream& input){
-	get_next_tok(input); //eat 'if'
+	//JIT of the session, based on ORC LLLazyJIT
+	//without compile threads every function handed to the JIT gets a lazy stub, and is optimized and compiled at its first call
+	//with compile threads every definition is handed to the JIT at once, and is optimized and compiled on the compile threads,
+	//the main thread goes on parsing and only waits when an expression needs the address
+	//the IR of the session is built on the ThreadSafeContext, the main thread holds its lock during codegen
+	class JITHelper : public CodegenHelper{
+	private:
+		orc::ThreadSafeContext context;
+		OptPipeline* pipeline;
+		std::unique_ptr<orc::LLLazyJIT> jit;
+		unsigned compile_threads;	//0: lazy compilation on the main thread
+		Module* openModule;
+		SymbolTable symbols;	//functions and externs already handed to the JIT, the modules are owned by ORC
+		unsigned definitions_per_module;	//with compile threads, a module is handed to the JIT when it has so many definitions
+		unsigned open_definitions;			//definitions in openModule
+
+		//stubbed calls: f is a stub jumping through the slot of its StubRecord, the body is compiled as f.v<n> at the first call
+		//a redefinition clears the slot, the next call compiles the new version
+		bool stub_calls;
+		std::unordered_map<std::string, StubRecord*> stubs;
+		std::mutex stub_mutex;
+
+		//code memory budget, cold stubbed functions are evicted when the code exceeds it
+		uint64_t code_budget;		//0 for no budget
+		std::atomic<uint64_t> code_bytes;	//sections of every object loaded by the JIT
+		std::vector<StubRecord*> stub_clock;	//eviction order
+		size_t clock_hand;
+		unsigned evictions, recompilations;
+		std::mutex code_mutex;
+		std::unordered_map<std::string, uint64_t> loading_sizes;	//code size of the objects being compiled, by a symbol they define
+
+		//profile-guided recompilation, a stubbed function is compiled again with its counts after pgo_threshold calls
+		uint64_t pgo_threshold;		//0: no instrumentation
+		OptPipeline* hot_pipeline;	//-O3, for the modules with the kpp.hot flag
+		const ProfileData* loaded_profile;	//--profile-in, the functions found in it are compiled hot at once
+		std::vector<RetiredCode> retired_code;	//old versions and instrumented code replaced while they were running
+		bool collect_at_safe_points;	//false in an engine, its host calls collect
+		unsigned tier_ups;
+
+		//batch kernels: a definition is compiled again into kernelModule, and inlined into the loop of the kernel
+		Module* kernelModule;
+		unsigned kernel_count;
+
+		//batch mode: consecutive top-level expressions are collected in exprModule and compiled together
+		Module* exprModule;
+		bool batching_expr;
+		std::vector<Function*> batched_exprs;
+
+		bool submitOpenModule();
+		void registerSymbols(Module* module);
+		void compileInBackground(std::vector<std::string> names);
+		void createStub(StubRecord* record, Module* module);
+		void unloadStub(StubRecord* record);
+		void watchObjectSize(const std::string& symbol);
+		uint64_t takeObjectSize(const std::string& symbol);
+		void onObjectLoaded(orc::MaterializationResponsibility& R, const object::ObjectFile& obj, const RuntimeDyld::LoadedObjectInfo& info);
+		void instrumentBody(StubRecord* record, Function* body);
+		FunctionProfile getCountedProfile(StubRecord* record);
+		void releaseRetiredCode();
 
-	ExprAST* ifexpr, *thenexpr, *elseexpr;
+	public:
+		JITHelper(orc::ThreadSafeContext ctx, OptPipeline* pm, KeyedObjectCache* cache = nullptr, unsigned threads = 0,
+			JITSlabAllocator* memory = nullptr, const std::vector<JITEventListener*>& listeners = std::vector<JITEventListener*>());
+		~JITHelper();
+		bool isValid()const{ return jit != nullptr; }
+		unsigned getCompileThreads()const{ return compile_threads; }
+		Module* getModuleForNewFunction() override;
+		void setStubCalls(bool stub);
+		bool getStubCalls()const{ return stub_calls; }
+		bool addDefinition(Function* func);
+		void* resolveStub(StubRecord* record);
+		void setCodeBudget(uint64_t bytes){ code_budget = bytes; }
+		void enforceCodeBudget();
+		void printCodeStats();
+		void setPGO(uint64_t threshold, const ProfileData* profile);
+		void tierUp(StubRecord* record);
+		void collectProfiles(ProfileData& data);
+		void printProfileStats();
+		void atSafePoint();
+		void setCollectAtSafePoints(bool collect){ collect_at_safe_points = collect; }
+		void collect();
+		void submitDefinitions();
+		void setDefinitionsPerModule(unsigned count){ definitions_per_module = count ? count : 1; }
+		void setExprBatching(bool batching){ batching_expr = batching; }
+		void addBatchedExpr(Function* func);
+		size_t getBatchedExprCount()const{ return batched_exprs.size(); }
+		bool runBatchedExprs(std::vector<double>& results);
+		bool submitBatchedExprs(ExprBatch& batch);
+		bool runExprBatch(ExprBatch& batch, std::vector<double>& results);
+		bool beginKernel();
+		bool finishKernel(Function* body, BatchKernel& kernel);
+		bool resolveKernel(BatchKernel& kernel);
+		Function* getFunction(const std::string& name) override;
+		void* getFunctionAddress(const std::string& name, unsigned arity);
+		void* getSymbolAddress(const std::string& name);
+		void dump(raw_ostream& out);
+	};
 
-	ifexpr = ParseExpression(input);
 
-	if (ifexpr == nullptr){
-		return nullptr;
+	JITHelper::JITHelper(orc::ThreadSafeContext ctx, OptPipeline* pm, KeyedObjectCache* cache, unsigned threads, JITSlabAllocator* memory,
+		const std::vector<JITEventListener*>& listeners)
+		:context(std::move(ctx)), pipeline(pm), compile_threads(threads), openModule(nullptr),
+		definitions_per_module(1), open_definitions(0), stub_calls(false), code_budget(0), code_bytes(0), clock_hand(0),
+		evictions(0), recompilations(0), pgo_threshold(0), hot_pipeline(nullptr), loaded_profile(nullptr), collect_at_safe_points(true), tier_ups(0),
+		kernelModule(nullptr), kernel_count(0), exprModule(nullptr), batching_expr(false){
+		//the same triple, CPU and features as the optimizer, the codegen level is chosen for every module by LeveledIRCompiler
+		auto jtmb = pipeline->getTarget().getJITTargetMachineBuilder();
+
+		//the compile threads work on a copy of each module in its own context, see IRLayer::setCloneToNewContextOnEmit
+		orc::LLLazyJITBuilder builder;
+		builder.setNumCompileThreads(compile_threads);
+		//with a slab allocator the sections of every object come from the slabs, instead of new pages from SectionMemoryManager
+		//the size of every object loaded is added to code_bytes
+		//the listeners of --perf-map and --jitdump see every object loaded
+		builder.setObjectLinkingLayerCreator([this, memory, listeners](orc::ExecutionSession& ES, const Triple& TT) -> Expected<std::unique_ptr<orc::ObjectLayer>> {
+			auto layer = std::make_unique<orc::RTDyldObjectLinkingLayer>(ES, [memory]() -> std::unique_ptr<RuntimeDyld::MemoryManager> {
+				if (memory)
+					return std::make_unique<SlabMemoryManager>(memory);
+				return std::make_unique<SectionMemoryManager>();
+			});
+			layer->setNotifyLoaded([this](orc::MaterializationResponsibility& R, const object::ObjectFile& obj, const RuntimeDyld::LoadedObjectInfo& info){
+				onObjectLoaded(R, obj, info);
+			});
+			for (JITEventListener* listener : listeners) {
+				layer->registerJITEventListener(*listener);
+			}
+			if (compile_stats){
+				layer->setNotifyEmitted([](orc::MaterializationResponsibility& R, std::unique_ptr<MemoryBuffer> obj){
+					TimedIRCompiler::linked();
+				});
+			}
+			return std::unique_ptr<orc::ObjectLayer>(std::move(layer));
+		});
+		if (cache)
+			cache->setKeySalt(jtmb.getTargetTriple().str() + "|" + jtmb.getCPU() + "|" + jtmb.getFeatures().getString());
+		bool concurrent = compile_threads != 0;
+		const OptPipeline* opt = pipeline;
+		builder.setCompileFunctionCreator([cache, concurrent, opt](orc::JITTargetMachineBuilder JTMB) -> Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+			std::unique_ptr<TargetMachine> tm;
+			if (!concurrent){
+				auto created = JTMB.createTargetMachine();
+				if (!created)
+					return created.takeError();
+				tm = std::move(*created);
+			}
+			std::unique_ptr<orc::IRCompileLayer::IRCompiler> compiler = std::make_unique<LeveledIRCompiler>(std::move(JTMB), opt, cache, std::move(tm));
+			if (compile_stats)
+				compiler = std::make_unique<TimedIRCompiler>(std::move(compiler));
+			return std::move(compiler);
+		});
+
+		auto lazy_jit = builder.setJITTargetMachineBuilder(std::move(jtmb)).create();
+		if (!lazy_jit){
+			KPP_LOG(LOG_ERROR, "Could not create the JIT: %s", toString(lazy_jit.takeError()).c_str());
+			return;
+		}
+		jit = std::move(*lazy_jit);
+
+		//the OptPipeline runs on each partition when it is compiled, not when the module is added
+		//the hot versions of --pgo go through hot_pipeline
+		jit->getIRTransformLayer().setTransform([this](orc::ThreadSafeModule TSM, orc::MaterializationResponsibility& R) -> Expected<orc::ThreadSafeModule> {
+			TSM.withModuleDo([this](Module& M){
+				OptPipeline* opt = hot_pipeline && M.getModuleFlag("kpp.hot") ? hot_pipeline : pipeline;
+				opt->run(&M);
+			});
+			return std::move(TSM);
+		});
+
+		jit->getMainJITDylib().addGenerator(std::make_unique<ProcessSymbolGenerator>());
 	}
 
-
-	if (cur_tok != TOK::THEN_TOK){
-		return Error("ParseIfExpr: Invalid syntax, expect 'then'");
+	//LLJIT waits for the compile threads, they may still write to the symbol table
+	JITHelper::~JITHelper(){
+		//a ResourceTracker must not outlive the session
+		for (StubRecord* record : stub_clock) {
+			record->tracker = nullptr;
+		}
+		retired_code.clear();
+		jit.reset();
+		for (StubRecord* record : stub_clock) {
+			delete record;
+		}
+		delete hot_pipeline;
 	}
 
-	get_next_tok(input);	//eat 'then'
+	//called by the linking layer, on the compile threads too
+	void JITHelper::onObjectLoaded(orc::MaterializationResponsibility& R, const object::ObjectFile& obj, const RuntimeDyld::LoadedObjectInfo& info){
+		uint64_t size = 0;
+		for (const object::SectionRef& section : obj.sections()) {
+			if (info.getSectionLoadAddress(section))
+				size += section.getSize();
+		}
+		code_bytes += size;
 
-	thenexpr = ParseExpression(input);
+		std::lock_guard<std::mutex> lock(code_mutex);
+		if (loading_sizes.empty())
+			return;
+		for (auto& kv : R.getSymbols()) {
+			auto iter = loading_sizes.find((*kv.first).str());
+			if (iter != loading_sizes.end())
+				iter->second = size;
+		}
+	}
 
-	if (thenexpr == nullptr){
-		return nullptr;
+	//the size of the object defining symbol is recorded by onObjectLoaded, until takeObjectSize
+	void JITHelper::watchObjectSize(const std::string& symbol){
+		std::lock_guard<std::mutex> lock(code_mutex);
+		loading_sizes[symbol] = 0;
 	}
 
-	//std::cout << "Parsing if" << std::endl;
-	//std::cout << get_tok_name(cur_tok) << std::endl;
-	if (cur_tok != TOK::ELSE_TOK){
-		return Error("ParseIfExpr: Invalid syntax, expect 'else'");
+	uint64_t JITHelper::takeObjectSize(const std::string& symbol){
+		std::lock_guard<std::mutex> lock(code_mutex);
+		auto iter = loading_sizes.find(symbol);
+		if (iter == loading_sizes.end())
+			return 0;
+		uint64_t size = iter->second;
+		loading_sizes.erase(iter);
+		return size;
 	}
-	get_next_tok(input); //eat 'else'
-	elseexpr = ParseExpression(input);
 
-	if (elseexpr == nullptr){
-		return nullptr;
+	//the definitions collected so far keep the old kind of calls
+	void JITHelper::setStubCalls(bool stub){
+		if (stub != stub_calls)
+			submitOpenModule();
+		stub_calls = stub;
 	}
 
-	get_next_tok(input);
-	return IfExprAST::factory(ifexpr, thenexpr, elseexpr);
-}
 
+	Module* JITHelper::getModuleForNewFunction(){
+		if (kernelModule)
+			return kernelModule;
+		Module*& target = batching_expr ? this->exprModule : this->openModule;
+		if (target)
+			return target;
 
-//, varʼ, һǶԡin壬Щʹ롮inexpression
-//
-//varexpr :: = 'var' identifier('=' expression) ? (',' identifier('=' expression) ? )* 'in' expression
-static ExprAST* ParseVarExpr(std::istream& input){
-	get_next_tok(input);//eat 'var'
+		std::string module_name = getUniqueMCJITName(batching_expr ? "cool_jit_expr_module_" : "cool_jit_module_");
 
-	std::vector<std::pair<std::string, ExprAST*>> variables;
-	if (cur_tok != TOK::IDENTIFIER_TOK){
-		return Error("ParseVarExpr: invalid syntax, expect indentifier at beigin of var expression");
+		Module* newModule = new Module(module_name, *context.getContext());
+		//ÿmoduleʹsessiontarget, ŻJITһ
+		newModule->setTargetTriple(pipeline->getTarget().triple);
+		newModule->setDataLayout(jit->getDataLayout());
+		target = newModule;
+		return target;
 	}
 
-	while (true) {
-		std::string var_name = cur_identifier;
-		get_next_tok(input);
-		ExprAST* init_expr = nullptr;
-		//ĳʼǿѡģ
-		if (cur_tok == '='){
-			init_expr = ParseExpression(input);
-			if (init_expr == nullptr){
-				return nullptr;
-			}
+	//openModuleѾJITĺвָʾFuntion*;
+	Function* JITHelper::getFunction(const std::string& name){
+		Module* current_module = kernelModule ? kernelModule : batching_expr ? exprModule : openModule;
+		if (current_module){
+			if (Function* find_func = current_module->getFunction(name))
+				return find_func;
 		}
-		variables.push_back(std::make_pair(var_name, init_expr));
-		get_next_tok(input);
-		if (cur_tok == ','){
-			get_next_tok(input);
-			if (cur_tok != TOK::IDENTIFIER_TOK){
-				return Error("ParseVarExpr: expect identifer");
+
+		FunctionType* func_type = nullptr;
+		if (batching_expr && openModule){
+			if (Function* find_func = openModule->getFunction(name))
+				func_type = find_func->getFunctionType();
+		}
+		if (!func_type){
+			JITSymbolEntry entry;
+			if (!symbols.find(name, entry)){
+				KPP_LOG(LOG_DEBUG, "Could not find the function %s", name.c_str());
+				return nullptr;
 			}
+			func_type = entry.type;
 		}
-		else if (cur_tok == TOK::IN_TOK)
-			break;
-		else
-			return Error("ParseVarExpr: Invalid syntax");
-	}
-
-	get_next_tok(input);//eat in;
 
-	ExprAST* body = ParseExpression(input);
+		//module, ڵǰmoduleд
+		KPP_LOG(LOG_DEBUG, "creating ExternalLinkage for function %s", name.c_str());
+		return Function::Create(func_type, Function::ExternalLinkage, name, getModuleForNewFunction());
+	}
 
-	if (body == nullptr){
-		return nullptr;
+	//record the functions of a module handed to the JIT, the internal ones (parfor bodies) are not visible outside it
+	void JITHelper::registerSymbols(Module* module){
+		for (auto iter = module->begin(); iter != module->end(); ++iter) {
+			if (iter->hasLocalLinkage())
+				continue;
+			symbols.add(iter->getName(), module->getModuleIdentifier(), iter->getFunctionType(), !iter->isDeclaration());
+		}
 	}
 
-	return VarExprAST::factory(variables, body);
-}
+	//hand openModule to the JIT
+	//lazy mode only emits the stubs here, with compile threads the module is compiled in the background
+	bool JITHelper::submitOpenModule(){
+		if (!openModule)
+			return true;
 
-//********************************************
-//			code generation
-//********************************************
+		Module* module = openModule;
+		openModule = nullptr;
+		open_definitions = 0;
+		std::vector<std::string> definitions;
+		{
+			auto lock = context.getLock();
+			registerSymbols(module);
+			if (loaded_profile)
+				loaded_profile->applyTo(module);
+			for (auto iter = module->begin(); iter != module->end(); ++iter) {
+				if (!iter->isDeclaration() && !iter->hasLocalLinkage())
+					definitions.push_back(iter->getName().str());
+			}
+		}
 
+		orc::ThreadSafeModule tsm(std::unique_ptr<Module>(module), context);
+		Error err = compile_threads ? jit->addIRModule(std::move(tsm)) : jit->addLazyIRModule(std::move(tsm));
+		if (err){
+			KPP_LOG(LOG_ERROR, "Could not add module to the JIT: %s", toString(std::move(err)).c_str());
+			return false;
+		}
+		if (compile_threads)
+			compileInBackground(std::move(definitions));
+		return true;
+	}
 
+	//start compiling the functions just added to the JIT, without waiting for the result
+	//the compile thread records the addresses in the symbol table, getSymbolAddress only waits for code not ready yet
+	void JITHelper::compileInBackground(std::vector<std::string> names){
+		if (names.empty())
+			return;
 
-//creat an alloca instruction in the entry block of the function
-//ջϴ洢ʹñɱ޸
-static AllocaInst* CreateEntryBlockAlloca(Function *TheFunction, const std::string &VarName, Type* _type){
+		orc::SymbolLookupSet lookup_set;
+		std::map<orc::SymbolStringPtr, std::string> mangled_names;
+		for (const std::string& name : names) {
+			orc::SymbolStringPtr mangled = jit->mangleAndIntern(name);
+			lookup_set.add(mangled);
+			mangled_names[mangled] = name;
+		}
 
-	//
-	IRBuilder<> tmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
-	return tmpB.CreateAlloca(_type, 0, VarName.c_str());
-}
+		orc::ExecutionSession& session = jit->getExecutionSession();
+		SymbolTable& table = symbols;
+		session.lookup(orc::LookupKind::Static, orc::makeJITDylibSearchOrder(&jit->getMainJITDylib()), std::move(lookup_set),
+			orc::SymbolState::Ready, [&session, &table, mangled_names](Expected<orc::SymbolMap> result){
+				if (!result){
+					session.reportError(result.takeError());
+					return;
+				}
+				for (auto& kv : *result) {
+					auto iter = mangled_names.find(kv.first);
+					if (iter != mangled_names.end())
+						table.setAddress(iter->second, jitTargetAddressToPointer<void*>(kv.second.getAddress()));
+				}
+			}, orc::NoDependenciesToRegister);
+	}
 
+	//func and the internal functions it refers to, the bodies of its parfor loops
+	static void collectOutlinedBodies(Function* func, SmallPtrSetImpl<const GlobalValue*>& bodies){
+		if (!bodies.insert(func).second)
+			return;
+		for (Instruction& inst : instructions(func)) {
+			for (Value* operand : inst.operands()) {
+				Function* callee = dyn_cast<Function>(operand);
+				if (callee && callee->hasLocalLinkage() && !callee->isDeclaration())
+					collectOutlinedBodies(callee, bodies);
+			}
+		}
+	}
 
-Value* DoubleValue::Codegen(){
-	return ConstantFP::get(getGlobalContext(), APFloat(value));
-}
+	//check a new definition against the functions already in the JIT, called with the context locked
+	//with stubbed calls the body leaves openModule as the bitcode of its version, the first version puts the stub in its place
+	//returns false if the definition is rejected, func is erased then
+	bool JITHelper::addDefinition(Function* func){
+		std::string name = func->getName().str();
+		JITSymbolEntry entry;
+		bool defined = symbols.find(name, entry) && entry.defined;
+		auto iter = stubs.find(name);
+
+		if (iter == stubs.end()){
+			if (defined){
+				ErrorF(stub_calls ? "redefinition of a function defined with direct calls" : "redefinition of function, use :calls stub");
+				func->eraseFromParent();
+				return false;
+			}
+			if (!stub_calls)
+				return true;
+		}
+		else if (iter->second->type != func->getFunctionType()){
+			ErrorF("redefinition with a different number of arguments");
+			func->eraseFromParent();
+			return false;
+		}
 
-Value* IntegerValue::Codegen(){
-	//return ConstantInt::get(getGlobalContext(), APInt(32, value, true));
-	return ConstantFP::get(getGlobalContext(), APFloat((double)value));
-}
+		StubRecord* record;
+		if (iter == stubs.end()){
+			record = new StubRecord();
+			record->owner = this;
+			record->slot = nullptr;
+			record->used = 0;
+			record->name = name;
+			record->type = func->getFunctionType();
+			record->version = 0;
+			record->code_size = 0;
+			record->compiled = false;
+			stubs[name] = record;
+			stub_clock.push_back(record);
+		}
+		else
+			record = iter->second;
+
+		//resolveStub reads the record on the threads running JIT code, it is only changed under stub_mutex
+		std::string body_name = name + ".v" + std::to_string(record->version + 1);
+		std::string bitcode;
+		func->setName(body_name);
+
+		//the body and its parfor bodies, the rest of openModule only as declarations
+		SmallPtrSet<const GlobalValue*, 4> cloned;
+		collectOutlinedBodies(func, cloned);
+		ValueToValueMapTy value_map;
+		std::unique_ptr<Module> body_module = CloneModule(*func->getParent(), value_map,
+			[&cloned](const GlobalValue* value){ return cloned.count(value) != 0; });
+		raw_string_ostream bitcode_stream(bitcode);
+		WriteBitcodeToFile(*body_module, bitcode_stream);
+		bitcode_stream.flush();
+		for (const GlobalValue* value : cloned) {
+			const_cast<GlobalValue*>(value)->dropAllReferences();
+		}
+		for (const GlobalValue* value : cloned) {
+			const_cast<GlobalValue*>(value)->eraseFromParent();
+		}
 
-Value* VariableExprAST::Codegen(){
-	Value* _val = namedValues[name];
-	if (!_val){
-		return nullptr;
-	}
-	return Builder.CreateLoad(_val, name);
-}
+		{
+			//the callers keep calling the stub, the next call compiles the new version
+			//the old version may still be running, it is released at the next safe point
+			std::lock_guard<std::mutex> lock(stub_mutex);
+			if (record->version){
+				record->slot.store(nullptr, std::memory_order_release);
+				if (record->tracker || record->counters)
+					retired_code.push_back(RetiredCode{ record->tracker, record->code_size, std::move(record->counters) });
+				record->tracker = nullptr;
+				KPP_LOG(LOG_INFO, "%s redefined", name.c_str());
+			}
+			++record->version;
+			record->body_name = body_name;
+			record->bitcode.swap(bitcode);
+			record->compiled = false;
+			record->hot = false;
+		}
 
-Value* UnaryExpAST::Codegen(){
-	//úִУ
-	Value *unary_val = expr->Codegen();
-	if (!unary_val){
-		return nullptr;
+		if (record->version == 1)
+			createStub(record, openModule);
+		return true;
 	}
 
-	//unary functionַ;
-	Function* func_address = TheModule->getFunction(std::string("unary") + unary_op);
-
-	if (func_address == nullptr){
-		return ErrorV("UnaryExpAST: couldn't find the unary opeartor function");
+	//	define double @f(double %x){
+	//		store atomic i8 1, &record->used monotonic
+	//		%target = load atomic &record->slot acquire
+	//		if %target is null, %target = kpp_jit_resolve(record)
+	//		%r = musttail call %target(%x)
+	//		ret %r
+	//	}
+	//the record is in the host and never freed, its address is a constant of the stub
+	void JITHelper::createStub(StubRecord* record, Module* module){
+		LLVMContext& ctx = module->getContext();
+		FunctionType* type = record->type;
+		PointerType* target_type = type->getPointerTo();
+		Type* int64_type = Type::getInt64Ty(ctx);
+		Type* int8_ptr_type = Type::getInt8PtrTy(ctx);
+
+		Function* stub = Function::Create(type, Function::ExternalLinkage, record->name, module);
+		BasicBlock* entry_block = BasicBlock::Create(ctx, "entry", stub);
+		BasicBlock* resolve_block = BasicBlock::Create(ctx, "resolve", stub);
+		BasicBlock* call_block = BasicBlock::Create(ctx, "call", stub);
+
+		IRBuilder<> builder(entry_block);
+		Value* used = builder.CreateIntToPtr(ConstantInt::get(int64_type, (uint64_t)(uintptr_t)&record->used), int8_ptr_type);
+		StoreInst* mark = builder.CreateStore(ConstantInt::get(Type::getInt8Ty(ctx), 1), used);
+		mark->setAtomic(AtomicOrdering::Monotonic);
+		mark->setAlignment(Align(1));
+		Value* slot = builder.CreateIntToPtr(ConstantInt::get(int64_type, (uint64_t)(uintptr_t)&record->slot), target_type->getPointerTo());
+		LoadInst* target = builder.CreateLoad(target_type, slot, "target");
+		target->setAtomic(AtomicOrdering::Acquire);
+		target->setAlignment(Align(8));
+		builder.CreateCondBr(builder.CreateIsNull(target), resolve_block, call_block);
+
+		builder.SetInsertPoint(resolve_block);
+		FunctionCallee resolver = module->getOrInsertFunction("kpp_jit_resolve", FunctionType::get(int8_ptr_type, int8_ptr_type, false));
+		Value* record_address = builder.CreateIntToPtr(ConstantInt::get(int64_type, (uint64_t)(uintptr_t)record), int8_ptr_type);
+		Value* resolved = builder.CreateBitCast(builder.CreateCall(resolver, record_address), target_type);
+		builder.CreateBr(call_block);
+
+		builder.SetInsertPoint(call_block);
+		PHINode* callee = builder.CreatePHI(target_type, 2, "callee");
+		callee->addIncoming(target, entry_block);
+		callee->addIncoming(resolved, resolve_block);
+		std::vector<Value*> args;
+		for (auto arg = stub->arg_begin(); arg != stub->arg_end(); ++arg) {
+			args.push_back(&*arg);
+		}
+		CallInst* call = builder.CreateCall(type, callee, args);
+		call->setTailCallKind(CallInst::TCK_MustTail);
+		builder.CreateRet(call);
 	}
 
+	//compile the current version of a stubbed function and store it into the slot, called by kpp_jit_resolve
+	//the body is parsed from its bitcode into a context of its own and has its own ResourceTracker, so it can be evicted
+	void* JITHelper::resolveStub(StubRecord* record){
+		std::lock_guard<std::mutex> lock(stub_mutex);
+		if (void* address = record->slot.load(std::memory_order_acquire))
+			return address;
 
-	return Builder.CreateCall(func_address, unary_val, "unop");
-}
-
-Value*  BinaryExprAST::Codegen(){
-
-	DEBUG_CERR("BinaryExprAST codegen\n");
-	if (binary_op == '='){
-		if (VariableExprAST* left_expr = dynamic_cast<VariableExprAST*>(lhs)){
-			Value* right_val = rhs->Codegen();
-			if (right_val == nullptr){
+		if (!record->tracker){
+			orc::ThreadSafeContext body_context(std::make_unique<LLVMContext>());
+			auto body_module = parseBitcodeFile(MemoryBufferRef(record->bitcode, record->body_name), *body_context.getContext());
+			if (!body_module){
+				KPP_LOG(LOG_ERROR, "Could not read the bitcode of %s: %s", record->body_name.c_str(), toString(body_module.takeError()).c_str());
 				return nullptr;
 			}
 
-			Value* variable = namedValues[left_expr->getName()];
-
-			if (variable == nullptr){
-				return ErrorV("BinaryExprAST codegen: No such variable");
+			//hot after the tier up, or found in --profile-in; counted while below the threshold
+			Function* body = (*body_module)->getFunction(record->body_name);
+			const FunctionProfile* profile = nullptr;
+			FunctionProfile counted;
+			if (record->hot && record->counters){
+				counted = getCountedProfile(record);
+				profile = &counted;
 			}
-			Builder.CreateStore(right_val, variable);
-			return right_val;
+			else if (loaded_profile && !record->counters)
+				profile = loaded_profile->find(record->name, body);
+			record->code_name = record->body_name;
+			if (profile){
+				//the instrumented code may still be running under its own name
+				ProfileData::attach(body, *profile);
+				body->setName(record->body_name + ".hot");
+				(*body_module)->addModuleFlag(Module::Warning, "kpp.hot", 1);
+				record->code_name = body->getName().str();
+				record->hot = true;
+			}
+			else if (pgo_threshold)
+				instrumentBody(record, body);
+
+			watchObjectSize(record->code_name);
+			record->tracker = jit->getMainJITDylib().createResourceTracker();
+			if (auto err = jit->addIRModule(record->tracker, orc::ThreadSafeModule(std::move(*body_module), body_context))){
+				KPP_LOG(LOG_ERROR, "Could not add %s to the JIT: %s", record->code_name.c_str(), toString(std::move(err)).c_str());
+				takeObjectSize(record->code_name);
+				record->tracker = nullptr;
+				return nullptr;
+			}
+			if (record->compiled)
+				++recompilations;
 		}
-		else
-			return ErrorV("binary_op '=' need identifer at left ");
-	}
 
-	Value *left_val = lhs->Codegen();
+		auto symbol = jit->lookup(record->code_name);
+		if (!symbol){
+			KPP_LOG(LOG_ERROR, "Could not compile %s: %s", record->code_name.c_str(), toString(symbol.takeError()).c_str());
+			takeObjectSize(record->code_name);
+			return nullptr;
+		}
+		if (!record->compiled || !record->code_size)
+			record->code_size = takeObjectSize(record->code_name);
+		record->compiled = true;
 
-	Value *right_val = rhs->Codegen();
-	if (left_val == nullptr || right_val == nullptr){
-		return nullptr;
+		void* address = jitTargetAddressToPointer<void*>(symbol->getAddress());
+		record->slot.store(address, std::memory_order_release);
+		return address;
 	}
 
-	switch (binary_op)
-	{
-	case '+':
-		return Builder.CreateFAdd(left_val, right_val, "addtmp");
-	case '-':
-		return Builder.CreateFSub(left_val, right_val, "subtmp");
-	case '*':
-		return Builder.CreateFMul(left_val, right_val, "multmp");
-	case '/':
-		return Builder.CreateFDiv(left_val, right_val, "divtmp");
-	case '<':
-	{
-		/*std::cout << "left double? " << (left_val->getType()->isDoubleTy()) << std::endl;
-		std::cout << "right double >" << (right_val->getType()->isDoubleTy()) << std::endl;
-		std::cout << "typeid of left is" << (left_val->getType()->getTypeID()) << std::endl;*/
+	//take the code of a stubbed function out of the JIT, the next call compiles it again
+	void JITHelper::unloadStub(StubRecord* record){
+		record->slot.store(nullptr, std::memory_order_release);
+		if (!record->tracker)
+			return;
+		if (auto err = record->tracker->remove())
+			KPP_LOG(LOG_ERROR, "Could not remove %s from the JIT: %s", record->code_name.c_str(), toString(std::move(err)).c_str());
+		record->tracker = nullptr;
+		code_bytes -= record->code_size;
+	}
+
+	//evict cold stubbed functions until the code fits into the budget, with the clock algorithm:
+	//a function called since the last pass only loses its used flag, the ones not called are evicted
+	//called by the main loop between two statements, no JIT code is running then, see atSafePoint
+	void JITHelper::enforceCodeBudget(){
+		if (!code_budget || code_bytes <= code_budget || stub_clock.empty())
+			return;
 
-		left_val = Builder.CreateFCmpULT(left_val, right_val, "cmplesstmp");
-		return Builder.CreateUIToFP(left_val, Type::getDoubleTy(getGlobalContext()), "booltmp");
+		std::lock_guard<std::mutex> lock(stub_mutex);
+		for (size_t steps = 2 * stub_clock.size(); steps != 0 && code_bytes > code_budget; --steps) {
+			StubRecord* record = stub_clock[clock_hand];
+			clock_hand = (clock_hand + 1) % stub_clock.size();
+			if (!record->tracker)
+				continue;
+			if (record->used.exchange(0))
+				continue;
+			unloadStub(record);
+			++evictions;
+		}
 	}
-	default:
-		break;
+
+	//called by the main loop between two statements, no JIT code is running then
+	//an engine does not know about the threads of its host calling the functions it looked up, it only collects in kpp::Engine::collect
+	void JITHelper::atSafePoint(){
+		if (collect_at_safe_points)
+			collect();
 	}
 
-	Function* func_address = theHelper->getFunction(std::string("binary") + binary_op);
+	//free the code replaced or tiered up, and evict cold code above the budget; no JIT code may be running
+	void JITHelper::collect(){
+		releaseRetiredCode();
+		enforceCodeBudget();
+	}
 
-	if (func_address == nullptr){
-		return ErrorV("BinaryExprAST codegen: couldn't find the binary operator");
+	void JITHelper::setPGO(uint64_t threshold, const ProfileData* profile){
+		pgo_threshold = threshold;
+		loaded_profile = profile;
+		if ((threshold || profile) && !hot_pipeline)
+			hot_pipeline = new OptPipeline(3, pipeline->getTarget());
 	}
-	Value* func_args[] = { left_val, right_val };
-	return Builder.CreateCall(func_address, func_args, "calltmp");
-}
 
+	//	calls = ++counters[0]
+	//	if calls == pgo_threshold, kpp_jit_tier_up(record)
+	//and before every conditional branch
+	//	++counters[condition ? 1 + 2 * i : 2 + 2 * i]
+	//the counters are plain loads and stores, a count lost by a race only makes the profile a little less exact
+	void JITHelper::instrumentBody(StubRecord* record, Function* body){
+		std::vector<BranchInst*> branches;
+		ProfileData::getBranches(body, branches);
+		uint64_t shape = ProfileData::getShape(body);
+		if (!record->counters || record->shape != shape){
+			record->counters.reset(new uint64_t[1 + 2 * branches.size()]());
+			record->branch_count = branches.size();
+			record->shape = shape;
+		}
 
-Value* CallExprAST::Codegen(){
+		LLVMContext& ctx = body->getContext();
+		Type* int64_type = Type::getInt64Ty(ctx);
+		Type* int8_ptr_type = Type::getInt8PtrTy(ctx);
+		auto counter = [&](size_t index) -> Constant* {
+			return ConstantExpr::getIntToPtr(ConstantInt::get(int64_type, (uint64_t)(uintptr_t)&record->counters[index]), int64_type->getPointerTo());
+		};
+		auto increment = [&](IRBuilder<>& builder, Value* address) -> Value* {
+			Value* count = builder.CreateAdd(builder.CreateLoad(int64_type, address), ConstantInt::get(int64_type, 1));
+			builder.CreateStore(count, address);
+			return count;
+		};
+
+		for (size_t i = 0; i < branches.size(); ++i) {
+			IRBuilder<> builder(branches[i]);
+			increment(builder, builder.CreateSelect(branches[i]->getCondition(), counter(1 + 2 * i), counter(2 + 2 * i)));
+		}
 
-	Function* call_func = theHelper->getFunction(this->func_name);
+		//after the allocas, mem2reg only promotes the ones of the entry block
+		BasicBlock::iterator insert_point = body->getEntryBlock().begin();
+		while (isa<AllocaInst>(*insert_point)) {
+			++insert_point;
+		}
+		IRBuilder<> builder(&body->getEntryBlock(), insert_point);
+		Value* calls = increment(builder, counter(0));
+		Instruction* tier_up_point = SplitBlockAndInsertIfThen(builder.CreateICmpEQ(calls, ConstantInt::get(int64_type, pgo_threshold)),
+			&*builder.GetInsertPoint(), false);
+		builder.SetInsertPoint(tier_up_point);
+		FunctionCallee tier_up = body->getParent()->getOrInsertFunction("kpp_jit_tier_up",
+			FunctionType::get(Type::getVoidTy(ctx), int8_ptr_type, false));
+		builder.CreateCall(tier_up, builder.CreateIntToPtr(ConstantInt::get(int64_type, (uint64_t)(uintptr_t)record), int8_ptr_type));
+	}
 
-	DEBUG_CERR("Get function success\n");
+	FunctionProfile JITHelper::getCountedProfile(StubRecord* record){
+		FunctionProfile profile;
+		profile.shape = record->shape;
+		profile.entry_count = record->counters ? record->counters[0] : 0;
+		for (unsigned i = 0; record->counters && i < record->branch_count; ++i) {
+			profile.branches.push_back(std::make_pair(record->counters[1 + 2 * i], record->counters[2 + 2 * i]));
+		}
+		return profile;
+	}
 
-	if (call_func == nullptr){
-		return ErrorV("unknown function referenced");
+	//called by the instrumented code at the pgo_threshold-th call, through kpp_jit_tier_up
+	//the next call through the stub compiles the hot version, the instrumented code is still on the stack
+	//and is only removed at the next safe point
+	void JITHelper::tierUp(StubRecord* record){
+		std::lock_guard<std::mutex> lock(stub_mutex);
+		if (record->hot || !record->tracker)
+			return;
+		record->slot.store(nullptr, std::memory_order_release);
+		retired_code.push_back(RetiredCode{ record->tracker, record->code_size, nullptr });
+		record->tracker = nullptr;
+		record->compiled = false;
+		record->hot = true;
+		++tier_ups;
 	}
 
+	//tierUp adds to retired_code on the threads running JIT code, it is only read under stub_mutex
+	void JITHelper::releaseRetiredCode(){
+		std::lock_guard<std::mutex> lock(stub_mutex);
+		if (retired_code.empty())
+			return;
+		for (RetiredCode& retired : retired_code) {
+			if (!retired.tracker)
+				continue;
+			if (auto err = retired.tracker->remove())
+				KPP_LOG(LOG_ERROR, "Could not remove replaced code from the JIT: %s", toString(std::move(err)).c_str());
+			code_bytes -= retired.code_size;
+		}
+		retired_code.clear();
+	}
 
-	if (call_func->arg_size() != func_args.size()){
-		return ErrorV("Incorrect arguments passed");
+	//the counts of every function instrumented, by the name of the function
+	void JITHelper::collectProfiles(ProfileData& data){
+		std::lock_guard<std::mutex> lock(stub_mutex);
+		for (StubRecord* record : stub_clock) {
+			if (record->counters)
+				data.set(record->name, getCountedProfile(record));
+		}
 	}
 
-	std::vector<Value*> args;
+	void JITHelper::printProfileStats(){
+		std::lock_guard<std::mutex> lock(stub_mutex);
+		unsigned counted = 0, hot = 0;
+		for (StubRecord* record : stub_clock) {
+			if (record->counters)
+				++counted;
+			if (record->hot)
+				++hot;
+		}
+		if (pgo_threshold)
+			kpp_print("pgo: hot after %llu calls, ", (unsigned long long)pgo_threshold);
+		else
+			kpp_print("pgo: no instrumentation, ");
+		kpp_print("%u functions counted, %u hot, %u tier ups\n", counted, hot, tier_ups);
+		for (StubRecord* record : stub_clock) {
+			if (record->hot && record->counters)
+				kpp_print("  %s: %llu calls\n", record->name.c_str(), (unsigned long long)record->counters[0]);
+			else if (record->hot)
+				kpp_print("  %s: from the profile\n", record->name.c_str());
+		}
+	}
 
-	for (auto expr : func_args) {
-		Value* cur_arg = expr->Codegen();
-		if (!cur_arg){
+	void JITHelper::printCodeStats(){
+		unsigned resident = 0;
+		for (StubRecord* record : stub_clock) {
+			if (record->tracker)
+				++resident;
+		}
+		kpp_print("JIT code: %llu bytes", (unsigned long long)code_bytes.load());
+		if (code_budget)
+			kpp_print(", budget %llu bytes", (unsigned long long)code_budget);
+		kpp_print("\nstubbed functions: %zu, %u compiled, %u evictions, %u recompilations\n",
+			stub_clock.size(), resident, evictions, recompilations);
+	}
+
+	//with compile threads, the definitions start compiling while the next ones are parsed
+	//a module takes definitions_per_module of them, fewer bigger modules cost less to hand to ORC and to link
+	//lazy mode keeps collecting them in openModule until an expression needs them
+	//a stubbed definition is handed to the JIT at once, the next definition of the same name goes into a new module
+	void JITHelper::submitDefinitions(){
+		if (!openModule)
+			return;
+		if (stub_calls){
+			submitOpenModule();
+			return;
+		}
+		if (!compile_threads)
+			return;
+		if (++open_definitions < definitions_per_module)
+			return;
+		submitOpenModule();
+	}
+
+	//a function defined with arity arguments, for kpp::Engine::lookup; nullptr if there is none
+	void* JITHelper::getFunctionAddress(const std::string& name, unsigned arity){
+		if (!submitOpenModule())
 			return nullptr;
+		JITSymbolEntry entry;
+		if (!symbols.find(name, entry) || !entry.defined || entry.type->getNumParams() != arity)
+			return nullptr;
+		return getSymbolAddress(name);
+	}
+
+	void JITHelper::addBatchedExpr(Function* func){
+		//keep the expressions out of the driver, inlining thousands of them makes one huge function for the optimizer
+		func->addFnAttr(Attribute::NoInline);
+		batched_exprs.push_back(func);
+	}
+
+	//compile exprModule as a whole, without lazy stubs, and run the batched expressions in order
+	//a driver function calls every expression and stores the values into results
+	bool JITHelper::runBatchedExprs(std::vector<double>& results){
+		results.clear();
+		if (batched_exprs.empty())
+			return true;
+		ExprBatch batch;
+		return submitBatchedExprs(batch) && runExprBatch(batch, results);
+	}
+
+	//add exprModule to the JIT with a driver function calling every batched expression, and start a new batch
+	//the batch can be run on another thread, while the next expressions are compiled
+	bool JITHelper::submitBatchedExprs(ExprBatch& batch){
+		//the definitions used by the expressions must be in the JIT first
+		if (!submitOpenModule())
+			return false;
+
+		batch.driver_name = getUniqueMCJITName("anony_batch_");
+		{
+			//the lock must be released before the lookup, the compile threads need it to copy the module
+			auto lock = context.getLock();
+			LLVMContext& ctx = *context.getContext();
+			Type* double_type = Type::getDoubleTy(ctx);
+			FunctionType* driver_type = FunctionType::get(Type::getVoidTy(ctx), PointerType::getUnqual(double_type), false);
+			Function* driver = Function::Create(driver_type, Function::ExternalLinkage, batch.driver_name, exprModule);
+
+			IRBuilder<> builder(BasicBlock::Create(ctx, "entry", driver));
+			Value* out = &*driver->arg_begin();
+			for (size_t i = 0; i != batched_exprs.size(); ++i) {
+				Value* value = builder.CreateCall(batched_exprs[i], None, "exprtmp");
+				builder.CreateStore(value, builder.CreateConstGEP1_64(double_type, out, i));
+			}
+			builder.CreateRetVoid();
 		}
-		args.push_back(cur_arg);
+
+		batch.expr_count = batched_exprs.size();
+		Module* module = exprModule;
+		exprModule = nullptr;
+		batched_exprs.clear();
+
+		//nothing can call the expressions again, their code is removed after the run
+		batch.tracker = jit->getMainJITDylib().createResourceTracker();
+		watchObjectSize(batch.driver_name);
+		if (auto err = jit->addIRModule(batch.tracker, orc::ThreadSafeModule(std::unique_ptr<Module>(module), context))){
+			KPP_LOG(LOG_ERROR, "Could not add module to the JIT: %s", toString(std::move(err)).c_str());
+			takeObjectSize(batch.driver_name);
+			return false;
+		}
+		return true;
 	}
 
-	DEBUG_CERR("Arguments initialization success\n");
+	//compile and run a batch of submitBatchedExprs, the values of the expressions go to results in order
+	bool JITHelper::runExprBatch(ExprBatch& batch, std::vector<double>& results){
+		typedef void(*driver_type_ptr)(double*);
+		PhaseTimer lookup_timer(PHASE_LOOKUP);
+		auto driver_symbol = jit->lookup(batch.driver_name);
+		lookup_timer.stop();
+		uint64_t size = takeObjectSize(batch.driver_name);
+		if (!driver_symbol){
+			KPP_LOG(LOG_ERROR, "Could not find the batch function %s: %s", batch.driver_name.c_str(), toString(driver_symbol.takeError()).c_str());
+			return false;
+		}
+
+		results.resize(batch.expr_count);
+		driver_type_ptr driver_func = jitTargetAddressToPointer<driver_type_ptr>(driver_symbol->getAddress());
+		{
+			PhaseTimer timer(PHASE_RUN);
+			driver_func(results.data());
+		}
 
-	if (call_func->empty()){
-		fprintf(stderr, "It is empty\n");
+		if (auto err = batch.tracker->remove())
+			KPP_LOG(LOG_ERROR, "Could not remove %s from the JIT: %s", batch.driver_name.c_str(), toString(std::move(err)).c_str());
+		else
+			code_bytes -= size;
+		batch.tracker = nullptr;
+		return true;
 	}
 
-	return Builder.CreateCall(call_func, args, "calltmp");
-}
+	//the functions called by the kernel must be in the JIT, the definition is compiled into kernelModule next
+	bool JITHelper::beginKernel(){
+		if (!submitOpenModule())
+			return false;
+		auto lock = context.getLock();
+		kernelModule = new Module(getUniqueMCJITName("cool_jit_kernel_module_"), *context.getContext());
+		kernelModule->setTargetTriple(pipeline->getTarget().triple);
+		kernelModule->setDataLayout(jit->getDataLayout());
+		return true;
+	}
 
-Value* IfExprAST::Codegen(){
-	Value* cond_val = ifexpr->Codegen();
-	if (!cond_val){
-		return nullptr;
+	//	define void @f.batch<k>(double* noalias %col0, ..., double* noalias %out, i64 %n){
+	//		for i < n: out[i] = f(col0[i], ...)
+	//	}
+	//	define void @f.batch<k>.columns(double** %cols, double* %out, i64 %n)
+	//body is the definition of f compiled into kernelModule, it becomes internal and always inlined,
+	//so the loop has no calls left unless f calls other functions, and the vectorizer can widen it
+	//called with the context locked, body is nullptr if the definition could not be compiled again
+	bool JITHelper::finishKernel(Function* body, BatchKernel& kernel){
+		Module* module = kernelModule;
+		kernelModule = nullptr;
+		if (!body){
+			delete module;
+			return false;
+		}
+
+		std::string name = body->getName().str();
+		std::string kernel_name = name + ".batch" + std::to_string(++kernel_count);
+		body->setName(name + ".inline");
+		body->setLinkage(GlobalValue::InternalLinkage);
+		body->addFnAttr(Attribute::AlwaysInline);
+
+		LLVMContext& ctx = module->getContext();
+		Type* double_type = Type::getDoubleTy(ctx);
+		Type* double_ptr_type = double_type->getPointerTo();
+		Type* int64_type = Type::getInt64Ty(ctx);
+		unsigned arity = body->arg_size();
+
+		std::vector<Type*> param_types(arity + 1, double_ptr_type);
+		param_types.push_back(int64_type);
+		Function* rows = Function::Create(FunctionType::get(Type::getVoidTy(ctx), param_types, false),
+			Function::ExternalLinkage, kernel_name, module);
+		for (unsigned i = 0; i <= arity; ++i) {
+			rows->addParamAttr(i, Attribute::NoAlias);
+			rows->addParamAttr(i, Attribute::NoCapture);
+			if (i < arity)
+				rows->addParamAttr(i, Attribute::ReadOnly);
+		}
+		Value* n = rows->getArg(arity + 1);
+
+		BasicBlock* entry_block = BasicBlock::Create(ctx, "entry", rows);
+		BasicBlock* loop_block = BasicBlock::Create(ctx, "loop", rows);
+		BasicBlock* exit_block = BasicBlock::Create(ctx, "exit", rows);
+		IRBuilder<> builder(entry_block);
+		builder.CreateCondBr(builder.CreateICmpEQ(n, ConstantInt::get(int64_type, 0)), exit_block, loop_block);
+
+		builder.SetInsertPoint(loop_block);
+		PHINode* index = builder.CreatePHI(int64_type, 2, "i");
+		index->addIncoming(ConstantInt::get(int64_type, 0), entry_block);
+		std::vector<Value*> args;
+		for (unsigned i = 0; i < arity; ++i) {
+			args.push_back(builder.CreateLoad(double_type, builder.CreateInBoundsGEP(double_type, rows->getArg(i), index)));
+		}
+		Value* result = builder.CreateCall(body, args);
+		builder.CreateStore(result, builder.CreateInBoundsGEP(double_type, rows->getArg(arity), index));
+		Value* next = builder.CreateAdd(index, ConstantInt::get(int64_type, 1), "next", true, true);
+		index->addIncoming(next, loop_block);
+		builder.CreateCondBr(builder.CreateICmpEQ(next, n), exit_block, loop_block);
+
+		builder.SetInsertPoint(exit_block);
+		builder.CreateRetVoid();
+
+		Function* columns = Function::Create(FunctionType::get(Type::getVoidTy(ctx), { double_ptr_type->getPointerTo(), double_ptr_type, int64_type }, false),
+			Function::ExternalLinkage, kernel_name + ".columns", module);
+		builder.SetInsertPoint(BasicBlock::Create(ctx, "entry", columns));
+		args.clear();
+		for (unsigned i = 0; i < arity; ++i) {
+			args.push_back(builder.CreateLoad(double_ptr_type, builder.CreateConstInBoundsGEP1_64(double_ptr_type, columns->getArg(0), i)));
+		}
+		args.push_back(columns->getArg(1));
+		args.push_back(columns->getArg(2));
+		builder.CreateCall(rows, args);
+		builder.CreateRetVoid();
+
+		if (verifyModule(*module, &errs())){
+			delete module;
+			return false;
+		}
+
+		//kernels are never removed, the host may keep their addresses
+		if (auto err = jit->addIRModule(orc::ThreadSafeModule(std::unique_ptr<Module>(module), context))){
+			KPP_LOG(LOG_ERROR, "Could not add the kernel of %s to the JIT: %s", name.c_str(), toString(std::move(err)).c_str());
+			return false;
+		}
+		kernel.symbol = kernel_name;
+		kernel.arity = arity;
+		kernel.rows = nullptr;
+		kernel.columns = nullptr;
+		return true;
 	}
-	cond_val = Builder.CreateFCmpONE(cond_val, ConstantFP::get(getGlobalContext(), APFloat(0.0)), "ifcond");
 
-	Function* theFunc = Builder.GetInsertBlock()->getParent();
+	//compile the kernel added by finishKernel, without the context locked
+	bool JITHelper::resolveKernel(BatchKernel& kernel){
+		auto rows = jit->lookup(kernel.symbol);
+		if (!rows){
+			KPP_LOG(LOG_ERROR, "Could not compile %s: %s", kernel.symbol.c_str(), toString(rows.takeError()).c_str());
+			return false;
+		}
+		auto columns = jit->lookup(kernel.symbol + ".columns");
+		if (!columns){
+			KPP_LOG(LOG_ERROR, "Could not compile %s.columns: %s", kernel.symbol.c_str(), toString(columns.takeError()).c_str());
+			return false;
+		}
+		kernel.rows = jitTargetAddressToPointer<void*>(rows->getAddress());
+		kernel.columns = jitTargetAddressToPointer<void(*)(const double* const*, double*, uint64_t)>(columns->getAddress());
+		return true;
+	}
 
-	BasicBlock* thenBB = BasicBlock::Create(getGlobalContext(), "then", theFunc);
-	BasicBlock* elseBB = BasicBlock::Create(getGlobalContext(), "else");
+	//the address is looked up in the JIT once and then cached in the symbol table
+	//with lazy compilation it is the address of the stub, which stays valid after the body is compiled
+	void* JITHelper::getSymbolAddress(const std::string& name){
+		JITSymbolEntry entry;
+		bool found = symbols.find(name, entry);
+		if (found && entry.address)
+			return entry.address;
+
+		PhaseTimer timer(PHASE_LOOKUP, name);
+		auto symbol = jit->lookup(name);
+		timer.stop();
+		if (!symbol){
+			consumeError(symbol.takeError());
+			return nullptr;
+		}
 
-	BasicBlock* mergeBB = BasicBlock::Create(getGlobalContext(), "ifcond");
+		void* address = jitTargetAddressToPointer<void*>(symbol->getAddress());
+		if (found)
+			symbols.setAddress(name, address);
+		return address;
+	}
 
-	Builder.CreateCondBr(cond_val, thenBB, elseBB);
+	//modules handed to the JIT are owned by ORC, only openModule can be printed
+	void JITHelper::dump(raw_ostream& out){
+		if (openModule){
+			openModule->print(out, nullptr);
+		}
+	}
 
-	Builder.SetInsertPoint(thenBB);
-	Value* then_val = thenexpr->Codegen();
 
-	if (then_val == nullptr){
-		return nullptr;
+	//ahead-of-time compiler, kppc mode
+	//the whole script goes into one module, top-level expressions become the init function of the module
+	class AOTCompiler : public CodegenHelper{
+	public:
+		enum EmitKind{
+			EMIT_OBJECT,
+			EMIT_SHARED,
+			EMIT_EXECUTABLE,
+		};
+
+	private:
+		LLVMContext& context;
+		OptPipeline* pipeline;
+		std::unique_ptr<TargetMachine> target_machine;
+		std::unique_ptr<Module> module;
+		std::vector<Function*> init_exprs;
+		const ProfileData* profile;
+
+		void addRuntime();
+		Function* createInitFunction(const std::string& name);
+		bool emitObjectFile(const std::string& path);
+		bool writeHeader(const std::string& path, const std::string& init_name);
+		bool link(const std::string& object_path, const std::string& output, EmitKind kind);
+
+	public:
+		AOTCompiler(LLVMContext& ctx, OptPipeline* pm);
+		bool isValid()const{ return target_machine != nullptr; }
+		Module* getModuleForNewFunction() override{ return module.get(); }
+		Function* getFunction(const std::string& name) override;
+		void addInitExpr(Function* func);
+		void setProfile(const ProfileData* data){ profile = data; }
+		bool emit(const std::string& output, EmitKind kind);
+	};
+
+
+	AOTCompiler::AOTCompiler(LLVMContext& ctx, OptPipeline* pm) :context(ctx), pipeline(pm), profile(nullptr){
+		const TargetSpec& spec = pipeline->getTarget();
+		const std::string& triple = spec.triple;
+		std::string err;
+		const Target* target = TargetRegistry::lookupTarget(triple, err);
+		if (!target){
+			KPP_LOG(LOG_ERROR, "Could not find the target %s: %s", triple.c_str(), err.c_str());
+			return;
+		}
+
+		//PIC, so that the same object can go into a shared library
+		target_machine.reset(target->createTargetMachine(triple, spec.cpu, spec.features, TargetOptions(),
+			Optional<Reloc::Model>(Reloc::PIC_), None, pipeline->getCodeGenOptLevel()));
+
+		module.reset(new Module(getUniqueMCJITName("cool_aot_module_"), context));
+		module->setTargetTriple(triple);
+		module->setDataLayout(target_machine->createDataLayout());
 	}
 
-	//֧ת
-	Builder.CreateBr(mergeBB);
-	//then expresssion codegenܻᴴbasicBlockthen expression
-	//basic blockܲԭthenBB
-	thenBB = Builder.GetInsertBlock();
-	theFunc->getBasicBlockList().push_back(elseBB);
+	Function* AOTCompiler::getFunction(const std::string& name){
+		Function* func = module->getFunction(name);
+		if (!func){
+			KPP_LOG(LOG_DEBUG, "Could not find the function %s", name.c_str());
+		}
+		return func;
+	}
 
-	Builder.SetInsertPoint(elseBB);
+	void AOTCompiler::addInitExpr(Function* func){
+		//anonymous functions are only called by the init function
+		func->setLinkage(Function::InternalLinkage);
+		init_exprs.push_back(func);
+	}
 
-	Value* else_val = elseexpr->Codegen();
+	//the library functions of the JIT host, printd and putchard, are defined in the module when the script uses them
+	void AOTCompiler::addRuntime(){
+		Type* double_type = Type::getDoubleTy(context);
+		Type* int_type = Type::getInt32Ty(context);
+
+		Function* printd = module->getFunction("printd");
+		if (printd && printd->isDeclaration() && printd->arg_size() == 1){
+			FunctionCallee printf_func = module->getOrInsertFunction("printf",
+				FunctionType::get(int_type, PointerType::getUnqual(Type::getInt8Ty(context)), true));
+			IRBuilder<> builder(BasicBlock::Create(context, "entry", printd));
+			builder.CreateCall(printf_func, { builder.CreateGlobalStringPtr("%f\n", "printd_fmt"), &*printd->arg_begin() });
+			builder.CreateRet(ConstantFP::get(double_type, 0.0));
+			printd->setLinkage(Function::InternalLinkage);
+		}
 
-	if (else_val == nullptr){
-		return nullptr;
+		Function* putchard = module->getFunction("putchard");
+		if (putchard && putchard->isDeclaration() && putchard->arg_size() == 1){
+			FunctionCallee putchar_func = module->getOrInsertFunction("putchar", FunctionType::get(int_type, int_type, false));
+			IRBuilder<> builder(BasicBlock::Create(context, "entry", putchard));
+			builder.CreateCall(putchar_func, builder.CreateFPToSI(&*putchard->arg_begin(), int_type));
+			builder.CreateRet(ConstantFP::get(double_type, 0.0));
+			putchard->setLinkage(Function::InternalLinkage);
+		}
 	}
 
-	Builder.CreateBr(mergeBB);
+	//void <name>(void), runs the top-level expressions in order
+	Function* AOTCompiler::createInitFunction(const std::string& name){
+		FunctionType* init_type = FunctionType::get(Type::getVoidTy(context), false);
+		Function* init = Function::Create(init_type, Function::ExternalLinkage, name, module.get());
+		IRBuilder<> builder(BasicBlock::Create(context, "entry", init));
+		for (Function* expr : init_exprs) {
+			builder.CreateCall(expr);
+		}
+		builder.CreateRetVoid();
+		return init;
+	}
 
-	elseBB = Builder.GetInsertBlock();
+	bool AOTCompiler::emitObjectFile(const std::string& path){
+		std::error_code ec;
+		raw_fd_ostream out(path, ec, sys::fs::OF_None);
+		if (ec){
+			KPP_LOG(LOG_ERROR, "Could not open %s: %s", path.c_str(), ec.message().c_str());
+			return false;
+		}
 
-	theFunc->getBasicBlockList().push_back(mergeBB);
+		legacy::PassManager codegen_pm;
+		if (target_machine->addPassesToEmitFile(codegen_pm, out, nullptr, CGFT_ObjectFile)){
+			KPP_LOG(LOG_ERROR, "The target can not emit object files");
+			return false;
+		}
+		{
+			PhaseTimer timer(PHASE_EMIT, module->getModuleIdentifier());
+			codegen_pm.run(*module);
+		}
+		//a failed write, a full disk, shows up at the flush
+		out.close();
+		if (out.has_error()){
+			KPP_LOG(LOG_ERROR, "Could not write %s: %s", path.c_str(), out.error().message().c_str());
+			out.clear_error();
+			return false;
+		}
+		return true;
+	}
 
-	Builder.SetInsertPoint(mergeBB);
+	//C header declaring the exported kpp functions and the init function <stem>_init
+	bool AOTCompiler::writeHeader(const std::string& path, const std::string& init_name){
+		std::error_code ec;
+		raw_fd_ostream out(path, ec, sys::fs::OF_Text);
+		if (ec){
+			KPP_LOG(LOG_ERROR, "Could not open %s: %s", path.c_str(), ec.message().c_str());
+			return false;
+		}
+
+		std::string guard = "KPP_" + init_name.substr(0, init_name.size() - 5) + "_H";
+		for (auto& ch : guard) ch = toupper(ch);
+
+		out << "/* generated by kppc, do not edit */\n";
+		out << "#ifndef " << guard << "\n#define " << guard << "\n\n";
+		out << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+		out << "/* runs the top-level expressions of the script */\n";
+		out << "void " << init_name << "(void);\n\n";
+		for (auto iter = module->begin(); iter != module->end(); ++iter) {
+			if (iter->isDeclaration() || iter->hasLocalLinkage() || iter->getName() == init_name)
+				continue;
+			//operators are exported too, but their names are not C identifiers
+			std::string name = iter->getName().str();
+			if (name.empty() || !(isalpha(name[0]) || name[0] == '_') ||
+				name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") != std::string::npos)
+				continue;
+
+			out << "double " << name << "(";
+			for (size_t i = 0; i != iter->arg_size(); ++i) {
+				out << (i ? ", " : "") << "double";
+			}
+			out << (iter->arg_size() ? ");\n" : "void);\n");
+		}
+		out << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n";
+		out.close();
+		if (out.has_error()){
+			KPP_LOG(LOG_ERROR, "Could not write %s: %s", path.c_str(), out.error().message().c_str());
+			out.clear_error();
+			return false;
+		}
+		return true;
+	}
+
+	//link with the system compiler driver, $CC or cc
+	bool AOTCompiler::link(const std::string& object_path, const std::string& output, EmitKind kind){
+		PhaseTimer timer(PHASE_LINK, module->getModuleIdentifier());
+		const char* cc_env = getenv("CC");
+		std::string cc_name = cc_env && *cc_env ? cc_env : "cc";
+		auto cc = sys::findProgramByName(cc_name);
+		if (!cc){
+			KPP_LOG(LOG_ERROR, "Could not find the linker driver %s", cc_name.c_str());
+			return false;
+		}
+
+		std::vector<StringRef> args = { *cc };
+		if (kind == EMIT_SHARED)
+			args.push_back("-shared");
+		args.push_back("-o");
+		args.push_back(output);
+		args.push_back(object_path);
+		args.push_back("-lm");
+
+		std::string err;
+		if (sys::ExecuteAndWait(*cc, args, None, {}, 0, 0, &err) != 0){
+			KPP_LOG(LOG_ERROR, "Link failed %s", err.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	bool AOTCompiler::emit(const std::string& output, EmitKind kind){
+		//<stem>_init, the stem of the output file as a C identifier
+		std::string init_name = sys::path::stem(output).str();
+		for (auto& ch : init_name) {
+			if (!isalnum(ch)) ch = '_';
+		}
+		if (init_name.empty() || isdigit(init_name[0]))
+			init_name = "kpp_" + init_name;
+		init_name += "_init";
+
+		addRuntime();
+		Function* init = createInitFunction(init_name);
+
+		if (kind == EMIT_EXECUTABLE){
+			//int main(), runs the init function
+			Type* int_type = Type::getInt32Ty(context);
+			Function* main_func = Function::Create(FunctionType::get(int_type, false), Function::ExternalLinkage, "main", module.get());
+			IRBuilder<> builder(BasicBlock::Create(context, "entry", main_func));
+			builder.CreateCall(init);
+			builder.CreateRet(ConstantInt::get(int_type, 0));
+		}
+
+		if (verifyModule(*module, &errs())){
+			KPP_LOG(LOG_ERROR, "Invalid module generated");
+			return false;
+		}
+		//the counts of a --pgo run, for the functions whose IR has not changed since
+		if (profile)
+			profile->applyTo(module.get());
+		pipeline->run(module.get());
+
+		if (kind == EMIT_OBJECT){
+			SmallString<128> header_path(output);
+			sys::path::replace_extension(header_path, "h");
+			return emitObjectFile(output) && writeHeader(header_path.str().str(), init_name);
+		}
+
+		SmallString<128> object_path;
+		if (std::error_code ec = sys::fs::createTemporaryFile("kppc", "o", object_path)){
+			KPP_LOG(LOG_ERROR, "Could not create temporary file: %s", ec.message().c_str());
+			return false;
+		}
+		bool success = emitObjectFile(object_path.str().str()) && link(object_path.str().str(), output, kind);
+		sys::fs::remove(object_path);
+
+		if (success && kind == EMIT_SHARED){
+			SmallString<128> header_path(output);
+			sys::path::replace_extension(header_path, "h");
+			success = writeHeader(header_path.str().str(), init_name);
+		}
+		return success;
+	}
 
-	PHINode *if_phi_node = Builder.CreatePHI(Type::getDoubleTy(getGlobalContext()), 2, "iftmp");
-	if_phi_node->addIncoming(then_val, thenBB);
-	if_phi_node->addIncoming(else_val, elseBB);
-	return if_phi_node;
 }
+//end anonymous namespace
 
 
-Value* ForExprAST::Codegen(){
-	// Output this as:
-	//   var = alloca double
-	//   ...
-	//   start = startexpr
-	//   store start -> var
-	//   goto loop
-	// loop:
-	//   ...
-	//   bodyexpr
-	//   ...
-	// loopend:
-	//   step = stepexpr
-	//   endcond = endexpr
-	//
-	//   curvar = load var
-	//   nextvar = curvar + step
-	//   store nextvar -> var
-	//   br endcond, loop, endloop
-	// outloop:
-	Function* theFunc = Builder.GetInsertBlock()->getParent();
-	Value* startVal = start->Codegen();
+//****************************************
+//GlobalVariabls for llvm
+//****************************************
 
-	if (startVal == nullptr){
-		return nullptr;
+static orc::ThreadSafeContext& getThreadSafeContext(){
+	return theSession->context;
+}
+
+static LLVMContext& getGlobalContext(){
+	return *theSession->context.getContext();
+}
+
+//the JIT goes first, it waits for its compile threads, which may still use the object cache
+void kpp::Session::stopJIT(){
+	delete helper;
+	helper = nullptr;
+	delete jit_memory;
+	jit_memory = nullptr;
+	codegen = compiler;
+}
+
+kpp::Session::~Session(){
+	stopJIT();
+	delete compiler;
+	delete pipeline;
+	delete profile;
+	delete object_cache;
+	for (auto& kv : arrays) {
+		delete kv.second;
+	}
+	for (auto& kv : exprast_pool) {
+		delete kv.first;
+	}
+}
+
+
+
+
+/******************************************************/
+/*******************   Parser *************************/
+/******************************************************/
+int32_t get_next_tok(std::istream& input){
+	theSession->cur_tok = get_tok(input);
+	KPP_LOG(LOG_TRACE, "token %s", get_tok_name(theSession->cur_tok).c_str());
+	return theSession->cur_tok;
+}
+
+
+static int32_t get_precedence(char bi_op){
+	//printf("%d\n", bi_op);
+	//assert(isascii(bi_op));
+	int32_t precedence = theSession->binary_op_precedence[bi_op];
+	if (precedence <= 0){
+		return -1;
 	}
+	return precedence;
+}
 
 
-	AllocaInst *var_alloca = CreateEntryBlockAlloca(theFunc, var_name, startVal->getType());
-	Builder.CreateStore(startVal, var_alloca);
 
-	BasicBlock *loopBB = BasicBlock::Create(getGlobalContext(), "loop", theFunc);
-	Builder.CreateBr(loopBB);
-	Builder.SetInsertPoint(loopBB);
-	//restore the original value
-	AllocaInst* old_value = namedValues[var_name];
-	namedValues[var_name] = var_alloca;
-	//for expression Զһdouble 0, Ҫ¼bodyValue*
-	if (this->body->Codegen() == nullptr){
+static FunctionAST* ParseToplevelExpr(std::istream& input);
+static ExprAST* ParseExpression(std::istream& input);
+static PrototypeAST* ParseExtern(std::istream& input);
+static ExprAST* ParseIdentifierExpr(std::istream& input);
+static ExprAST* ParseUnary(std::istream& input);
+static ExprAST* ParseBinaryopRHS(std::istream& input, int32_t expr_prec, ExprAST* lhs);
+static ExprAST* ParsePrimary(std::istream& input);
+static ExprAST* ParseVarExpr(std::istream& input);
+static ExprAST* ParseForExpr(std::istream& input);
+static ExprAST* ParseParForExpr(std::istream& input);
+static ExprAST* ParseIfExpr(std::istream& input);
+static ExprAST* ParseNumber(std::istream& input);
+static ExprAST* ParseParenExpr(std::istream& input);
+
+
+static PrototypeAST* ParsePrototype(std::istream& input);
+static FunctionAST* ParseDefinition(std::istream& input);
+
+
+
+//toplevelexpr ::= expression
+//װΪ
+static FunctionAST* ParseToplevelExpr(std::istream& input){
+	PhaseTimer timer(PHASE_PARSE);
+	srand((unsigned int)time(nullptr));
+	if (ExprAST* expr = ParseExpression(input)){
+		std::string name = getUniqueAnonyName("anony_func_");
+		PrototypeAST* anonymous = PrototypeAST::factory(name, std::vector<std::string>(), 0, 0);
+		return FunctionAST::factory(anonymous, expr);
+	}
+	return nullptr;
+}
+
+
+//ʾʽunaryʽbinoprhsʽ
+//expression ::= unary binoprhs
+static ExprAST* ParseExpression(std::istream& input){
+	ExprAST* lhs = ParseUnary(input);
+	if (lhs == nullptr){
 		return nullptr;
 	}
+	return ParseBinaryopRHS(input, 0, lhs);
+}
 
-	Value* step_value;
+//unaryʽǰtokenΪoperator򷵻unaryExpAST, ǰunaryʽΪһprimaryʽûunary operator
+//unary
+//	:: = primary
+//	:: = op unary
+static ExprAST* ParseUnary(std::istream& input){
+	//ǰtokenΪoperatorǰʽΪһPrimaryʽ
+	if (!isascii(theSession->cur_tok) || theSession->cur_tok == '(' || theSession->cur_tok == ','){
+		return ParsePrimary(input);
+	}
 
-	if (step){
-		step_value = step->Codegen();
-		if (step_value == nullptr){
-			return ErrorV("ForExprAST codegen error");
-		}
+	char op = theSession->cur_tok;
+	get_next_tok(input);
+	KPP_LOG(LOG_TRACE, "unary op is %c", op);
+	if (ExprAST* expr = ParseUnary(input)){
+		return UnaryExpAST::factory(op, expr);
 	}
-	else
-		step_value = ConstantFP::get(getGlobalContext(), APFloat(1.0));
+	return nullptr;
+}
 
-	Value* end_val = end->Codegen();
 
-	if (end_val == nullptr){
-		return ErrorV("ForExprAST codegen error");
+//binoprhsԿܴڵbinary operator ExpASTн
+//ǰbinary operatorڻprecedenceСǰһbinary operatorprecedenceֱӷǰһexprAST:lhs
+//ǰbinary operatorprecedenceǰһbinary operatorprecedence
+//binoprhs
+//	:: =
+//	:: = ('bi_op' unary)*
+static ExprAST* ParseBinaryopRHS(std::istream& input, int32_t expr_prec, ExprAST* lhs){
+	while (true)
+	{
+		int32_t cur_prec = get_precedence(theSession->cur_tok);
+
+		if (cur_prec < expr_prec){
+			return lhs;
+		}
+
+		int32_t biop = theSession->cur_tok;
+
+		get_next_tok(input);
+
+		ExprAST* rhs = ParseUnary(input);
+		if (rhs == nullptr){
+			return nullptr;
+		}
+
+		int32_t nxt_prec = get_precedence(theSession->cur_tok);
+
+		//the operators binding tighter than biop belong to rhs, the others to the loop here
+		if (cur_prec < nxt_prec){
+			rhs = ParseBinaryopRHS(input, cur_prec + 1, rhs);
+			if (rhs == nullptr){
+				return nullptr;
+			}
+		}
+
+		lhs = BinaryExprAST::factory(biop, lhs, rhs);
+	}
+}
+
+//primaryʽʽ
+//primary
+//	:: = identifierexpr
+//	:: = numberexpr
+//	:: = parenexpr
+//	:: = ifexpr
+//	:: = forexpr
+//	:: = parforexpr
+//	:: = varexpr
+//
+
+static ExprAST* ParsePrimary(std::istream& input){
+	switch (theSession->cur_tok)
+	{
+	case TOK::DOUBLE_TOK:
+	case TOK::INT_TOK:
+		return ParseNumber(input);
+	case '(':
+		return ParseParenExpr(input);
+	case TOK::IDENTIFIER_TOK:
+		return ParseIdentifierExpr(input);
+	case TOK::FOR_TOK:
+		return ParseForExpr(input);
+	case TOK::PARFOR_TOK:
+		return ParseParForExpr(input);
+	case TOK::IF_TOK:
+		return ParseIfExpr(input);
+	case TOK::VAR_TOK:
+		return ParseVarExpr(input);
+	default:
+		get_next_tok(input);	//eat invalid token
+		return ErrorE("ParsePrimary: Invalid tok");
+	}
+}
+
+//űʽʽ
+//parenexpr :: = '(' expression ')'
+
+static ExprAST* ParseParenExpr(std::istream& input){
+	get_next_tok(input); //eat '('
+	ExprAST* ret = ParseExpression(input);
+	if (ret == nullptr){
+		return nullptr;
+	}
+
+	if (theSession->cur_tok != ')'){
+		return ErrorE("ParseParenExpr: expect ')' at last");
+	}
+	get_next_tok(input);//eat ')'
+
+	return ret;
+}
+
+
+//ǱԪأҲǺ
+//identifer normal form
+//identifierexpr:
+//	::=identifer
+//	::=identifer '[' expression ']'
+//	::=indeiffer ('expression*')
+
+static ExprAST* ParseIdentifierExpr(std::istream& input){
+
+	std::string var_name = theSession->cur_identifier;	//var_name, һܳԵĿǰcur_identifierstring
+	get_next_tok(input);//eat indetifer_tok;
+
+	if (theSession->cur_tok == '['){
+		get_next_tok(input);	//eat '['
+		ExprAST* index = ParseExpression(input);
+		if (!index){
+			return nullptr;
+		}
+		if (theSession->cur_tok != ']'){
+			return ErrorE("ParseIdentifier: expect ']' after array index");
+		}
+		get_next_tok(input);	//eat ']'
+		return ArrayIndexExprAST::factory(var_name, index);
+	}
+
+	if (theSession->cur_tok != '('){
+		return VariableExprAST::factory(var_name);
+	}
+
+	std::vector<ExprAST*> func_args;
+
+	get_next_tok(input);	//eat '('
+	if (theSession->cur_tok != ')'){
+		while (1){
+			ExprAST* expr = ParseExpression(input);
+
+			if (!expr){
+				return ErrorE("ParseIdentifier: Error in parsing function arguments");
+			}
+			func_args.push_back(expr);
+
+			if (theSession->cur_tok == ')'){
+				break;
+			}
+			else if (theSession->cur_tok != ','){
+				return ErrorE("ParseIdentifier: Expect ',' in arguments parsing");
+			}
+			get_next_tok(input);	//eat ','
+		}
+	}
+
+	get_next_tok(input);	//eat last ')';
+	CallExprAST* func_call = CallExprAST::factory(var_name, func_args);
+	return func_call;
+}
+
+
+static ExprAST* ParseNumber(std::istream& input){
+	if (theSession->cur_tok == TOK::INT_TOK){
+		get_next_tok(input);
+		return DoubleValue::factory((double)theSession->cur_integer);
+		//return IntegerValue::factory(cur_integer);
+	}
+	else if (theSession->cur_tok == TOK::DOUBLE_TOK){
+		get_next_tok(input);
+		return DoubleValue::factory(theSession->cur_double);
+	}
+	else
+		return ErrorE("ParseNumber: Error token given");
+}
+
+
+
+//forexpr ѭ
+//
+//forexpr :: = 'for' identifier '=' expr ','  (identifier  =  expr)*; expr(',' expr) ? 'in' expression
+static ExprAST* ParseForExpr(std::istream& input){
+	get_next_tok(input);
+	if (theSession->cur_tok != TOK::IDENTIFIER_TOK){
+		return ErrorE("ParseForExpr: error in for expression, expect a variable name");
+	}
+	std::string var_name = theSession->cur_identifier;
+
+	get_next_tok(input); //eat identifer
+	if (theSession->cur_tok != '='){
+		return ErrorE("ParseForExpr: error in for expression, expect '='");
+	}
+
+	get_next_tok(input);//eat '='
+
+
+	ExprAST *start = ParseExpression(input);
+	if (start == nullptr){
+		return nullptr;
+	}
+
+	if (theSession->cur_tok != ','){
+		return ErrorE("ParseForExpr: expect ',' after start expression");
+	}
+
+	get_next_tok(input); //eat ','
+
+	ExprAST *end = ParseExpression(input);
+
+	if (end == nullptr){
+		return nullptr;
+	}
+
+	//step if a optional
+	ExprAST* step = nullptr;
+	if (theSession->cur_tok == ','){
+		get_next_tok(input); //eat ','
+		step = ParseExpression(input);
+		if (step == nullptr){
+			return nullptr;
+		}
+	}
+
+	if (theSession->cur_tok != TOK::IN_TOK){
+		return ErrorE("ParseForExpr: expect 'in' in for expression");
+	}
+
+	get_next_tok(input);	//eat 'in'
+
+	ExprAST* block = ParseExpression(input);
+
+	if (block == nullptr){
+		return nullptr;
+	}
+
+	return ForExprAST::factory(var_name, start, end, step, block);
+
+}
+
+//parforexpr ѭ, identifierȡ[start, end)е, ε֮û˳
+//
+//parforexpr :: = 'parfor' identifier '=' expr ',' expr ('reduce' ('+' | '*' | 'min' | 'max'))? 'in' expression
+static ExprAST* ParseParForExpr(std::istream& input){
+	get_next_tok(input);	//eat 'parfor'
+	if (theSession->cur_tok != TOK::IDENTIFIER_TOK){
+		return ErrorE("ParseParForExpr: expect a variable name");
+	}
+	std::string var_name = theSession->cur_identifier;
+
+	get_next_tok(input); //eat identifer
+	if (theSession->cur_tok != '='){
+		return ErrorE("ParseParForExpr: expect '='");
+	}
+	get_next_tok(input);//eat '='
+
+	ExprAST *start = ParseExpression(input);
+	if (start == nullptr){
+		return nullptr;
+	}
+	if (theSession->cur_tok != ','){
+		return ErrorE("ParseParForExpr: expect ',' after start expression");
+	}
+	get_next_tok(input); //eat ','
+
+	ExprAST *end = ParseExpression(input);
+	if (end == nullptr){
+		return nullptr;
+	}
+
+	//reduce is not a keyword, it is only looked for here
+	ParforReduction reduction = PARFOR_NONE;
+	if (theSession->cur_tok == TOK::IDENTIFIER_TOK && theSession->cur_identifier == "reduce"){
+		get_next_tok(input);	//eat 'reduce'
+		if (theSession->cur_tok == '+')
+			reduction = PARFOR_ADD;
+		else if (theSession->cur_tok == '*')
+			reduction = PARFOR_MUL;
+		else if (theSession->cur_tok == TOK::IDENTIFIER_TOK && theSession->cur_identifier == "min")
+			reduction = PARFOR_MIN;
+		else if (theSession->cur_tok == TOK::IDENTIFIER_TOK && theSession->cur_identifier == "max")
+			reduction = PARFOR_MAX;
+		else
+			return ErrorE("ParseParForExpr: expect '+', '*', min or max after reduce");
+		get_next_tok(input);	//eat the operator
+	}
+
+	if (theSession->cur_tok != TOK::IN_TOK){
+		return ErrorE("ParseParForExpr: expect 'in' in parfor expression");
+	}
+	get_next_tok(input);	//eat 'in'
+
+	ExprAST* block = ParseExpression(input);
+	if (block == nullptr){
+		return nullptr;
+	}
+	return ParForExprAST::factory(var_name, start, end, block, reduction);
+}
+
+//'def' 庯
+//definition :: = 'def' prototype expression
+static FunctionAST* ParseDefinition(std::istream& input){
+	PhaseTimer timer(PHASE_PARSE);
+	get_next_tok(input); //eat 'def'
+
+	PrototypeAST *func_proto = ParsePrototype(input);
+	if (!func_proto){
+		return nullptr;
+	}
+	timer.setName(func_proto->getName());
+
+	ExprAST* body = ParseExpression(input);
+	if (!body){
+		return nullptr;
+	}
+
+	return FunctionAST::factory(func_proto, body);
+}
+
+//ԭͣ unary operator binary operator Ҳͨ
+//prototype
+//	:: = id '('id* ')'
+//	:: = binary LETTER number ? (id, id)
+//	:: = unary LETTER(id)
+static PrototypeAST* ParsePrototype(std::istream& input){
+
+	switch (theSession->cur_tok)
+	{
+	case TOK::IDENTIFIER_TOK://
+	{
+		std::string func_name = theSession->cur_identifier;
+		get_next_tok(input);//eat identifier;
+
+		if (theSession->cur_tok != '('){
+			return ErrorP("ParsePrototype: expect '(' at begin of function definition");
+		}
+		get_next_tok(input);
+		std::vector<std::string> func_args;
+
+		if (theSession->cur_tok != ')'){
+			while (1) {
+				if (theSession->cur_tok == TOK::IDENTIFIER_TOK){
+					func_args.push_back(theSession->cur_identifier);
+					get_next_tok(input);
+				}
+				else
+					break;
+			}
+		}
+
+		if (theSession->cur_tok != ')'){
+			return ErrorP("ParsePrototype: expect ')' at end of function prototype");
+		}
+		get_next_tok(input);
+		return PrototypeAST::factory(func_name, func_args);
+	}
+	case TOK::UNARY_TOK:
+	{
+		get_next_tok(input);//eat unary
+
+		std::string invalid_char = "[](){},/\\";
+		//if the cur_tok is visited and not a alpha or digit or brace, it is valid
+		if (theSession->cur_tok < 127 && theSession->cur_tok > 32 && !isalnum(theSession->cur_tok) && invalid_char.find(theSession->cur_tok) == std::string::npos){
+			char op = theSession->cur_tok;
+			get_next_tok(input);	//eat op
+
+			if (theSession->cur_tok != '('){
+				return ErrorP("ParsePrototype: expect '(' in unary definition");
+			}
+
+			get_next_tok(input);	//eat '('
+
+			if (theSession->cur_tok != TOK::IDENTIFIER_TOK){
+				return ErrorP("ParsePrototype: expect indentifier in unary arguments parsing");
+			}
+
+			std::string func_args = theSession->cur_identifier;
+
+			get_next_tok(input);	//eat identifer;
+
+
+			if (theSession->cur_tok != ')'){
+				return ErrorP("ParsePrototype: expect ')' at end of unary aguments parsing");
+			}
+
+			get_next_tok(input);	//eat ')'
+
+			return PrototypeAST::factory(std::string(1, op), std::vector<std::string>(1, func_args), 1);
+		}
+		else
+			return ErrorP("ParsePrototype: Invalid operater character in unary defination");
+
+	}
+	case TOK::BINARY_TOK:
+	{
+		get_next_tok(input);	//eat binary token;
+
+		std::string invalid_char = "[](){},/\\";
+		//if the cur_tok is visited and not a alpha or digit or brace, it is valid
+		if (theSession->cur_tok < 127 && theSession->cur_tok > 32 && !isalnum(theSession->cur_tok) && invalid_char.find(theSession->cur_tok) == std::string::npos){
+			char op = theSession->cur_tok;
+			get_next_tok(input);	//eat op
+			if (theSession->cur_tok != TOK::INT_TOK){
+				return ErrorP("ParsePrototype: expect a binary opeator precedence");
+			}
+
+			int32_t biop_prec = theSession->cur_integer;
+
+			get_next_tok(input);	//eat integer;
+
+			if (theSession->cur_tok != '('){
+				return ErrorP("ParsePrototype: expect '(' in binary operator definition");
+			}
+
+			get_next_tok(input);	//eat '('
+
+			std::vector<std::string> func_args;
+			if (theSession->cur_tok != TOK::IDENTIFIER_TOK){
+				return ErrorP("ParsePrototype: expect indentifier in binary arguments parser");
+			}
+
+			func_args.push_back(theSession->cur_identifier);
+
+			get_next_tok(input);	//eat identifer;
+
+			if (theSession->cur_tok != TOK::IDENTIFIER_TOK){
+				return ErrorP("ParsePrototype: expect indentifier in binary arguments parser");
+			}
+
+			func_args.push_back(theSession->cur_identifier);
+
+			get_next_tok(input);	//eat identifier;
+
+			if (theSession->cur_tok != ')'){
+				return ErrorP("ParsePrototype: expect ')' at end of binary operator aguments parser");
+			}
+
+			get_next_tok(input);	//eat ')'
+
+			return PrototypeAST::factory(std::string(1, op), func_args, 2, biop_prec);
+		}
+		else
+			return ErrorP("ParsePrototype: Invalid operater character in unary defination");
+	}
+	default:
+		return ErrorP("ParsePrototype: Invalid syntax in definition");
+	}
+
+}
+
+
+//external ʽⲿ, externؼʿʼ
+//external :: = 'extern' prototype
+
+static PrototypeAST* ParseExtern(std::istream& input){
+	PhaseTimer timer(PHASE_PARSE);
+	get_next_tok(input);//eat extern;
+	return ParsePrototype(input);
+}
+
+
+//ifelseexpr ʽ
+//
+//ifexpr :: = 'if' expression 'then' expression 'else' expression
+
+static ExprAST* ParseIfExpr(std::istream& input){
+	get_next_tok(input); //eat 'if'
+
+	ExprAST* ifexpr, *thenexpr, *elseexpr;
+
+	ifexpr = ParseExpression(input);
+
+	if (ifexpr == nullptr){
+		return nullptr;
+	}
+
+
+	if (theSession->cur_tok != TOK::THEN_TOK){
+		return ErrorE("ParseIfExpr: Invalid syntax, expect 'then'");
+	}
+
+	get_next_tok(input);	//eat 'then'
+
+	thenexpr = ParseExpression(input);
+
+	if (thenexpr == nullptr){
+		return nullptr;
+	}
+
+	//std::cout << "Parsing if" << std::endl;
+	//std::cout << get_tok_name(cur_tok) << std::endl;
+	if (theSession->cur_tok != TOK::ELSE_TOK){
+		return ErrorE("ParseIfExpr: Invalid syntax, expect 'else'");
+	}
+	get_next_tok(input); //eat 'else'
+	elseexpr = ParseExpression(input);
+
+	if (elseexpr == nullptr){
+		return nullptr;
+	}
+
+	return IfExprAST::factory(ifexpr, thenexpr, elseexpr);
+}
+
+
+//, varʼ, һǶԡin壬Щʹ롮inexpression
+//
+//varexpr :: = 'var' identifier('=' expression) ? (',' identifier('=' expression) ? )* 'in' expression
+static ExprAST* ParseVarExpr(std::istream& input){
+	get_next_tok(input);//eat 'var'
+
+	std::vector<std::pair<std::string, ExprAST*>> variables;
+	if (theSession->cur_tok != TOK::IDENTIFIER_TOK){
+		return ErrorE("ParseVarExpr: invalid syntax, expect indentifier at beigin of var expression");
+	}
+
+	while (true) {
+		std::string var_name = theSession->cur_identifier;
+		get_next_tok(input);
+		ExprAST* init_expr = nullptr;
+		//ĳʼǿѡģ
+		if (theSession->cur_tok == '='){
+			get_next_tok(input);	//eat '='
+			init_expr = ParseExpression(input);
+			if (init_expr == nullptr){
+				return nullptr;
+			}
+		}
+		variables.push_back(std::make_pair(var_name, init_expr));
+		if (theSession->cur_tok == ','){
+			get_next_tok(input);
+			if (theSession->cur_tok != TOK::IDENTIFIER_TOK){
+				return ErrorE("ParseVarExpr: expect identifer");
+			}
+		}
+		else if (theSession->cur_tok == TOK::IN_TOK)
+			break;
+		else
+			return ErrorE("ParseVarExpr: Invalid syntax");
+	}
+
+	get_next_tok(input);//eat in;
+
+	ExprAST* body = ParseExpression(input);
+
+	if (body == nullptr){
+		return nullptr;
+	}
+
+	return VarExprAST::factory(variables, body);
+}
+
+//********************************************
+//			code generation
+//********************************************
+
+
+
+//creat an alloca instruction in the entry block of the function
+//ջϴ洢ʹñɱ޸
+static AllocaInst* CreateEntryBlockAlloca(Function *TheFunction, const std::string &VarName, Type* _type){
+
+	//
+	IRBuilder<> tmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+	return tmpB.CreateAlloca(_type, 0, VarName.c_str());
+}
+
+
+//-g
+void DebugInfo::beginFunction(Function* func, const PrototypeAST* proto){
+	if (!enabled)
+		return;
+	Module* module = func->getParent();
+	DICompileUnit* unit = module->debug_compile_units().empty() ? nullptr : *module->debug_compile_units().begin();
+	DIBuilder builder(*module, true, unit);
+	if (!unit){
+		unit = builder.createCompileUnit(dwarf::DW_LANG_C, builder.createFile(file, directory), "kpp", theSession->pipeline->getOptLevel() != 0, "", 0);
+		module->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+		module->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+	}
+
+	//double f(double, ...)
+	DIType* double_type = builder.createBasicType("double", 64, dwarf::DW_ATE_float);
+	SmallVector<Metadata*, 8> types(proto->getArgCount() + 1, double_type);
+	DIFile* unit_file = unit->getFile();
+	DISubprogram* subprogram = builder.createFunction(unit_file, proto->getName(), func->getName(), unit_file, proto->getLine(),
+		builder.createSubroutineType(builder.getOrCreateTypeArray(types)), proto->getLine(), DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+	func->setSubprogram(subprogram);
+	builder.finalize();
+	theSession->Builder.SetCurrentDebugLocation(DILocation::get(func->getContext(), proto->getLine(), 0, subprogram));
+}
+
+//a call without a location can not be inlined into a function with debug info, they get the line of the definition
+//the code generated after it, e.g. the batch drivers, has no location
+void DebugInfo::finishFunction(Function* func){
+	if (!enabled)
+		return;
+	theSession->Builder.SetCurrentDebugLocation(DebugLoc());
+	DISubprogram* subprogram = func->getSubprogram();
+	if (!subprogram)
+		return;
+	for (Instruction& inst : instructions(func)) {
+		if (isa<CallBase>(inst) && !inst.getDebugLoc())
+			inst.setDebugLoc(DILocation::get(func->getContext(), subprogram->getLine(), 0, subprogram));
+	}
+}
+
+//the code generated next is at AST, in the function of the insert point; the parfor bodies have no debug info
+void DebugInfo::emitLocation(ExprAST* AST){
+	if (!enabled)
+		return;
+	BasicBlock* block = theSession->Builder.GetInsertBlock();
+	DISubprogram* subprogram = block ? block->getParent()->getSubprogram() : nullptr;
+	if (subprogram)
+		theSession->Builder.SetCurrentDebugLocation(DILocation::get(subprogram->getContext(), AST->getLine(), AST->getCol(), subprogram));
+	else
+		theSession->Builder.SetCurrentDebugLocation(DebugLoc());
+}
+
+Value* DoubleValue::Codegen(){
+	return ConstantFP::get(getGlobalContext(), APFloat(value));
+}
+
+Value* IntegerValue::Codegen(){
+	//return ConstantInt::get(getGlobalContext(), APInt(32, value, true));
+	return ConstantFP::get(getGlobalContext(), APFloat((double)value));
+}
+
+Value* VariableExprAST::Codegen(){
+	theSession->debug_info.emitLocation(this);
+	Value* _val = theSession->namedValues[name];
+	if (!_val){
+		return ErrorV("unknown variable name");
+	}
+	return theSession->Builder.CreateLoad(cast<AllocaInst>(_val)->getAllocatedType(), _val, name);
+}
+
+Value* UnaryExpAST::Codegen(){
+	theSession->debug_info.emitLocation(this);
+	//úִУ
+	Value *unary_val = expr->Codegen();
+	if (!unary_val){
+		return nullptr;
+	}
+
+	//unary functionַ;
+	Function* func_address = theSession->codegen->getFunction(std::string("unary") + unary_op);
+
+	if (func_address == nullptr){
+		return ErrorV("UnaryExpAST: couldn't find the unary opeartor function");
+	}
+
+
+	return theSession->Builder.CreateCall(func_address, unary_val, "unop");
+}
+
+Value*  BinaryExprAST::Codegen(){
+
+	KPP_LOG(LOG_TRACE, "BinaryExprAST codegen");
+	if (binary_op == '='){
+		if (VariableExprAST* left_expr = dynamic_cast<VariableExprAST*>(lhs)){
+			Value* right_val = rhs->Codegen();
+			if (right_val == nullptr){
+				return nullptr;
+			}
+			theSession->debug_info.emitLocation(this);
+
+			Value* variable = theSession->namedValues[left_expr->getName()];
+
+			if (variable == nullptr){
+				return ErrorV("BinaryExprAST codegen: No such variable");
+			}
+			theSession->Builder.CreateStore(right_val, variable);
+			return right_val;
+		}
+		else
+			return ErrorV("binary_op '=' need identifer at left ");
+	}
+
+	Value *left_val = lhs->Codegen();
+
+	Value *right_val = rhs->Codegen();
+	if (left_val == nullptr || right_val == nullptr){
+		return nullptr;
+	}
+	//the operation itself is at the operator, after the code of the operands
+	theSession->debug_info.emitLocation(this);
+
+	switch (binary_op)
+	{
+	case '+':
+		return theSession->Builder.CreateFAdd(left_val, right_val, "addtmp");
+	case '-':
+		return theSession->Builder.CreateFSub(left_val, right_val, "subtmp");
+	case '*':
+		return theSession->Builder.CreateFMul(left_val, right_val, "multmp");
+	case '/':
+		return theSession->Builder.CreateFDiv(left_val, right_val, "divtmp");
+	case '<':
+	{
+		/*std::cout << "left double? " << (left_val->getType()->isDoubleTy()) << std::endl;
+		std::cout << "right double >" << (right_val->getType()->isDoubleTy()) << std::endl;
+		std::cout << "typeid of left is" << (left_val->getType()->getTypeID()) << std::endl;*/
+
+		left_val = theSession->Builder.CreateFCmpULT(left_val, right_val, "cmplesstmp");
+		return theSession->Builder.CreateUIToFP(left_val, Type::getDoubleTy(getGlobalContext()), "booltmp");
+	}
+	default:
+		break;
+	}
+
+	Function* func_address = theSession->codegen->getFunction(std::string("binary") + binary_op);
+
+	if (func_address == nullptr){
+		return ErrorV("BinaryExprAST codegen: couldn't find the binary operator");
+	}
+	Value* func_args[] = { left_val, right_val };
+	return theSession->Builder.CreateCall(func_address, func_args, "calltmp");
+}
+
+
+static KppArray* find_array(const std::string& name);
+static Value* array_reduction_codegen(const std::string& builtin, const std::vector<KppArray*>& arrays);
+
+Value* CallExprAST::Codegen(){
+
+	//sum(a), dot(a, b) ... when the arguments are arrays
+	std::vector<KppArray*> arrays;
+	for (ExprAST* expr : func_args) {
+		VariableExprAST* variable = dynamic_cast<VariableExprAST*>(expr);
+		KppArray* array = variable ? find_array(variable->getName()) : nullptr;
+		if (!array)
+			break;
+		arrays.push_back(array);
+	}
+	if (!arrays.empty() && arrays.size() == func_args.size()){
+		theSession->debug_info.emitLocation(this);
+		return array_reduction_codegen(func_name, arrays);
+	}
+
+	Function* call_func = theSession->codegen->getFunction(this->func_name);
+
+	KPP_LOG(LOG_TRACE, "Get function success");
+
+	if (call_func == nullptr){
+		return ErrorV("unknown function referenced");
+	}
+
+
+	if (call_func->arg_size() != func_args.size()){
+		return ErrorV("Incorrect arguments passed");
+	}
+
+	std::vector<Value*> args;
+
+	for (auto expr : func_args) {
+		Value* cur_arg = expr->Codegen();
+		if (!cur_arg){
+			return nullptr;
+		}
+		args.push_back(cur_arg);
+	}
+
+	KPP_LOG(LOG_TRACE, "Arguments initialization success");
+	theSession->debug_info.emitLocation(this);
+
+	if (call_func->empty()){
+		KPP_LOG(LOG_TRACE, "%s is only declared in this module", call_func->getName().str().c_str());
+	}
+
+	return theSession->Builder.CreateCall(call_func, args, "calltmp");
+}
+
+//the array name, unless a variable hides it
+static KppArray* find_array(const std::string& name){
+	auto variable = theSession->namedValues.find(name);
+	if (variable != theSession->namedValues.end() && variable->second)
+		return nullptr;
+	auto iter = theSession->arrays.find(name);
+	return iter == theSession->arrays.end() ? nullptr : iter->second;
+}
+
+//the data and length in the view of array, loaded where they are used: the array may be bound again later
+static void load_array(KppArray* array, Value*& data, Value*& length){
+	LLVMContext& context = getGlobalContext();
+	Type* data_type = Type::getDoublePtrTy(context);
+	Type* int64_type = Type::getInt64Ty(context);
+	StructType* view_type = StructType::get(context, { data_type, int64_type });
+	Value* view = ConstantExpr::getIntToPtr(ConstantInt::get(int64_type, (uint64_t)&array->view), view_type->getPointerTo());
+	data = theSession->Builder.CreateLoad(data_type, theSession->Builder.CreateStructGEP(view_type, view, 0), "data");
+	length = theSession->Builder.CreateLoad(int64_type, theSession->Builder.CreateStructGEP(view_type, view, 1), "length");
+}
+
+Value* ArrayIndexExprAST::Codegen(){
+	theSession->debug_info.emitLocation(this);
+	KppArray* array = find_array(name);
+	if (!array){
+		return ErrorV(("unknown array " + name).c_str());
+	}
+	if (!theSession->helper){
+		return ErrorV("arrays need the JIT");
+	}
+	Value* index_val = index->Codegen();
+	if (!index_val){
+		return nullptr;
+	}
+
+	Function* theFunc = theSession->Builder.GetInsertBlock()->getParent();
+	Type* double_type = Type::getDoubleTy(getGlobalContext());
+	Value* data, *length;
+	load_array(array, data, length);
+	index_val = theSession->Builder.CreateFPToSI(index_val, Type::getInt64Ty(getGlobalContext()), "index");
+	//a negative index is a large unsigned one
+	Value* in_range = theSession->Builder.CreateICmpULT(index_val, length, "inrange");
+
+	BasicBlock* entryBB = theSession->Builder.GetInsertBlock();
+	BasicBlock* loadBB = BasicBlock::Create(getGlobalContext(), "element", theFunc);
+	BasicBlock* mergeBB = BasicBlock::Create(getGlobalContext(), "element.end", theFunc);
+	theSession->Builder.CreateCondBr(in_range, loadBB, mergeBB);
+	theSession->Builder.SetInsertPoint(loadBB);
+	Value* element = theSession->Builder.CreateLoad(double_type, theSession->Builder.CreateInBoundsGEP(double_type, data, index_val), name);
+	theSession->Builder.CreateBr(mergeBB);
+
+	theSession->Builder.SetInsertPoint(mergeBB);
+	PHINode* phi = theSession->Builder.CreatePHI(double_type, 2, name + ".element");
+	phi->addIncoming(ConstantFP::getNaN(double_type), entryBB);
+	phi->addIncoming(element, loadBB);
+	return phi;
+}
+
+//the reduction builtins over arrays
+//	sum(a)		the sum of the elements
+//	dot(a, b)	the sum of a[i] * b[i], over the length of the shorter one
+//	minv(a)		the smallest element, inf for an empty array, NaN elements are skipped
+//	maxv(a)		the largest element, -inf for an empty array
+//	norm2(a)	sqrt(dot(a, a))
+//	len(a)		the number of elements
+//the sums are not in the order of a scalar loop, they are vectorized with several accumulators
+enum ArrayReduction{
+	REDUCE_SUM,
+	REDUCE_DOT,
+	REDUCE_MIN,
+	REDUCE_MAX,
+	REDUCE_NORM2,
+};
+
+//	define internal double @kpp.<builtin>.v<width>(double* %x, double* %y, i64 %n){
+//		acc0 ... acc3 = <width x double> identity
+//		for i in [0, n rounded down to 4 * width), step 4 * width: acck = acck op x[i + k * width ...]
+//		s = horizontal reduction of acc0 op acc1 op acc2 op acc3
+//		for i in the rest: s = s op x[i]
+//		ret s
+//	}
+//four accumulators hide the latency of the vector adds, width is the vector register of the target
+static Function* get_reduction_function(ArrayReduction reduction, unsigned width){
+	static const char* names[] = { "sum", "dot", "minv", "maxv", "norm2" };
+	static const unsigned accumulators = 4;
+	Module* module = theSession->Builder.GetInsertBlock()->getModule();
+	std::string func_name = std::string("kpp.") + names[reduction] + ".v" + std::to_string(width);
+	if (Function* func = module->getFunction(func_name))
+		return func;
+
+	LLVMContext& context = getGlobalContext();
+	Type* double_type = Type::getDoubleTy(context);
+	Type* int64_type = Type::getInt64Ty(context);
+	FixedVectorType* vector_type = FixedVectorType::get(double_type, width);
+	FunctionType* type = FunctionType::get(double_type, { double_type->getPointerTo(), double_type->getPointerTo(), int64_type }, false);
+	Function* func = Function::Create(type, Function::InternalLinkage, func_name, module);
+	Function::arg_iterator arg_iter = func->arg_begin();
+	Value* x = &*arg_iter++;
+	Value* y = &*arg_iter++;
+	Value* n = &*arg_iter;
+	x->setName("x");
+	y->setName("y");
+	n->setName("n");
+
+	double identity = reduction == REDUCE_MIN ? HUGE_VAL : reduction == REDUCE_MAX ? -HUGE_VAL : 0.0;
+	Constant* scalar_identity = ConstantFP::get(double_type, identity);
+	Constant* vector_identity = ConstantVector::getSplat(ElementCount::getFixed(width), scalar_identity);
+	IRBuilder<> builder(BasicBlock::Create(context, "entry", func));
+	BasicBlock* entryBB = builder.GetInsertBlock();
+	BasicBlock* vectorBB = BasicBlock::Create(context, "vector", func);
+	BasicBlock* vectorEndBB = BasicBlock::Create(context, "vector.end", func);
+	BasicBlock* tailBB = BasicBlock::Create(context, "tail", func);
+	BasicBlock* exitBB = BasicBlock::Create(context, "exit", func);
+
+	//acc = acc op value, for scalars and vectors
+	auto combine = [&builder, reduction](Value* acc, Value* value, Value* other) -> Value*{
+		switch (reduction)
+		{
+		case REDUCE_MIN:
+			return builder.CreateMinNum(acc, value);
+		case REDUCE_MAX:
+			return builder.CreateMaxNum(acc, value);
+		case REDUCE_SUM:
+			return builder.CreateFAdd(acc, value);
+		default:
+			return builder.CreateIntrinsic(Intrinsic::fmuladd, { value->getType() }, { value, other, acc });
+		}
+	};
+
+	uint64_t step = (uint64_t)width * accumulators;
+	Value* vector_end = builder.CreateAnd(n, builder.getInt64(~(step - 1)), "vector.n");
+	builder.CreateCondBr(builder.CreateICmpUGT(vector_end, builder.getInt64(0)), vectorBB, vectorEndBB);
+
+	builder.SetInsertPoint(vectorBB);
+	PHINode* index = builder.CreatePHI(int64_type, 2, "index");
+	index->addIncoming(builder.getInt64(0), entryBB);
+	std::vector<PHINode*> accs;
+	std::vector<Value*> next_accs;
+	for (unsigned k = 0; k < accumulators; ++k) {
+		accs.push_back(builder.CreatePHI(vector_type, 2, "acc" + std::to_string(k)));
+		accs[k]->addIncoming(vector_identity, entryBB);
+	}
+	for (unsigned k = 0; k < accumulators; ++k) {
+		Value* offset = builder.CreateAdd(index, builder.getInt64(k * width));
+		Value* x_vector = builder.CreateAlignedLoad(vector_type,
+			builder.CreateBitCast(builder.CreateInBoundsGEP(double_type, x, offset), vector_type->getPointerTo()), Align(8));
+		Value* other = x_vector;
+		if (reduction == REDUCE_DOT){
+			other = builder.CreateAlignedLoad(vector_type,
+				builder.CreateBitCast(builder.CreateInBoundsGEP(double_type, y, offset), vector_type->getPointerTo()), Align(8));
+		}
+		next_accs.push_back(combine(accs[k], x_vector, other));
+	}
+	Value* next_index = builder.CreateNUWAdd(index, builder.getInt64(step), "index.next");
+	index->addIncoming(next_index, vectorBB);
+	for (unsigned k = 0; k < accumulators; ++k) {
+		accs[k]->addIncoming(next_accs[k], vectorBB);
+	}
+	builder.CreateCondBr(builder.CreateICmpULT(next_index, vector_end), vectorBB, vectorEndBB);
+
+	builder.SetInsertPoint(vectorEndBB);
+	std::vector<PHINode*> final_accs;
+	for (unsigned k = 0; k < accumulators; ++k) {
+		final_accs.push_back(builder.CreatePHI(vector_type, 2));
+		final_accs[k]->addIncoming(vector_identity, entryBB);
+		final_accs[k]->addIncoming(next_accs[k], vectorBB);
+	}
+	Value* total = nullptr;
+	for (PHINode* acc : final_accs) {
+		if (!total)
+			total = acc;
+		else if (reduction == REDUCE_MIN)
+			total = builder.CreateMinNum(total, acc);
+		else if (reduction == REDUCE_MAX)
+			total = builder.CreateMaxNum(total, acc);
+		else
+			total = builder.CreateFAdd(total, acc);
+	}
+	Value* vector_result;
+	if (reduction == REDUCE_MIN)
+		vector_result = builder.CreateFPMinReduce(total);
+	else if (reduction == REDUCE_MAX)
+		vector_result = builder.CreateFPMaxReduce(total);
+	else{
+		IRBuilderBase::FastMathFlagGuard guard(builder);
+		FastMathFlags flags;
+		flags.setAllowReassoc();
+		builder.setFastMathFlags(flags);
+		vector_result = builder.CreateFAddReduce(scalar_identity, total);
+	}
+	builder.CreateCondBr(builder.CreateICmpULT(vector_end, n), tailBB, exitBB);
+
+	builder.SetInsertPoint(tailBB);
+	PHINode* tail_index = builder.CreatePHI(int64_type, 2, "tail.index");
+	PHINode* tail_acc = builder.CreatePHI(double_type, 2, "tail.acc");
+	tail_index->addIncoming(vector_end, vectorEndBB);
+	tail_acc->addIncoming(vector_result, vectorEndBB);
+	Value* x_element = builder.CreateLoad(double_type, builder.CreateInBoundsGEP(double_type, x, tail_index));
+	Value* other = reduction == REDUCE_DOT ? builder.CreateLoad(double_type, builder.CreateInBoundsGEP(double_type, y, tail_index)) : x_element;
+	Value* next_tail_acc = combine(tail_acc, x_element, other);
+	Value* next_tail_index = builder.CreateNUWAdd(tail_index, builder.getInt64(1));
+	tail_index->addIncoming(next_tail_index, tailBB);
+	tail_acc->addIncoming(next_tail_acc, tailBB);
+	builder.CreateCondBr(builder.CreateICmpULT(next_tail_index, n), tailBB, exitBB);
+
+	builder.SetInsertPoint(exitBB);
+	PHINode* result = builder.CreatePHI(double_type, 2, "result");
+	result->addIncoming(vector_result, vectorEndBB);
+	result->addIncoming(next_tail_acc, tailBB);
+	if (reduction == REDUCE_NORM2)
+		builder.CreateRet(builder.CreateUnaryIntrinsic(Intrinsic::sqrt, result));
+	else
+		builder.CreateRet(result);
+	verifyFunction(*func);
+	return func;
+}
+
+static Value* array_reduction_codegen(const std::string& builtin, const std::vector<KppArray*>& arrays){
+	static const std::map<std::string, std::pair<int, unsigned>> builtins = {
+		{ "sum", { REDUCE_SUM, 1 } }, { "dot", { REDUCE_DOT, 2 } }, { "minv", { REDUCE_MIN, 1 } },
+		{ "maxv", { REDUCE_MAX, 1 } }, { "norm2", { REDUCE_NORM2, 1 } }, { "len", { -1, 1 } },
+	};
+	auto iter = builtins.find(builtin);
+	if (iter == builtins.end() || iter->second.second != arrays.size()){
+		return ErrorV(("no builtin " + builtin + " over " + std::to_string(arrays.size()) + " arrays").c_str());
+	}
+	if (!theSession->helper){
+		return ErrorV("arrays need the JIT");
+	}
+
+	Type* double_type = Type::getDoubleTy(getGlobalContext());
+	Value* x, *n;
+	load_array(arrays[0], x, n);
+	if (iter->second.first < 0){
+		return theSession->Builder.CreateUIToFP(n, double_type, "len");
+	}
+	Value* y = x;
+	if (arrays.size() == 2){
+		Value* y_length;
+		load_array(arrays[1], y, y_length);
+		n = theSession->Builder.CreateSelect(theSession->Builder.CreateICmpULT(y_length, n), y_length, n, "length");
+	}
+
+	if (!theSession->vector_doubles){
+		theSession->vector_doubles = std::max(theSession->pipeline->getVectorBitWidth() / 64, 2u);
+	}
+	Function* func = get_reduction_function((ArrayReduction)iter->second.first, theSession->vector_doubles);
+	return theSession->Builder.CreateCall(func, { x, y, n }, builtin);
+}
+
+Value* IfExprAST::Codegen(){
+	theSession->debug_info.emitLocation(this);
+	Value* cond_val = ifexpr->Codegen();
+	if (!cond_val){
+		return nullptr;
+	}
+	cond_val = theSession->Builder.CreateFCmpONE(cond_val, ConstantFP::get(getGlobalContext(), APFloat(0.0)), "ifcond");
+
+	Function* theFunc = theSession->Builder.GetInsertBlock()->getParent();
+
+	BasicBlock* thenBB = BasicBlock::Create(getGlobalContext(), "then", theFunc);
+	BasicBlock* elseBB = BasicBlock::Create(getGlobalContext(), "else");
+
+	BasicBlock* mergeBB = BasicBlock::Create(getGlobalContext(), "ifcond");
+
+	theSession->Builder.CreateCondBr(cond_val, thenBB, elseBB);
+
+	theSession->Builder.SetInsertPoint(thenBB);
+	Value* then_val = thenexpr->Codegen();
+
+	if (then_val == nullptr){
+		return nullptr;
+	}
+
+	//֧ת
+	theSession->Builder.CreateBr(mergeBB);
+	//then expresssion codegenܻᴴbasicBlockthen expression
+	//basic blockܲԭthenBB
+	thenBB = theSession->Builder.GetInsertBlock();
+	theFunc->getBasicBlockList().push_back(elseBB);
+
+	theSession->Builder.SetInsertPoint(elseBB);
+
+	Value* else_val = elseexpr->Codegen();
+
+	if (else_val == nullptr){
+		return nullptr;
+	}
+
+	theSession->Builder.CreateBr(mergeBB);
+
+	elseBB = theSession->Builder.GetInsertBlock();
+
+	theFunc->getBasicBlockList().push_back(mergeBB);
+
+	theSession->Builder.SetInsertPoint(mergeBB);
+
+	PHINode *if_phi_node = theSession->Builder.CreatePHI(Type::getDoubleTy(getGlobalContext()), 2, "iftmp");
+	if_phi_node->addIncoming(then_val, thenBB);
+	if_phi_node->addIncoming(else_val, elseBB);
+	return if_phi_node;
+}
+
+
+Value* ForExprAST::Codegen(){
+	theSession->debug_info.emitLocation(this);
+	// Output this as:
+	//   var = alloca double
+	//   ...
+	//   start = startexpr
+	//   store start -> var
+	//   goto loop
+	// loop:
+	//   ...
+	//   bodyexpr
+	//   ...
+	// loopend:
+	//   step = stepexpr
+	//   endcond = endexpr
+	//
+	//   curvar = load var
+	//   nextvar = curvar + step
+	//   store nextvar -> var
+	//   br endcond, loop, endloop
+	// outloop:
+	Function* theFunc = theSession->Builder.GetInsertBlock()->getParent();
+	Value* startVal = start->Codegen();
+
+	if (startVal == nullptr){
+		return nullptr;
+	}
+
+
+	AllocaInst *var_alloca = CreateEntryBlockAlloca(theFunc, var_name, startVal->getType());
+	theSession->Builder.CreateStore(startVal, var_alloca);
+
+	BasicBlock *loopBB = BasicBlock::Create(getGlobalContext(), "loop", theFunc);
+	theSession->Builder.CreateBr(loopBB);
+	theSession->Builder.SetInsertPoint(loopBB);
+	//restore the original value
+	AllocaInst* old_value = theSession->namedValues[var_name];
+	theSession->namedValues[var_name] = var_alloca;
+	//for expression Զһdouble 0, Ҫ¼bodyValue*
+	if (this->body->Codegen() == nullptr){
+		return nullptr;
+	}
+
+	Value* step_value;
+
+	if (step){
+		step_value = step->Codegen();
+		if (step_value == nullptr){
+			return ErrorV("ForExprAST codegen error");
+		}
+	}
+	else
+		step_value = ConstantFP::get(getGlobalContext(), APFloat(1.0));
+
+	Value* end_val = end->Codegen();
+
+	if (end_val == nullptr){
+		return ErrorV("ForExprAST codegen error");
+	}
+
+	Value* cur_val = theSession->Builder.CreateLoad(var_alloca->getAllocatedType(), var_alloca, var_name.c_str());
+	Value* next_val = theSession->Builder.CreateFAdd(cur_val, step_value, "nextvar");
+	theSession->Builder.CreateStore(next_val, var_alloca);
+
+	end_val = theSession->Builder.CreateFCmpONE(end_val, ConstantFP::get(getGlobalContext(), APFloat(0.0)), "loopcond");
+
+	BasicBlock *afterBB = BasicBlock::Create(getGlobalContext(), "afterloop", theFunc);
+
+	theSession->Builder.CreateCondBr(end_val, loopBB, afterBB);
+
+	theSession->Builder.SetInsertPoint(afterBB);
+
+
+	//restore original value;
+	if (old_value){
+		theSession->namedValues[var_name] = old_value;
+	}
+	else{
+		theSession->namedValues.erase(var_name);
+	}
+	return Constant::getNullValue(Type::getDoubleTy(getGlobalContext()));
+}
+
+
+static double parfor_identity(int32_t reduction){
+	switch (reduction)
+	{
+	case PARFOR_MUL:
+		return 1.0;
+	case PARFOR_MIN:
+		return HUGE_VAL;
+	case PARFOR_MAX:
+		return -HUGE_VAL;
+	default:
+		return 0.0;
+	}
+}
+
+// Output this as:
+//   env = the variables in scope
+//   result = kpp_parfor(<function>.parfor, env, fptosi start, fptosi end, reduction)
+// kppc has no thread pool, it calls <function>.parfor over the whole range
+Value* ParForExprAST::Codegen(){
+	theSession->debug_info.emitLocation(this);
+	Function* theFunc = theSession->Builder.GetInsertBlock()->getParent();
+	Type* double_type = Type::getDoubleTy(getGlobalContext());
+	Type* int64_type = Type::getInt64Ty(getGlobalContext());
+
+	Value* start_val = start->Codegen();
+	if (start_val == nullptr){
+		return nullptr;
+	}
+	Value* end_val = end->Codegen();
+	if (end_val == nullptr){
+		return nullptr;
+	}
+
+	//the variables in scope are passed by value, every iteration starts with the values they have here
+	std::vector<std::pair<std::string, AllocaInst*>> captured;
+	for (auto& named : theSession->namedValues) {
+		if (named.second && named.first != var_name)
+			captured.push_back(named);
+	}
+	ArrayType* env_type = ArrayType::get(double_type, std::max<size_t>(captured.size(), 1));
+	AllocaInst* env = CreateEntryBlockAlloca(theFunc, "parfor.env", env_type);
+	for (unsigned i = 0; i < captured.size(); ++i) {
+		Value* value = theSession->Builder.CreateLoad(double_type, captured[i].second, captured[i].first);
+		theSession->Builder.CreateStore(value, theSession->Builder.CreateConstInBoundsGEP2_32(env_type, env, 0, i));
+	}
+
+	Function* body_func = createBody(captured);
+	if (body_func == nullptr){
+		return nullptr;
+	}
+
+	Value* args[] = {
+		theSession->Builder.CreateConstInBoundsGEP2_32(env_type, env, 0, 0, "env"),
+		theSession->Builder.CreateFPToSI(start_val, int64_type, "begin"),
+		theSession->Builder.CreateFPToSI(end_val, int64_type, "end"),
+	};
+	if (!theSession->helper){
+		return theSession->Builder.CreateCall(body_func, args, "parfor");
+	}
+	FunctionCallee run = theFunc->getParent()->getOrInsertFunction("kpp_parfor", double_type,
+		body_func->getType(), args[0]->getType(), int64_type, int64_type, Type::getInt32Ty(getGlobalContext()));
+	return theSession->Builder.CreateCall(run, { body_func, args[0], args[1], args[2], theSession->Builder.getInt32(reduction) }, "parfor");
+}
+
+//	define internal double @<function>.parfor(double* %env, i64 %begin, i64 %end){
+//		acc = identity
+//		for index in [begin, end): the captured variables = env, var_name = sitofp index, acc = acc op body
+//		ret acc
+//	}
+//the reduction allows reassociation, the ranges are reduced in any order anyway
+Function* ParForExprAST::createBody(const std::vector<std::pair<std::string, AllocaInst*>>& captured){
+	IRBuilder<>& builder = theSession->Builder;
+	Function* parent = builder.GetInsertBlock()->getParent();
+	Type* double_type = Type::getDoubleTy(getGlobalContext());
+	Type* int64_type = Type::getInt64Ty(getGlobalContext());
+	FunctionType* type = FunctionType::get(double_type, { double_type->getPointerTo(), int64_type, int64_type }, false);
+	Function* func = Function::Create(type, Function::InternalLinkage, parent->getName() + ".parfor", parent->getParent());
+	Function::arg_iterator arg_iter = func->arg_begin();
+	Value* env = &*arg_iter++;
+	Value* begin = &*arg_iter++;
+	Value* end_index = &*arg_iter;
+	env->setName("env");
+	begin->setName("begin");
+	end_index->setName("end");
+
+	//the body is generated with the variables of func, the ones of parent come back afterwards
+	IRBuilderBase::InsertPoint parent_ip = builder.saveIP();
+	std::map<std::string, AllocaInst*> parent_values;
+	parent_values.swap(theSession->namedValues);
+
+	BasicBlock* entryBB = BasicBlock::Create(getGlobalContext(), "entry", func);
+	BasicBlock* loopBB = BasicBlock::Create(getGlobalContext(), "loop", func);
+	BasicBlock* exitBB = BasicBlock::Create(getGlobalContext(), "exit", func);
+	builder.SetInsertPoint(entryBB);
+	std::vector<AllocaInst*> allocas;
+	for (auto& variable : captured) {
+		allocas.push_back(CreateEntryBlockAlloca(func, variable.first, double_type));
+		theSession->namedValues[variable.first] = allocas.back();
+	}
+	AllocaInst* var_alloca = CreateEntryBlockAlloca(func, var_name, double_type);
+	theSession->namedValues[var_name] = var_alloca;
+	Value* identity = ConstantFP::get(double_type, parfor_identity(reduction));
+	builder.CreateCondBr(builder.CreateICmpSLT(begin, end_index), loopBB, exitBB);
+
+	builder.SetInsertPoint(loopBB);
+	PHINode* index = builder.CreatePHI(int64_type, 2, "index");
+	PHINode* acc = builder.CreatePHI(double_type, 2, "acc");
+	index->addIncoming(begin, entryBB);
+	acc->addIncoming(identity, entryBB);
+	for (unsigned i = 0; i < allocas.size(); ++i) {
+		Value* value = builder.CreateLoad(double_type, builder.CreateConstInBoundsGEP1_32(double_type, env, i), captured[i].first);
+		builder.CreateStore(value, allocas[i]);
+	}
+	builder.CreateStore(builder.CreateSIToFP(index, double_type, var_name), var_alloca);
+
+	Value* body_val = body->Codegen();
+	if (body_val == nullptr){
+		theSession->namedValues.swap(parent_values);
+		builder.restoreIP(parent_ip);
+		func->eraseFromParent();
+		return nullptr;
+	}
+
+	Value* next_acc = acc;
+	{
+		IRBuilderBase::FastMathFlagGuard guard(builder);
+		FastMathFlags flags;
+		flags.setAllowReassoc();
+		builder.setFastMathFlags(flags);
+		switch (reduction)
+		{
+		case PARFOR_ADD:
+			next_acc = builder.CreateFAdd(acc, body_val, "acc.next");
+			break;
+		case PARFOR_MUL:
+			next_acc = builder.CreateFMul(acc, body_val, "acc.next");
+			break;
+		case PARFOR_MIN:
+			next_acc = builder.CreateMinNum(acc, body_val, "acc.next");
+			break;
+		case PARFOR_MAX:
+			next_acc = builder.CreateMaxNum(acc, body_val, "acc.next");
+			break;
+		default:
+			break;
+		}
+	}
+	Value* next = builder.CreateNSWAdd(index, builder.getInt64(1), "index.next");
+	BasicBlock* latchBB = builder.GetInsertBlock();
+	index->addIncoming(next, latchBB);
+	acc->addIncoming(next_acc, latchBB);
+	builder.CreateCondBr(builder.CreateICmpSLT(next, end_index), loopBB, exitBB);
+
+	builder.SetInsertPoint(exitBB);
+	PHINode* result = builder.CreatePHI(double_type, 2, "result");
+	result->addIncoming(identity, entryBB);
+	result->addIncoming(next_acc, latchBB);
+	builder.CreateRet(result);
+	verifyFunction(*func);
+
+	theSession->namedValues.swap(parent_values);
+	builder.restoreIP(parent_ip);
+	return func;
+}
+
+
+//varexpr ::= 'var' identifier ('=' expression)?(',' identifier ('=' expression)?)* 'in' expression
+Value* VarExprAST::Codegen(){
+	theSession->debug_info.emitLocation(this);
+	Function* theFunc = theSession->Builder.GetInsertBlock()->getParent();
+	std::vector<AllocaInst*> old_bindings;
+	for (unsigned i = 0; i != this->vars.size(); ++i) {
+		old_bindings.push_back(theSession->namedValues[vars[i].first]);
+		ExprAST* init = vars[i].second;
+		Value* init_val;
+		if (init){
+			init_val = init->Codegen();
+			if (init_val == nullptr){
+				return nullptr;
+			}
+
+		}
+		else{
+			init_val = ConstantFP::get(getGlobalContext(), APFloat(1.0));
+		}
+		AllocaInst* cur_alloca = CreateEntryBlockAlloca(theFunc, vars[i].first, init_val->getType());
+		theSession->Builder.CreateStore(init_val, cur_alloca);
+		theSession->namedValues[vars[i].first] = cur_alloca;
+	}
+
+	Value* body_val = this->body->Codegen();
+
+	if (body_val == nullptr){
+		return nullptr;
+	}
+
+	for (size_t i = 0; i < vars.size(); i++){
+		theSession->namedValues[vars[i].first] = old_bindings[i];
+	}
+	return body_val;
+}
+
+
+Function* PrototypeAST::Codegen(){
+
+	std::vector<Type*> array_type(this->func_args.size(), Type::getDoubleTy(getGlobalContext()));
+
+	FunctionType *Func_type = FunctionType::get(Type::getDoubleTy(getGlobalContext()), array_type, false);
+
+
+	KPP_LOG(LOG_DEBUG, "Current register function name is %s", func_name.c_str());
+
+
+	Module *current_module = theSession->codegen->getModuleForNewFunction();
+
+	Function* func = Function::Create(Func_type, Function::ExternalLinkage, func_name, current_module);
+
+	if (func == nullptr){
+		ErrorE("Fail to construct a function proto");
+		return nullptr;
+	}
+
+	if (func->getName() != func_name){
+		func->eraseFromParent();
+
+		//theHelperбJIT(Modules vector)ûJIT(openModule)Modulesвfunc
+		func = theSession->codegen->getFunction(func_name);
+
+		if (!func->empty()){
+			ErrorF("redefinition of function");
+			return nullptr;
+		}
+
+		if (func->arg_size() != func_args.size()){
+			ErrorF("Differenct arguments given");
+			return nullptr;
+		}
+	}
+	unsigned Idx = 0;
+	for (Function::arg_iterator AI = func->arg_begin(); Idx != this->func_args.size();
+		++AI, ++Idx)
+		AI->setName(this->func_args[Idx]);
+
+	return func;
+}
+
+void PrototypeAST::CreateArgumentAllocas(Function *func){
+
+	Function::arg_iterator arg_iter = func->arg_begin();
+	Type* default_type = Type::getDoubleTy(getGlobalContext());
+	for (uint32_t i = 0; i != func_args.size(); ++i) {
+		AllocaInst *cur_alloca = CreateEntryBlockAlloca(func, func_args[i], default_type);
+		theSession->Builder.CreateStore(&*arg_iter++, cur_alloca);
+		theSession->namedValues[func_args[i]] = cur_alloca;
+	}
+}
+
+static uint32_t profile_function_id(const std::string& name);
+
+//the calls of --profile around the body, the top-level expressions are not profiled, kppc has no profiler
+static bool is_profiled(const PrototypeAST* proto){
+	return theSession->profile_calls && !theSession->compiler && proto->getName().compare(0, 11, "anony_func_") != 0;
+}
+
+static void emit_profile_call(Module* module, const char* runtime, ArrayRef<Value*> args){
+	LLVMContext& context = getGlobalContext();
+	SmallVector<Type*, 1> arg_types;
+	for (Value* arg : args) {
+		arg_types.push_back(arg->getType());
+	}
+	FunctionCallee callee = module->getOrInsertFunction(runtime, FunctionType::get(Type::getVoidTy(context), arg_types, false));
+	theSession->Builder.CreateCall(callee, args);
+}
+
+Function *FunctionAST::Codegen(){
+	theSession->namedValues.clear();
+	Function* theFunc = this->func_proto->Codegen();
+	if (theFunc == nullptr){
+		KPP_LOG(LOG_TRACE, "Failed in Prototype generation");
+		return nullptr;
+	}
+	KPP_LOG(LOG_TRACE, "Function prototype generation successs");
+
+	BasicBlock *BB = BasicBlock::Create(getGlobalContext(), "entry", theFunc);
+	theSession->Builder.SetInsertPoint(BB);
+	theSession->debug_info.beginFunction(theFunc, func_proto);
+
+	this->func_proto->CreateArgumentAllocas(theFunc);
+	bool profiled = is_profiled(func_proto);
+	if (profiled){
+		Value* id = ConstantInt::get(Type::getInt32Ty(getGlobalContext()), profile_function_id(func_proto->getName()));
+		emit_profile_call(theFunc->getParent(), "kpp_profile_enter", id);
+	}
+
+	if (Value *ret_value = this->body->Codegen()){
+
+
+
+		if (this->func_proto->isBinary()){
+			theSession->binary_op_precedence[func_proto->getOperatorName()] = func_proto->getBinaryProceence();
+		}
+		if (profiled)
+			emit_profile_call(theFunc->getParent(), "kpp_profile_exit", None);
+		theSession->Builder.CreateRet(ret_value);
+		theSession->debug_info.finishFunction(theFunc);
+		verifyFunction(*theFunc);
+
+		return theFunc;
+	}
+
+	KPP_LOG(LOG_TRACE, "Failed in function body codegen");
+	theSession->debug_info.finishFunction(theFunc);
+	theFunc->eraseFromParent();
+	return nullptr;
+}
+
+
+//the IR sink of --dump-ir=<file>, shared by the sessions of the process
+//without it the IR is printed to stderr at LOG_DEBUG
+static std::unique_ptr<raw_fd_ostream> ir_dump_file;
+static std::mutex ir_dump_lock;
+
+static bool open_ir_dump(const std::string& path){
+	std::error_code ec;
+	ir_dump_file = std::make_unique<raw_fd_ostream>(path, ec, sys::fs::OF_Text);
+	if (ec){
+		KPP_LOG(LOG_ERROR, "Could not open %s: %s", path.c_str(), ec.message().c_str());
+		ir_dump_file.reset();
+		return false;
+	}
+	return true;
+}
+
+//the output for a dump of IR, nullptr if it is not dumped; ir_dump_lock must be held
+static raw_ostream* get_ir_dump(){
+	if (ir_dump_file)
+		return ir_dump_file.get();
+	return KPP_LOG_ENABLED(LOG_DEBUG) ? &errs() : nullptr;
+}
+
+static void dump_ir(const char* what, const Function* func){
+	if (!ir_dump_file && !KPP_LOG_ENABLED(LOG_DEBUG))
+		return;
+	std::lock_guard<std::mutex> lock(ir_dump_lock);
+	if (raw_ostream* out = get_ir_dump()){
+		*out << what << "\n";
+		func->print(*out);
+		out->flush();
+	}
+}
+
+//the value of a top-level expression: printed by the REPL, kept for kpp::Engine and the server, logged for a script
+static void report_value(double value){
+	if (theSession->echo)
+		kpp_print("Evaluated to %lf\n", value);
+	else if (theSession->keep_results)
+		theSession->results.push_back(value);
+	else
+		KPP_LOG(LOG_INFO, "Evaluated to %lf", value);
+}
+
+//the code of a parsed definition, handed to the JIT or the AOT compiler
+static void define_function(FunctionAST* func_ast){
+	{
+		//the compile threads copy the modules out of the same context
+		auto lock = getThreadSafeContext().getLock();
+		PhaseTimer timer(PHASE_CODEGEN, func_ast->getPrototype()->getName());
+		if (Function* func = func_ast->Codegen()){
+			dump_ir("Read the function definition:", func);
+			std::string name = func_ast->getPrototype()->getName();
+			if (!theSession->helper || theSession->helper->addDefinition(func))
+				theSession->definitions[name] = func_ast;
+		}
+		else{
+			KPP_LOG(LOG_DEBUG, "failed in FunctionAST codegen");
+		}
+	}
+	if (theSession->helper)
+		theSession->helper->submitDefinitions();
+}
+
+static void declare_extern(PrototypeAST* proto){
+	auto lock = getThreadSafeContext().getLock();
+	PhaseTimer timer(PHASE_CODEGEN, proto->getName());
+	Function* func = proto->Codegen();
+	if (func)
+		dump_ir("Read extern:", func);
+}
+
+static void HandleDefinition(std::istream& input){
+	if (FunctionAST* func_ast = ParseDefinition(input)){
+		define_function(func_ast);
+	}
+	else{
+		KPP_LOG(LOG_ERROR, "Invalid definition syntax");
+		get_next_tok(input);
+	}
+}
+
+
+static void HandleExtern(std::istream& input){
+	if (PrototypeAST* proto = ParseExtern(input)){
+		declare_extern(proto);
+	}
+	else{
+		get_next_tok(input);
+	}
+}
+
+//run the top-level expressions batched so far
+static void FlushToplevelExpressions(){
+	if (!theSession->helper || theSession->helper->getBatchedExprCount() == 0)
+		return;
+
+	std::vector<double> results;
+	if (theSession->helper->runBatchedExprs(results)){
+		for (double value : results) {
+			report_value(value);
+		}
+	}
+}
+
+//the code of a top-level expression, added to the init function of kppc or to the next batch of the JIT
+static void add_toplevel_expression(FunctionAST* top_func_expr){
+	//the lock is released before the expression runs, its callees may still be compiling
+	auto lock = getThreadSafeContext().getLock();
+	PhaseTimer timer(PHASE_CODEGEN);
+	Function* top_func;
+	if (theSession->compiler){
+		//kppcģʽ, ʽinitִ
+		if ((top_func = top_func_expr->Codegen()))
+			theSession->compiler->addInitExpr(top_func);
+		return;
+	}
+	//batch modeֻɴ, FlushToplevelExpressionsͳһִ
+	//the REPL runs a batch of one expression at once, so its code is released after the run
+	theSession->helper->setExprBatching(true);
+	top_func = top_func_expr->Codegen();
+	theSession->helper->setExprBatching(false);
+	if (top_func)
+		theSession->helper->addBatchedExpr(top_func);
+}
+
+static void HandleToplevelExpression(std::istream& input){
+	if (FunctionAST *top_func_expr = ParseToplevelExpr(input)){
+		add_toplevel_expression(top_func_expr);
+		if (!theSession->compiler && !theSession->batch_mode)
+			FlushToplevelExpressions();
+	}
+	else{
+		get_next_tok(input);
+	}
+}
+
+
+//the batch kernel of a function, built at the first use and again after a redefinition
+static BatchKernel* get_batch_kernel(const std::string& name){
+	auto definition = theSession->definitions.find(name);
+	if (!theSession->helper || definition == theSession->definitions.end()){
+		ErrorE(("no definition of " + name).c_str());
+		return nullptr;
+	}
+	auto cached = theSession->kernels.find(name);
+	if (cached != theSession->kernels.end() && cached->second.definition == definition->second)
+		return &cached->second;
+
+	BatchKernel kernel;
+	kernel.definition = definition->second;
+	if (!theSession->helper->beginKernel())
+		return nullptr;
+	{
+		auto lock = getThreadSafeContext().getLock();
+		if (!theSession->helper->finishKernel(kernel.definition->Codegen(), kernel)){
+			ErrorE(("could not build the batch kernel of " + name).c_str());
+			return nullptr;
+		}
+	}
+	if (!theSession->helper->resolveKernel(kernel))
+		return nullptr;
+	return &(theSession->kernels[name] = kernel);
+}
+
+//run a kernel over n rows, the rows are split among threads, the calling thread takes the first part
+static void run_batch_kernel(const BatchKernel& kernel, const double* const* columns, double* out, size_t n, unsigned threads){
+	//a part is a multiple of 8 rows, the threads do not share the cache lines of out
+	size_t part = threads > 1 ? ((n + threads - 1) / threads + 7) & ~(size_t)7 : n;
+	if (part >= n){
+		kernel.columns(columns, out, n);
+		return;
+	}
+
+	auto run_part = [&kernel, columns, out](size_t begin, size_t count){
+		std::vector<const double*> part_columns(kernel.arity);
+		for (unsigned i = 0; i < kernel.arity; ++i) {
+			part_columns[i] = columns[i] + begin;
+		}
+		kernel.columns(part_columns.data(), out + begin, count);
+	};
+	std::vector<std::thread> workers;
+	for (size_t begin = part; begin < n; begin += part) {
+		workers.emplace_back(run_part, begin, std::min(part, n - begin));
+	}
+	run_part(0, part);
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+//:batch <name> [rows] [threads], times the kernel of name against a call per row, over generated columns
+static void run_batch_command(const std::string& arg){
+	std::istringstream args(arg);
+	std::string name;
+	size_t rows = 1000000;
+	unsigned threads = 1;
+	args >> name >> rows >> threads;
+	if (name.empty() || !rows || !threads){
+		ErrorE("usage: :batch <name> [rows] [threads]");
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	BatchKernel* kernel = get_batch_kernel(name);
+	if (!kernel)
+		return;
+	double build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	std::vector<std::vector<double>> data(kernel->arity, std::vector<double>(rows));
+	std::vector<const double*> columns;
+	for (unsigned i = 0; i < kernel->arity; ++i) {
+		for (size_t j = 0; j < rows; ++j) {
+			data[i][j] = (double)(j % 1024) / 1024 + i;
+		}
+		columns.push_back(data[i].data());
+	}
+	std::vector<double> out(rows);
+	run_batch_kernel(*kernel, columns.data(), out.data(), rows, threads);
+
+	start = std::chrono::steady_clock::now();
+	run_batch_kernel(*kernel, columns.data(), out.data(), rows, threads);
+	double kernel_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	kpp_print("%s: %zu rows, kernel %.3f ms (%.1f Mrows/s, %u threads, built in %.1f ms)\n",
+		kernel->symbol.c_str(), rows, kernel_ms, rows / kernel_ms / 1000, threads, build_ms);
+
+	//the same rows through the function pointer, as a host loop calling the function would do
+	void* address = theSession->helper->getFunctionAddress(name, kernel->arity);
+	if (!address || kernel->arity > 3)
+		return;
+	std::vector<double> expected(rows);
+	start = std::chrono::steady_clock::now();
+	switch (kernel->arity) {
+	case 0:
+		for (size_t j = 0; j < rows; ++j) expected[j] = ((double(*)())address)();
+		break;
+	case 1:
+		for (size_t j = 0; j < rows; ++j) expected[j] = ((double(*)(double))address)(columns[0][j]);
+		break;
+	case 2:
+		for (size_t j = 0; j < rows; ++j) expected[j] = ((double(*)(double, double))address)(columns[0][j], columns[1][j]);
+		break;
+	default:
+		for (size_t j = 0; j < rows; ++j) expected[j] = ((double(*)(double, double, double))address)(columns[0][j], columns[1][j], columns[2][j]);
+		break;
+	}
+	double call_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	size_t mismatches = 0;
+	for (size_t j = 0; j < rows; ++j) {
+		if (out[j] != expected[j] && !(out[j] != out[j] && expected[j] != expected[j]))
+			++mismatches;
+	}
+	kpp_print("%s: %zu rows, a call per row %.3f ms (%.1f Mrows/s), %zu results differ\n",
+		name.c_str(), rows, call_ms, rows / call_ms / 1000, mismatches);
+}
+
+
+//the array name of theSession, created empty the first time
+static KppArray* get_array(const std::string& name){
+	KppArray*& array = theSession->arrays[name];
+	if (!array){
+		array = new KppArray();
+		array->view.data = nullptr;
+		array->view.length = 0;
+	}
+	return array;
+}
+
+//:array [<name> <length> [<value>|iota|random]], list the arrays or create one, filled with value (0 by default),
+//its indices or numbers in [0, 1) from a fixed seed
+static void run_array_command(const std::string& arg){
+	if (arg.empty()){
+		for (auto& kv : theSession->arrays) {
+			kpp_print("%s: %llu doubles%s\n", kv.first.c_str(), (unsigned long long)kv.second->view.length,
+				kv.second->storage.empty() && kv.second->view.length ? " of the host" : "");
+		}
+		return;
+	}
+
+	std::istringstream args(arg);
+	std::string name, fill;
+	long long length = -1;
+	args >> name >> length >> fill;
+	if (name.empty() || !(isalpha(name[0]) || name[0] == '_') || length < 0){
+		ErrorE("usage: :array <name> <length> [<value>|iota|random]");
+		return;
+	}
+	std::vector<double> storage((size_t)length);
+	if (fill == "iota"){
+		for (size_t i = 0; i < storage.size(); ++i) {
+			storage[i] = (double)i;
+		}
+	}
+	else if (fill == "random"){
+		std::mt19937_64 generator(42);
+		std::uniform_real_distribution<double> distribution(0.0, 1.0);
+		for (double& element : storage) {
+			element = distribution(generator);
+		}
+	}
+	else if (!fill.empty()){
+		char* end;
+		double value = std::strtod(fill.c_str(), &end);
+		if (*end){
+			ErrorE("usage: :array <name> <length> [<value>|iota|random]");
+			return;
+		}
+		std::fill(storage.begin(), storage.end(), value);
+	}
+
+	KppArray* array = get_array(name);
+	array->storage.swap(storage);
+	array->view.data = array->storage.data();
+	array->view.length = array->storage.size();
+}
+
+
+//the profile of --profile-in, with the counts of this session over it
+static bool save_profile(const std::string& path){
+	ProfileData data;
+	if (theSession->profile)
+		data = *theSession->profile;
+	theSession->helper->collectProfiles(data);
+	if (!data.save(path))
+		return false;
+	KPP_LOG(LOG_INFO, "profile of %zu functions saved to %s", data.size(), path.c_str());
+	return true;
+}
+
+
+//****************************************
+//parfor runtime, kpp_parfor
+//****************************************
+
+namespace{
+	typedef double(*ParforBody)(double* env, int64_t begin, int64_t end);
+	struct ParforJob;
+
+	//iterations [begin, end) of a parfor loop
+	struct ParforRange{
+		ParforJob* job;
+		int64_t begin, end;
+	};
+
+	//a parfor loop being run, on the stack of the thread calling kpp_parfor
+	struct ParforJob{
+		ParforBody body;
+		double* env;
+		int32_t reduction;
+		int64_t grain;					//iterations of one call of body
+		std::mutex lock;
+		double result;
+		std::atomic<int64_t> remaining;	//iterations not run yet, kpp_parfor returns at 0
+	};
+
+	//the ranges of a thread, its owner pushes and pops at the back, the thieves take the front
+	struct ParforDeque{
+		std::mutex lock;
+		std::deque<ParforRange> ranges;
+		std::atomic<size_t> size;
+		std::atomic<bool> claimed;
+
+		ParforDeque() :size(0), claimed(false){}
+	};
+
+	//the deque of the current thread, given back when the thread exits
+	struct ParforDequeClaim{
+		ParforDeque* deque = nullptr;
+		~ParforDequeClaim(){ if (deque) deque->claimed = false; }
+	};
+	static thread_local ParforDequeClaim parfor_claim;
+
+	//the thread pool of the parfor loops of all the sessions, created at the first parfor
+	//every thread running ranges has a deque, the workers of the pool and the threads calling kpp_parfor
+	//a thread runs its range by blocks of grain iterations, and splits the upper half of the range onto its deque
+	//only while the deque is empty: a range is split again after the last half was stolen, idle threads steal the front,
+	//the oldest and largest range. A thread waiting for its loop runs the ranges of other loops meanwhile
+	class ParforPool{
+		static const unsigned max_deques = 256;
+		ParforDeque deques[max_deques];
+		std::atomic<unsigned> deque_count;	//the deques ever claimed are [0, deque_count)
+		unsigned threads;					//the workers and the calling thread
+		std::mutex sleep_lock;
+		std::condition_variable wake;
+		std::atomic<unsigned> sleeping;
+		std::atomic<uint64_t> pushes;		//the idle workers sleep until the next push
+		std::atomic<uint64_t> loops, splits, steals;
+
+		ParforDeque* claimDeque();
+		void push(ParforDeque* own, const ParforRange& range);
+		bool pop(ParforDeque* own, ParforRange& range);
+		bool steal(ParforDeque* own, ParforRange& range);
+		void execute(ParforRange range, ParforDeque* own);
+		void workerLoop();
+
+		explicit ParforPool(unsigned threads);
+	public:
+		//the size of the pool, before its first use
+		static void setThreads(unsigned threads);
+		static ParforPool* get();
+
+		double run(ParforBody body, double* env, int64_t begin, int64_t end, int32_t reduction);
+		void printStats()const;
+	};
+
+	static std::atomic<unsigned> parfor_threads(0);
+
+	static double parfor_combine(int32_t reduction, double x, double y){
+		switch (reduction)
+		{
+		case PARFOR_ADD:
+			return x + y;
+		case PARFOR_MUL:
+			return x * y;
+		case PARFOR_MIN:
+			return std::fmin(x, y);
+		case PARFOR_MAX:
+			return std::fmax(x, y);
+		default:
+			return 0.0;
+		}
+	}
+
+	ParforPool::ParforPool(unsigned _threads) :deque_count(0), threads(std::max(_threads, 1u)), sleeping(0), pushes(0), loops(0), splits(0), steals(0){
+		//the pool lives as long as the process, its workers are never joined
+		for (unsigned i = 1; i < threads; ++i) {
+			std::thread(&ParforPool::workerLoop, this).detach();
+		}
+	}
+
+	void ParforPool::setThreads(unsigned threads){
+		parfor_threads = threads;
+	}
+
+	ParforPool* ParforPool::get(){
+		static ParforPool* pool = new ParforPool(parfor_threads ? parfor_threads.load() : std::thread::hardware_concurrency());
+		return pool;
+	}
+
+	ParforDeque* ParforPool::claimDeque(){
+		if (parfor_claim.deque)
+			return parfor_claim.deque;
+		for (unsigned i = 0; i < max_deques; ++i) {
+			bool expected = false;
+			if (deques[i].claimed.compare_exchange_strong(expected, true)){
+				unsigned count = deque_count;
+				while (count < i + 1 && !deque_count.compare_exchange_weak(count, i + 1)) {}
+				parfor_claim.deque = &deques[i];
+				return &deques[i];
+			}
+		}
+		return nullptr;
+	}
+
+	void ParforPool::push(ParforDeque* own, const ParforRange& range){
+		{
+			std::lock_guard<std::mutex> lock(own->lock);
+			own->ranges.push_back(range);
+			own->size = own->ranges.size();
+		}
+		++pushes;
+		if (sleeping){
+			std::lock_guard<std::mutex> lock(sleep_lock);
+			wake.notify_one();
+		}
+	}
+
+	bool ParforPool::pop(ParforDeque* own, ParforRange& range){
+		if (!own->size)
+			return false;
+		std::lock_guard<std::mutex> lock(own->lock);
+		if (own->ranges.empty())
+			return false;
+		range = own->ranges.back();
+		own->ranges.pop_back();
+		own->size = own->ranges.size();
+		return true;
+	}
+
+	bool ParforPool::steal(ParforDeque* own, ParforRange& range){
+		static thread_local unsigned next_victim = 0;
+		unsigned count = deque_count;
+		for (unsigned i = 0; i < count; ++i) {
+			ParforDeque& victim = deques[(next_victim + i) % count];
+			if (&victim == own || !victim.size)
+				continue;
+			std::lock_guard<std::mutex> lock(victim.lock);
+			if (victim.ranges.empty())
+				continue;
+			range = victim.ranges.front();
+			victim.ranges.pop_front();
+			victim.size = victim.ranges.size();
+			next_victim = (next_victim + i + 1) % count;
+			steals.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+		return false;
+	}
+
+	void ParforPool::execute(ParforRange range, ParforDeque* own){
+		ParforJob* job = range.job;
+		double partial = parfor_identity(job->reduction);
+		int64_t done = 0;
+		while (range.begin < range.end){
+			if (range.end - range.begin > 2 * job->grain && !own->size){
+				int64_t middle = range.begin + (range.end - range.begin) / 2;
+				push(own, ParforRange{ job, middle, range.end });
+				range.end = middle;
+				splits.fetch_add(1, std::memory_order_relaxed);
+			}
+			int64_t block_end = std::min(range.begin + job->grain, range.end);
+			partial = parfor_combine(job->reduction, partial, job->body(job->env, range.begin, block_end));
+			done += block_end - range.begin;
+			range.begin = block_end;
+		}
+		{
+			std::lock_guard<std::mutex> lock(job->lock);
+			job->result = parfor_combine(job->reduction, job->result, partial);
+		}
+		//the job may be gone after this
+		job->remaining.fetch_sub(done, std::memory_order_acq_rel);
+	}
+
+	void ParforPool::workerLoop(){
+		ParforDeque* own = claimDeque();
+		if (!own)
+			return;
+		while (true){
+			uint64_t seen = pushes;
+			ParforRange range;
+			if (pop(own, range) || steal(own, range)){
+				execute(range, own);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleep_lock);
+			++sleeping;
+			wake.wait(lock, [this, seen](){ return pushes != seen; });
+			--sleeping;
+		}
+	}
+
+	double ParforPool::run(ParforBody body, double* env, int64_t begin, int64_t end, int32_t reduction){
+		if (begin >= end)
+			return parfor_identity(reduction);
+		int64_t count = end - begin;
+		int64_t grain = std::max<int64_t>(count / (threads * 16), 1);
+		ParforDeque* own = claimDeque();
+		if (threads < 2 || count < 2 * grain || !own)
+			return body(env, begin, end);
+
+		loops.fetch_add(1, std::memory_order_relaxed);
+		ParforJob job;
+		job.body = body;
+		job.env = env;
+		job.reduction = reduction;
+		job.grain = grain;
+		job.result = parfor_identity(reduction);
+		job.remaining = count;
+		execute(ParforRange{ &job, begin, end }, own);
+		while (job.remaining.load(std::memory_order_acquire) > 0){
+			ParforRange range;
+			if (pop(own, range) || steal(own, range))
+				execute(range, own);
+			else
+				std::this_thread::yield();
+		}
+		return job.result;
+	}
+
+	void ParforPool::printStats()const{
+		kpp_print("parfor: %u threads, %llu loops run in parallel, %llu ranges split, %llu stolen\n", threads,
+			(unsigned long long)loops.load(), (unsigned long long)splits.load(), (unsigned long long)steals.load());
+	}
+}
+
+
+//****************************************
+//--profile, the call profiler: kpp_profile_enter and kpp_profile_exit
+//****************************************
+
+namespace{
+	//the time stamp counter where there is one, the profiler converts it to time with the steady clock
+	static inline uint64_t read_cycle_counter(){
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	//the calls of one thread as a calling context tree, a node for every distinct stack of kpp functions
+	//only the thread itself changes it; a new node is added under mutex, the counters are atomic, so a report can read them while it runs
+	class ProfileThread{
+	public:
+		static const uint32_t none = ~0u;
+
+		struct Node{
+			uint32_t function;
+			uint32_t parent;
+			uint32_t first_child;
+			uint32_t next_sibling;
+			std::atomic<uint64_t> calls;
+			std::atomic<uint64_t> inclusive;	//cycles of the calls not inside another call of the same function
+			std::atomic<uint64_t> exclusive;	//cycles not spent in the kpp functions called
+			Node(uint32_t _function, uint32_t _parent) :function(_function), parent(_parent), first_child(none), next_sibling(none),
+				calls(0), inclusive(0), exclusive(0){}
+		};
+
+	private:
+		struct Frame{
+			uint32_t node;
+			uint64_t begin;
+			uint64_t children;		//cycles of the calls made by the frame
+		};
+
+		std::deque<Node> nodes;		//nodes[0] is the root, the thread outside any kpp function
+		std::vector<Frame> stack;
+		std::vector<uint32_t> active;	//calls of every function on the stack, for the inclusive time of recursion
+
+		static void add(std::atomic<uint64_t>& counter, uint64_t value){
+			counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		}
+
+	public:
+		std::mutex mutex;
+
+		ProfileThread(){ nodes.emplace_back(none, none); }
+
+		void enter(uint32_t function){
+			uint32_t parent = stack.empty() ? 0 : stack.back().node;
+			uint32_t node = nodes[parent].first_child;
+			while (node != none && nodes[node].function != function)
+				node = nodes[node].next_sibling;
+			if (node == none){
+				std::lock_guard<std::mutex> lock(mutex);
+				node = (uint32_t)nodes.size();
+				nodes.emplace_back(function, parent);
+				nodes[node].next_sibling = nodes[parent].first_child;
+				nodes[parent].first_child = node;
+			}
+			if (function >= active.size())
+				active.resize(function + 1, 0);
+			++active[function];
+			add(nodes[node].calls, 1);
+			stack.push_back(Frame{ node, read_cycle_counter(), 0 });
+		}
+
+		void exit(){
+			uint64_t end = read_cycle_counter();
+			if (stack.empty())
+				return;
+			Frame frame = stack.back();
+			stack.pop_back();
+			uint64_t elapsed = end - frame.begin;
+			Node& node = nodes[frame.node];
+			add(node.exclusive, elapsed - std::min(elapsed, frame.children));
+			if (--active[node.function] == 0)
+				add(node.inclusive, elapsed);
+			if (!stack.empty())
+				stack.back().children += elapsed;
+		}
+
+		//mutex must be held
+		size_t getNodeCount()const{ return nodes.size(); }
+		const Node& getNode(size_t index)const{ return nodes[index]; }
+		Node& getNode(size_t index){ return nodes[index]; }
+	};
+
+	//the functions and threads of the process; the same name in different sessions is one function
+	class CallProfiler{
+		std::mutex mutex;
+		std::vector<std::string> names;
+		std::unordered_map<std::string, uint32_t> ids;
+		std::vector<ProfileThread*> threads;	//kept after their thread ends, their counts are still reported
+
+		uint64_t start_cycles;
+		std::chrono::steady_clock::time_point start_time;
+		double call_cost_ns;		//of an enter and an exit, measured by the first report
+		std::once_flag call_cost_once;
+
+		CallProfiler();
+		double getNsPerCycle();
+		//the inclusive, exclusive and calls of every function, summed over the threads
+		void collect(std::vector<uint64_t>& calls, std::vector<uint64_t>& inclusive, std::vector<uint64_t>& exclusive);
+
+	public:
+		static CallProfiler* get();
+		uint32_t getFunctionId(const std::string& name);
+		ProfileThread* getThread();
+		void print();
+		bool writeStacks(const std::string& path);
+		void reset();
+	};
+
+	const uint32_t ProfileThread::none;
+
+	static thread_local ProfileThread* profile_thread = nullptr;
+
+	CallProfiler::CallProfiler() :start_cycles(read_cycle_counter()), start_time(std::chrono::steady_clock::now()), call_cost_ns(0){}
+
+	CallProfiler* CallProfiler::get(){
+		static CallProfiler profiler;
+		return &profiler;
+	}
+
+	uint32_t CallProfiler::getFunctionId(const std::string& name){
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = ids.find(name);
+		if (iter != ids.end())
+			return iter->second;
+		uint32_t id = (uint32_t)names.size();
+		names.push_back(name);
+		ids[name] = id;
+		return id;
+	}
+
+	ProfileThread* CallProfiler::getThread(){
+		if (!profile_thread){
+			profile_thread = new ProfileThread();
+			std::lock_guard<std::mutex> lock(mutex);
+			threads.push_back(profile_thread);
+		}
+		return profile_thread;
+	}
+
+	//the counter against the steady clock since the profiler started, at least 10ms
+	double CallProfiler::getNsPerCycle(){
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		while (std::chrono::steady_clock::now() - start_time < std::chrono::milliseconds(10))
+			std::this_thread::yield();
+		uint64_t cycles = read_cycle_counter() - start_cycles;
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start_time).count();
+		return cycles ? ns / cycles : 1.0;
+#else
+		return 1.0;
+#endif
+	}
+
+	void CallProfiler::collect(std::vector<uint64_t>& calls, std::vector<uint64_t>& inclusive, std::vector<uint64_t>& exclusive){
+		std::lock_guard<std::mutex> lock(mutex);
+		calls.assign(names.size(), 0);
+		inclusive.assign(names.size(), 0);
+		exclusive.assign(names.size(), 0);
+		for (ProfileThread* thread : threads) {
+			std::lock_guard<std::mutex> thread_lock(thread->mutex);
+			for (size_t i = 1; i < thread->getNodeCount(); ++i) {
+				const ProfileThread::Node& node = thread->getNode(i);
+				calls[node.function] += node.calls.load(std::memory_order_relaxed);
+				inclusive[node.function] += node.inclusive.load(std::memory_order_relaxed);
+				exclusive[node.function] += node.exclusive.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	//the functions by exclusive time, the 30 first
+	void CallProfiler::print(){
+		std::call_once(call_cost_once, [this](){
+			//a thread of its own, not reported
+			ProfileThread probe;
+			const int rounds = 100000;
+			auto begin = std::chrono::steady_clock::now();
+			for (int i = 0; i < rounds; ++i) {
+				probe.enter(0);
+				probe.exit();
+			}
+			call_cost_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / rounds;
+		});
+
+		std::vector<uint64_t> calls, inclusive, exclusive;
+		collect(calls, inclusive, exclusive);
+		double ns_per_cycle = getNsPerCycle();
+		std::vector<std::pair<uint64_t, uint32_t>> order;
+		uint64_t total_exclusive = 0, total_calls = 0;
+		for (uint32_t id = 0; id < calls.size(); ++id) {
+			if (!calls[id])
+				continue;
+			order.push_back(std::make_pair(exclusive[id], id));
+			total_exclusive += exclusive[id];
+			total_calls += calls[id];
+		}
+		std::sort(order.rbegin(), order.rend());
+
+		kpp_print("%-32s %12s %12s %12s %7s %10s\n", "function", "calls", "incl ms", "excl ms", "excl %", "incl ns/call");
+		for (size_t i = 0; i < order.size() && i < 30; ++i) {
+			uint32_t id = order[i].second;
+			kpp_print("%-32s %12llu %12.3f %12.3f %6.1f%% %10.1f\n", names[id].c_str(), (unsigned long long)calls[id],
+				inclusive[id] * ns_per_cycle / 1e6, exclusive[id] * ns_per_cycle / 1e6,
+				total_exclusive ? 100.0 * exclusive[id] / total_exclusive : 0.0, inclusive[id] * ns_per_cycle / calls[id]);
+		}
+		if (order.size() > 30)
+			kpp_print("%zu more functions\n", order.size() - 30);
+		kpp_print("%llu calls, the profiler adds about %.1f ns to each (%.3f ms in all)\n", (unsigned long long)total_calls,
+			call_cost_ns, total_calls * call_cost_ns / 1e6);
+	}
+
+	//a line per stack: the functions from the outermost, separated by ';', and the exclusive microseconds, for flamegraph.pl
+	bool CallProfiler::writeStacks(const std::string& path){
+		std::error_code ec;
+		raw_fd_ostream out(path, ec, sys::fs::OF_Text);
+		if (ec){
+			KPP_LOG(LOG_ERROR, "Could not open %s: %s", path.c_str(), ec.message().c_str());
+			return false;
+		}
+		double ns_per_cycle = getNsPerCycle();
+		std::map<std::string, double> stacks;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (ProfileThread* thread : threads) {
+				std::lock_guard<std::mutex> thread_lock(thread->mutex);
+				std::vector<std::string> paths(thread->getNodeCount());
+				//a parent is added before its children
+				for (size_t i = 1; i < thread->getNodeCount(); ++i) {
+					const ProfileThread::Node& node = thread->getNode(i);
+					paths[i] = node.parent ? paths[node.parent] + ";" + names[node.function] : names[node.function];
+					stacks[paths[i]] += node.exclusive.load(std::memory_order_relaxed) * ns_per_cycle / 1000;
+				}
+			}
+		}
+		for (auto& kv : stacks) {
+			if ((uint64_t)kv.second)
+				out << kv.first << " " << (uint64_t)kv.second << "\n";
+		}
+		KPP_LOG(LOG_INFO, "%zu stacks written to %s", stacks.size(), path.c_str());
+		return !out.has_error();
+	}
+
+	//the calls running keep their frames, their time from now on is counted
+	void CallProfiler::reset(){
+		std::lock_guard<std::mutex> lock(mutex);
+		for (ProfileThread* thread : threads) {
+			std::lock_guard<std::mutex> thread_lock(thread->mutex);
+			for (size_t i = 1; i < thread->getNodeCount(); ++i) {
+				ProfileThread::Node& node = thread->getNode(i);
+				node.calls = 0;
+				node.inclusive = 0;
+				node.exclusive = 0;
+			}
+		}
+	}
+}
+
+static uint32_t profile_function_id(const std::string& name){
+	return CallProfiler::get()->getFunctionId(name);
+}
+
+
+//REPL command, a line started with ':'
+//	:opt			show the current optimization level or pipeline
+//	:opt <0-3>		switch the optimization level
+//	:passes <pipeline>	use a custom PassBuilder pipeline, e.g. function(mem2reg,instcombine)
+//	:cache			show the hit/miss statistics of the object cache
+//	:target			show the target triple, CPU, features and vector width
+//	:mem			show the JIT memory, the code size against the budget, evictions and recompilations
+//	:calls [direct|stub]	show or switch how the next definitions are called, stubbed functions can be redefined
+//	:pgo [save <file>]	show the functions recompiled with their profile, or save the profile
+//	:batch <name> [rows] [threads]	build the batch kernel of a function and time it against a call per row
+//	:parfor			show the threads of the parfor pool, and how the loops were split and stolen
+//	:array [<name> <length> [<value>|iota|random]]	list the arrays, or create one for a[i] and the reduction builtins
+//	:log [off|error|warn|info|debug|trace]	show or set the log level of the process
+//	:profile [reset|stacks <file>]	show the calls and time of every function of --profile, reset them or write the collapsed stacks
+//	:stats [reset]	show the compile time of every phase, the slowest passes and definitions of --stats, or reset them
+static void run_command(const std::string& line){
+	std::string name = line.substr(0, line.find_first_of(" \t"));
+	std::string arg;
+	size_t arg_begin = line.find_first_not_of(" \t", name.size());
+	if (arg_begin != std::string::npos)
+		arg = line.substr(arg_begin);
+
+	if (name == "opt"){
+		if (!arg.empty() && (arg.size() != 1 || !isdigit(arg[0]) || !theSession->pipeline->setOptLevel(arg[0] - '0'))){
+			ErrorE("usage: :opt <0-3>");
+		}
+		if (theSession->pipeline->getCustomPipeline().empty())
+			kpp_print("optimization level -O%u\n", theSession->pipeline->getOptLevel());
+		else
+			kpp_print("custom pipeline %s\n", theSession->pipeline->getCustomPipeline().c_str());
+	}
+	else if (name == "target"){
+		const TargetSpec& spec = theSession->pipeline->getTarget();
+		unsigned vector_width = theSession->pipeline->getVectorBitWidth();
+		kpp_print("triple %s, cpu %s\n", spec.triple.c_str(), spec.cpu.c_str());
+		kpp_print("features %s\n", spec.features.c_str());
+		kpp_print("vector width %u bits, %u doubles\n", vector_width, vector_width / 64);
+	}
+	else if (name == "cache"){
+		if (theSession->object_cache)
+			theSession->object_cache->printStats();
+		else
+			kpp_print("object cache is disabled, use --cache-dir=<dir>\n");
+	}
+	else if (name == "calls"){
+		if (!theSession->helper){
+			ErrorE(":calls needs the JIT");
+		}
+		else{
+			if (arg == "stub" || arg == "direct")
+				theSession->helper->setStubCalls(arg == "stub");
+			else if (!arg.empty())
+				ErrorE("usage: :calls [direct|stub]");
+			kpp_print("%s calls\n", theSession->helper->getStubCalls() ? "stubbed" : "direct");
+		}
+	}
+	else if (name == "pgo"){
+		if (!theSession->helper){
+			ErrorE(":pgo needs the JIT");
+		}
+		else if (arg.compare(0, 5, "save ") == 0){
+			save_profile(arg.substr(5));
+		}
+		else if (arg.empty()){
+			theSession->helper->printProfileStats();
+		}
+		else{
+			ErrorE("usage: :pgo [save <file>]");
+		}
+	}
+	else if (name == "batch"){
+		if (!theSession->helper)
+			ErrorE(":batch needs the JIT");
+		else
+			run_batch_command(arg);
+	}
+	else if (name == "array"){
+		if (!theSession->helper)
+			ErrorE(":array needs the JIT");
+		else
+			run_array_command(arg);
+	}
+	else if (name == "parfor"){
+		ParforPool::get()->printStats();
+	}
+	else if (name == "mem"){
+		if (theSession->jit_memory)
+			theSession->jit_memory->printStats();
+		else
+			kpp_print("JIT memory is allocated by SectionMemoryManager\n");
+		if (theSession->helper)
+			theSession->helper->printCodeStats();
+	}
+	else if (name == "log"){
+		int level = arg.empty() ? kpp_log_level.load() : parse_log_level(arg);
+		if (level < 0)
+			ErrorE("usage: :log [off|error|warn|info|debug|trace]");
+		else if (level > KPP_LOG_MAX_LEVEL)
+			kpp_print("log level %s is compiled out, build with -DKPP_LOG_MAX_LEVEL=LOG_TRACE\n", arg.c_str());
+		else{
+			kpp_log_level = level;
+			kpp_print("log level %s\n", log_level_names[level]);
+		}
+	}
+	else if (name == "profile"){
+		std::string stacks_path = arg.compare(0, 7, "stacks ") == 0 ? arg.substr(7) : std::string();
+		if (!theSession->profile_calls)
+			kpp_print("the call profiler is off, run with --profile\n");
+		else if (arg == "reset")
+			CallProfiler::get()->reset();
+		else if (!stacks_path.empty())
+			CallProfiler::get()->writeStacks(stacks_path);
+		else
+			CallProfiler::get()->print();
+	}
+	else if (name == "stats"){
+		if (!compile_stats)
+			kpp_print("compile statistics are off, run with --stats or --trace=<file>\n");
+		else if (arg == "reset")
+			compile_stats->reset();
+		else
+			compile_stats->print();
+	}
+	else if (name == "passes"){
+		if (arg.empty() || !theSession->pipeline->setCustomPipeline(arg)){
+			ErrorE("usage: :passes <pipeline>");
+		}
+	}
+	else{
+		kpp_print("Error: unknown command ':%s'\n", name.c_str());
+	}
+}
+
+static void HandleCommand(std::istream& input){
+	run_command(get_line_rest(input));
+	get_next_tok(input);
+}
+
+
+static void mainloop(std::istream& input){
+	if (theSession->echo)
+		kpp_print("ready>");
+	get_next_tok(input);
+	while (true) {
+		//no JIT code runs between two statements
+		if (theSession->helper)
+			theSession->helper->atSafePoint();
+		//only consecutive top-level expressions share a batch
+		if (theSession->cur_tok == TOK::DEF_TOK || theSession->cur_tok == TOK::EXTERN_TOK || theSession->cur_tok == ':' || theSession->cur_tok == TOK::EOF_TOK){
+			FlushToplevelExpressions();
+		}
+		switch (theSession->cur_tok)
+		{
+		case TOK::DEF_TOK:
+			HandleDefinition(input);
+			break;
+		case TOK::EXTERN_TOK:
+			HandleExtern(input);
+			break;
+		case ';':
+			get_next_tok(input);
+			break;
+		case ':':
+			HandleCommand(input);
+			break;
+		case TOK::EOF_TOK:
+			if (theSession->echo)
+				kpp_print("token eof");
+			return;
+		default:
+			HandleToplevelExpression(input);
+			break;
+		}
+		if (theSession->echo)
+			kpp_print("ready>");
+	}
+}
+
+//****************************************
+//--pipelined, the parser, the code generator and the expressions run on threads of their own
+//****************************************
+
+//a stage waiting on a full or empty queue spins, then yields, then sleeps a little longer every round up to 1ms
+static void stage_backoff(unsigned& round){
+	++round;
+	if (round < 16)
+		return;
+	if (round < 64)
+		std::this_thread::yield();
+	else
+		std::this_thread::sleep_for(std::chrono::microseconds(std::min(50u << std::min((round - 64) / 16, 5u), 1000u)));
+}
+
+//a bounded ring between two stages, with one producer and one consumer and no locks
+template <typename T>
+class StageQueue{
+	std::vector<T> slots;
+	uint64_t mask;
+	alignas(64) std::atomic<uint64_t> head;	//the next slot to pop, written by the consumer
+	alignas(64) std::atomic<uint64_t> tail;	//the next slot to push, written by the producer
+	uint64_t full_waits, empty_waits;
+
+public:
+	//capacity is rounded up to a power of 2
+	explicit StageQueue(uint64_t capacity) :head(0), tail(0), full_waits(0), empty_waits(0){
+		uint64_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+		slots.resize(size);
+		mask = size - 1;
+	}
+
+	void push(T item){
+		uint64_t index = tail.load(std::memory_order_relaxed);
+		if (index - head.load(std::memory_order_acquire) > mask){
+			++full_waits;
+			unsigned round = 0;
+			while (index - head.load(std::memory_order_acquire) > mask)
+				stage_backoff(round);
+		}
+		slots[index & mask] = std::move(item);
+		tail.store(index + 1, std::memory_order_release);
+	}
+
+	T pop(){
+		uint64_t index = head.load(std::memory_order_relaxed);
+		if (tail.load(std::memory_order_acquire) == index){
+			++empty_waits;
+			unsigned round = 0;
+			while (tail.load(std::memory_order_acquire) == index)
+				stage_backoff(round);
+		}
+		T item = std::move(slots[index & mask]);
+		head.store(index + 1, std::memory_order_release);
+		return item;
+	}
+
+	//the consumer only
+	bool empty()const{ return tail.load(std::memory_order_acquire) == head.load(std::memory_order_relaxed); }
+	//the producer waited on a full queue, the consumer on an empty one
+	uint64_t getFullWaits()const{ return full_waits; }
+	uint64_t getEmptyWaits()const{ return empty_waits; }
+};
+
+//a statement parsed by the parser thread, in the order of the input
+struct ParsedItem{
+	enum Kind{
+		ITEM_DEFINITION,
+		ITEM_EXTERN,
+		ITEM_EXPRESSION,
+		ITEM_COMMAND,
+		ITEM_END,
+	};
+	Kind kind;
+	FunctionAST* func;		//definition or top-level expression
+	PrototypeAST* proto;	//extern
+	std::string command;	//the line of a ':' command
+	uint64_t seq;
+};
+
+//parser thread -> parsed -> code generator on the calling thread -> batches -> runner thread
+//the code generator batches the consecutive expressions the parser has ready, and hands the batch to the runner
+//without waiting for it; the runner compiles and runs the batches in order, the lookup of the driver of a batch
+//only waits for the definitions it calls. the other waits:
+//	the parser waits for the code of a binary operator definition, the precedence is set by its codegen
+//	a redefinition waits for the runner to finish the expressions before it
+//	a ':' command waits for the runner to finish, the commands change the session the code runs in
+//	the JIT safe point is taken only when the runner is idle
+class StagedPipeline{
+	StageQueue<ParsedItem> parsed;
+	StageQueue<ExprBatch*> batches;		//nullptr at the end
+	std::atomic<uint64_t> generated;	//seq of the last item done by the code generator
+	std::atomic<uint64_t> batches_run;
+	uint64_t batches_submitted;
+	uint64_t expressions;
+
+	static const size_t max_batch = 1024;
+
+	void parseLoop(std::istream& input);
+	void runLoop();
+	void submitBatch();
+	void waitForRunner();
+
+public:
+	explicit StagedPipeline(unsigned depth) :parsed(depth), batches(depth), generated(0), batches_run(0),
+		batches_submitted(0), expressions(0){}
+	void run(std::istream& input);
+};
+
+void StagedPipeline::parseLoop(std::istream& input){
+	uint64_t seq = 0;
+	get_next_tok(input);
+	while (true) {
+		ParsedItem item = ParsedItem();
+		switch (theSession->cur_tok)
+		{
+		case TOK::DEF_TOK:
+			item.kind = ParsedItem::ITEM_DEFINITION;
+			item.func = ParseDefinition(input);
+			if (!item.func){
+				KPP_LOG(LOG_ERROR, "Invalid definition syntax");
+				get_next_tok(input);
+				continue;
+			}
+			break;
+		case TOK::EXTERN_TOK:
+			item.kind = ParsedItem::ITEM_EXTERN;
+			item.proto = ParseExtern(input);
+			if (!item.proto){
+				get_next_tok(input);
+				continue;
+			}
+			break;
+		case ';':
+			get_next_tok(input);
+			continue;
+		case ':':
+			item.kind = ParsedItem::ITEM_COMMAND;
+			item.command = get_line_rest(input);
+			get_next_tok(input);
+			break;
+		case TOK::EOF_TOK:
+			item.kind = ParsedItem::ITEM_END;
+			break;
+		default:
+			item.kind = ParsedItem::ITEM_EXPRESSION;
+			item.func = ParseToplevelExpr(input);
+			if (!item.func){
+				get_next_tok(input);
+				continue;
+			}
+			break;
+		}
+
+		item.seq = ++seq;
+		bool binary = item.kind == ParsedItem::ITEM_DEFINITION && item.func->getPrototype()->isBinary();
+		bool end = item.kind == ParsedItem::ITEM_END;
+		parsed.push(std::move(item));
+		if (end)
+			return;
+		if (binary){
+			unsigned round = 0;
+			while (generated.load(std::memory_order_acquire) < seq)
+				stage_backoff(round);
+		}
+	}
+}
+
+void StagedPipeline::runLoop(){
+	std::vector<double> results;
+	while (ExprBatch* batch = batches.pop()) {
+		if (theSession->helper->runExprBatch(*batch, results)){
+			for (double value : results) {
+				report_value(value);
+			}
+		}
+		delete batch;
+		batches_run.fetch_add(1, std::memory_order_release);
+	}
+}
+
+void StagedPipeline::submitBatch(){
+	if (theSession->helper->getBatchedExprCount() == 0)
+		return;
+	ExprBatch* batch = new ExprBatch();
+	if (!theSession->helper->submitBatchedExprs(*batch)){
+		delete batch;
+		return;
+	}
+	++batches_submitted;
+	batches.push(batch);
+}
+
+void StagedPipeline::waitForRunner(){
+	unsigned round = 0;
+	while (batches_run.load(std::memory_order_acquire) != batches_submitted)
+		stage_backoff(round);
+}
+
+//the code generator runs on the calling thread, it owns the JIT of theSession like mainloop
+void StagedPipeline::run(std::istream& input){
+	kpp::Session* session = theSession;
+	std::thread parser([this, session, &input](){
+		SessionScope scope(session);
+		parseLoop(input);
+	});
+	std::thread runner([this, session](){
+		SessionScope scope(session);
+		runLoop();
+	});
+
+	while (true) {
+		//no more statements ready, the batch runs while the parser waits for input
+		if (parsed.empty())
+			submitBatch();
+		ParsedItem item = parsed.pop();
+		if (item.kind != ParsedItem::ITEM_EXPRESSION)
+			submitBatch();
+
+		switch (item.kind)
+		{
+		case ParsedItem::ITEM_DEFINITION:
+			//the expressions before a redefinition call the old code
+			if (theSession->definitions.count(item.func->getPrototype()->getName()))
+				waitForRunner();
+			define_function(item.func);
+			break;
+		case ParsedItem::ITEM_EXTERN:
+			declare_extern(item.proto);
+			break;
+		case ParsedItem::ITEM_EXPRESSION:
+			add_toplevel_expression(item.func);
+			++expressions;
+			if (theSession->helper->getBatchedExprCount() >= max_batch)
+				submitBatch();
+			break;
+		case ParsedItem::ITEM_COMMAND:
+			waitForRunner();
+			run_command(item.command);
+			break;
+		case ParsedItem::ITEM_END:
+			break;
+		}
+		generated.store(item.seq, std::memory_order_release);
+		if (item.kind == ParsedItem::ITEM_END)
+			break;
+		//no JIT code runs while the runner is idle, only the code generator gives it work
+		if (batches_run.load(std::memory_order_acquire) == batches_submitted)
+			theSession->helper->atSafePoint();
+	}
+
+	batches.push(nullptr);
+	runner.join();
+	parser.join();
+	KPP_LOG(LOG_INFO, "pipeline: %llu expressions in %llu batches; parser waited %llu times on a full queue, "
+		"code generator %llu times on the parser and %llu times on the runner, runner %llu times on the code generator",
+		(unsigned long long)expressions, (unsigned long long)batches_submitted, (unsigned long long)parsed.getFullWaits(),
+		(unsigned long long)parsed.getEmptyWaits(), (unsigned long long)batches.getFullWaits(), (unsigned long long)batches.getEmptyWaits());
+}
+
+//mainloop with the stages on their own threads, depth is the size of the queues between them
+static void pipelined_mainloop(std::istream& input, unsigned depth){
+	StagedPipeline pipeline(depth);
+	pipeline.run(input);
+}
+
+//===----------------------------------------------------------------------===//
+// "Library" functions that can be "extern'd" from user code.
+//===----------------------------------------------------------------------===//
+/// putchard - putchar that takes a double and returns 0.
+extern "C" double putchard(double X) {
+	putchar((char)X);
+	return 0;
+}
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+double printd(double X) {
+	printf("%f\n", X);
+	return 0;
+}
+
+/// kpp_jit_resolve - called by the stub of a function whose code is not in the JIT.
+/// the caller may be any thread running the code of an engine, the record tells which JIT it belongs to
+extern "C" void* kpp_jit_resolve(void* record) {
+	void* address = ((StubRecord*)record)->owner->resolveStub((StubRecord*)record);
+	if (!address){
+		fprintf(stderr, "Fatal: could not compile %s\n", ((StubRecord*)record)->body_name.c_str());
+		abort();
+	}
+	return address;
+}
+
+/// kpp_jit_tier_up - called by the instrumented code of a function at its --pgo threshold.
+extern "C" void kpp_jit_tier_up(void* record) {
+	((StubRecord*)record)->owner->tierUp((StubRecord*)record);
+}
+
+/// kpp_profile_enter - called on entry of every kpp function with --profile, id is the one of the function name.
+extern "C" void kpp_profile_enter(int32_t id) {
+	ProfileThread* thread = profile_thread;
+	if (!thread)
+		thread = CallProfiler::get()->getThread();
+	thread->enter((uint32_t)id);
+}
+
+/// kpp_profile_exit - called before the function returns.
+extern "C" void kpp_profile_exit() {
+	profile_thread->exit();
+}
+
+/// kpp_parfor - runs the outlined body of a parfor over [begin, end) on the parfor pool, returns the reduction of the ranges.
+extern "C" double kpp_parfor(ParforBody body, double* env, int64_t begin, int64_t end, int32_t reduction) {
+	return ParforPool::get()->run(body, env, begin, end, reduction);
+}
+
+//once per process, for the command line and for every kpp::Engine
+static void initialize_llvm(){
+	static std::once_flag once;
+	std::call_once(once, [](){
+		///InitializeNativeTarget - The main program should call this function to
+		/// initialize the native target corresponding to the host.  This is useful 
+		/// for JIT applications to ensure that the target gets linked in correctly.
+		/// It is legal for a client to make multiple calls to this function.
+		InitializeNativeTarget();
+
+		/// InitializeNativeTargetAsmPrinter - The main program should call
+		/// this function to initialize the native target asm printer.
+		InitializeNativeTargetAsmPrinter();
+
+		/// InitializeNativeTargetAsmParser - The main program should call
+		/// this function to initialize the native target asm parser.
+		InitializeNativeTargetAsmParser();
+
+		llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+		llvm::sys::DynamicLibrary::AddSymbol("printd", (void*)&printd);
+		llvm::sys::DynamicLibrary::AddSymbol("kpp_jit_resolve", (void*)&kpp_jit_resolve);
+		llvm::sys::DynamicLibrary::AddSymbol("kpp_jit_tier_up", (void*)&kpp_jit_tier_up);
+		llvm::sys::DynamicLibrary::AddSymbol("kpp_parfor", (void*)&kpp_parfor);
+		llvm::sys::DynamicLibrary::AddSymbol("kpp_profile_enter", (void*)&kpp_profile_enter);
+		llvm::sys::DynamicLibrary::AddSymbol("kpp_profile_exit", (void*)&kpp_profile_exit);
+	});
+}
+
+//the optimizer of theSession, and its JIT unless it is kppc
+//the pass pipeline is built once here and shared by all the modules of the session
+//the sessions of kpp --server compile through shared_cache instead of a cache of their own
+static bool start_session(const kpp::EngineOptions& options, bool jit, KeyedObjectCache* shared_cache = nullptr){
+	kpp::Session* session = theSession;
+	session->pipeline = new OptPipeline(options.opt_level, TargetSpec(options.mcpu, options.mattr));
+	if (!options.pipeline.empty() && !session->pipeline->setCustomPipeline(options.pipeline)){
+		return false;
+	}
+	session->debug_info.enabled = options.debug_lines;
+	session->profile_calls = options.call_profile;
+	if (!jit)
+		return true;
+
+	if (!options.cache_dir.empty() && !shared_cache){
+		session->object_cache = new DiskObjectCache(options.cache_dir, options.cache_size << 20);
+	}
+#ifdef __linux__
+	if (options.jit_slab_size){
+		session->jit_memory = new JITSlabAllocator(options.jit_slab_size << 10, options.jit_huge_pages);
+		if (!session->jit_memory->isValid()){
+			delete session->jit_memory;
+			session->jit_memory = nullptr;
+		}
+	}
+#endif
+	KeyedObjectCache* cache = shared_cache ? shared_cache : session->object_cache;
+	std::vector<JITEventListener*> listeners;
+	if (options.perf_map && PerfMapListener::get()->isValid())
+		listeners.push_back(PerfMapListener::get());
+	if (options.jitdump){
+		//LLVM's listener writes jit-<pid>.dump to $JITDUMPDIR or ~/.debug/jit, nullptr if LLVM was built without it
+		if (JITEventListener* listener = JITEventListener::createPerfJITEventListener())
+			listeners.push_back(listener);
+		else
+			KPP_LOG(LOG_WARN, "LLVM was built without perf support, --jitdump is ignored");
+	}
+	session->helper = new JITHelper(session->context, session->pipeline, cache,
+		options.jit_threads > 0 ? options.jit_threads : 0, session->jit_memory, listeners);
+	if (!session->helper->isValid()){
+		return false;
+	}
+	session->helper->setStubCalls(options.stub_calls || options.code_budget || options.pgo_threshold);
+	session->helper->setCodeBudget(options.code_budget);
+	session->helper->setPGO(options.pgo_threshold, session->profile);
+	if (options.parfor_threads)
+		ParforPool::setThreads(options.parfor_threads);
+	session->codegen = session->helper;
+	return true;
+}
+
+
+//****************************************
+//kpp::Engine, see kpp.h
+//****************************************
+
+kpp::Engine::Engine(const EngineOptions& options) :session(new Session()){
+	initialize_llvm();
+	SessionScope scope(session);
+	session->echo = false;
+	session->keep_results = true;
+	session->capture_output = true;
+	if (!start_session(options, true))
+		session->codegen = nullptr;
+	else if (session->helper)
+		session->helper->setCollectAtSafePoints(false);
+}
+
+kpp::Engine::~Engine(){
+	SessionScope scope(session);
+	delete session;
+}
+
+bool kpp::Engine::isValid()const{
+	return session->codegen != nullptr;
+}
+
+//run source in theSession, the values of its expressions go to results
+static bool compile_source(const std::string& source){
+	unsigned errors = theSession->error_count;
+	theSession->results.clear();
+
+	//a new input, the lexer starts without lookahead
+	std::istringstream input(source);
+	theSession->cur_char = ' ';
+	mainloop(input);
+	return theSession->error_count == errors;
+}
+
+bool kpp::Engine::compile(const std::string& source){
+	if (!isValid())
+		return false;
+	SessionScope scope(session);
+	session->output.clear();
+	return compile_source(source);
+}
+
+bool kpp::Engine::eval(const std::string& source, double& result){
+	if (!compile(source))
+		return false;
+	if (session->results.empty()){
+		session->last_error = "no expression to evaluate";
+		return false;
+	}
+	result = session->results.back();
+	return true;
+}
+
+void* kpp::Engine::lookupAddress(const std::string& name, unsigned arity){
+	if (!isValid())
+		return nullptr;
+	SessionScope scope(session);
+	void* address = session->helper->getFunctionAddress(name, arity);
+	if (!address)
+		session->last_error = "no function " + name + " with " + std::to_string(arity) + " arguments";
+	return address;
+}
+
+void* kpp::Engine::lookupBatchAddress(const std::string& name, unsigned arity){
+	if (!isValid())
+		return nullptr;
+	SessionScope scope(session);
+	BatchKernel* kernel = get_batch_kernel(name);
+	if (!kernel)
+		return nullptr;
+	if (kernel->arity != arity){
+		session->last_error = "no function " + name + " with " + std::to_string(arity) + " arguments";
+		return nullptr;
 	}
+	return kernel->rows;
+}
 
-	Value* cur_val = Builder.CreateLoad(var_alloca, var_name.c_str());
-	Value* next_val = Builder.CreateFAdd(cur_val, step_value, "nextvar");
-	Builder.CreateStore(next_val, var_alloca);
+bool kpp::Engine::evalBatch(const std::string& name, const double* const* columns, double* out, size_t n, unsigned threads){
+	if (!isValid())
+		return false;
+	SessionScope scope(session);
+	BatchKernel* kernel = get_batch_kernel(name);
+	if (!kernel)
+		return false;
+	run_batch_kernel(*kernel, columns, out, n, threads);
+	return true;
+}
 
-	end_val = Builder.CreateFCmpONE(end_val, ConstantFP::get(getGlobalContext(), APFloat(0.0)), "loopcond");
+void kpp::Engine::collect(){
+	if (!isValid())
+		return;
+	SessionScope scope(session);
+	session->helper->collect();
+}
 
-	BasicBlock *afterBB = BasicBlock::Create(getGlobalContext(), "afterloop", theFunc);
+bool kpp::Engine::bindArray(const std::string& name, const double* data, size_t length){
+	if (!isValid())
+		return false;
+	SessionScope scope(session);
+	KppArray* array = get_array(name);
+	array->storage.clear();
+	array->view.data = data;
+	array->view.length = length;
+	return true;
+}
 
-	Builder.CreateCondBr(end_val, loopBB, afterBB);
+const std::string& kpp::Engine::getError()const{
+	return session->last_error;
+}
 
-	Builder.SetInsertPoint(afterBB);
+const std::string& kpp::Engine::getOutput()const{
+	return session->output;
+}
 
 
-	//restore original value;
-	if (old_value){
-		namedValues[var_name] = old_value;
-	}
-	else{
-		namedValues.erase(var_name);
-	}
-	return Constant::getNullValue(Type::getDoubleTy(getGlobalContext()));
+#ifndef KPP_EMBEDDED
+
+//command line options, the ones of kpp::EngineOptions and the ones of the kpp program
+struct KppOptions : public kpp::EngineOptions{
+	std::string script;		//script file, run in batch mode; read std::cin if empty
+	bool aot;				//kppc mode, --emit=obj|so|exe or run as kppc
+	AOTCompiler::EmitKind emit_kind;
+	std::string output;		//-o <file>, output of kppc
+	std::string pass_remarks;	//--pass-remarks=<regex>, print the optimization remarks of the matching passes
+	std::string profile_in;	//--profile-in=<file>, compile with the counts of an earlier run, kppc too
+	std::string profile_out;	//--profile-out=<file>, save the counts at exit
+	std::string server;		//--server=<socket>, serve the clients of a Unix socket, a session each
+	unsigned server_threads;	//--server-threads=<n>, the workers running the requests, 0 for one per core
+	unsigned pipelined;		//--pipelined[=<depth>], parse, compile and run on threads of their own; 0 for mainloop
+	int log_level;			//--log=<level>, -1 for info in the REPL and the server, warn otherwise
+	std::string dump_ir;	//--dump-ir=<file>, the IR of every definition and extern
+	bool stats;				//--stats, print the compile time of every phase at exit
+	std::string trace;		//--trace=<file>, write the phases and passes as a Chrome trace at exit
+	std::string profile_stacks;	//--profile=<file>, write the collapsed stacks of the call profiler at exit
+
+	//--jit-threads is -1 by default: one thread for an interactive REPL, lazy compilation for scripts and pipes
+	//--jit-budget is given in KB
+	KppOptions() :aot(false), emit_kind(AOTCompiler::EMIT_OBJECT), server_threads(0), pipelined(0), log_level(-1), stats(false){ jit_threads = -1; }
+};
+
+static void print_usage(const char* prog){
+	fprintf(stderr, "usage: %s [-O0|-O1|-O2|-O3] [--passes=<pipeline>] [--cache-dir=<dir>] [--cache-size=<MB>] [script.kpp]\n", prog);
+	fprintf(stderr, "       %s --emit=obj|so|exe [-O0|-O1|-O2|-O3] [-o <output>] script.kpp\n", prog);
+	fprintf(stderr, "target: [--mcpu=<cpu>] [--mattr=<+feature,-feature>] [--pass-remarks=<regex>]\n");
+	fprintf(stderr, "jit: [--jit-threads=<n>] [--jit-slab-size=<KB>] [--jit-huge-pages] [--calls=direct|stub] [--jit-budget=<KB>]\n");
+	fprintf(stderr, "pgo: [--pgo[=<calls>]] [--profile-in=<file>] [--profile-out=<file>]\n");
+	fprintf(stderr, "parfor: [--parfor-threads=<n>]\n");
+	fprintf(stderr, "server: [--server=<socket>] [--server-threads=<n>]\n");
+	fprintf(stderr, "streaming input: [--pipelined[=<queue depth>]]\n");
+	fprintf(stderr, "output: [--log=off|error|warn|info|debug|trace] [--dump-ir=<file>]\n");
+	fprintf(stderr, "compile time: [--stats] [--trace=<file>]\n");
+	fprintf(stderr, "profiling with perf: [--perf-map] [--jitdump] [-g]\n");
+	fprintf(stderr, "call profiler: [--profile[=<collapsed stacks file>]]\n");
 }
 
+static bool parse_args(int argc, char** argv, KppOptions& options){
+	//installed as kppc, compile ahead of time
+	options.aot = sys::path::stem(argv[0]) == "kppc";
 
-//varexpr ::= 'var' identifier ('=' expression)?(',' identifier ('=' expression)?)* 'in' expression
-Value* VarExprAST::Codegen(){
-	Function* theFunc = Builder.GetInsertBlock()->getParent();
-	std::vector<AllocaInst*> old_bindings;
-	for (unsigned i = 0; i != this->vars.size(); ++i) {
-		old_bindings.push_back(namedValues[vars[i].first]);
-		ExprAST* init = vars[i].second;
-		Value* init_val;
-		if (init){
-			init_val = init->Codegen();
-			if (init_val == nullptr){
-				return nullptr;
+	for (int i = 1; i < argc; ++i){
+		std::string arg = argv[i];
+		if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '3'){
+			options.opt_level = arg[2] - '0';
+		}
+		else if (arg.compare(0, 9, "--passes=") == 0){
+			options.pipeline = arg.substr(9);
+		}
+		else if (arg.compare(0, 12, "--cache-dir=") == 0){
+			options.cache_dir = arg.substr(12);
+		}
+		else if (arg.compare(0, 13, "--cache-size=") == 0){
+			options.cache_size = std::strtoull(arg.c_str() + 13, nullptr, 10);
+		}
+		else if (arg.compare(0, 7, "--emit=") == 0){
+			std::string kind = arg.substr(7);
+			options.aot = true;
+			if (kind == "obj")
+				options.emit_kind = AOTCompiler::EMIT_OBJECT;
+			else if (kind == "so")
+				options.emit_kind = AOTCompiler::EMIT_SHARED;
+			else if (kind == "exe")
+				options.emit_kind = AOTCompiler::EMIT_EXECUTABLE;
+			else{
+				fprintf(stderr, "Unknown output kind %s\n", kind.c_str());
+				return false;
 			}
-
+		}
+		else if (arg.compare(0, 7, "--mcpu=") == 0){
+			options.mcpu = arg.substr(7);
+		}
+		else if (arg.compare(0, 8, "--mattr=") == 0){
+			options.mattr = arg.substr(8);
+		}
+		else if (arg.compare(0, 15, "--pass-remarks=") == 0){
+			options.pass_remarks = arg.substr(15);
+		}
+		else if (arg.compare(0, 14, "--jit-threads=") == 0){
+			options.jit_threads = std::atoi(arg.c_str() + 14);
+			if (options.jit_threads < 0){
+				fprintf(stderr, "Invalid number of compile threads %s\n", arg.c_str() + 14);
+				return false;
+			}
+		}
+		else if (arg.compare(0, 16, "--jit-slab-size=") == 0){
+			options.jit_slab_size = std::strtoull(arg.c_str() + 16, nullptr, 10);
+		}
+		else if (arg == "--jit-huge-pages"){
+			options.jit_huge_pages = true;
+		}
+		else if (arg == "--calls=direct" || arg == "--calls=stub"){
+			options.stub_calls = arg == "--calls=stub";
+		}
+		else if (arg.compare(0, 13, "--jit-budget=") == 0){
+			options.code_budget = std::strtoull(arg.c_str() + 13, nullptr, 10) << 10;
+			options.stub_calls = true;
+		}
+		else if (arg == "--pgo" || arg.compare(0, 6, "--pgo=") == 0){
+			options.pgo_threshold = arg.size() > 6 ? std::strtoull(arg.c_str() + 6, nullptr, 10) : 1000;
+			if (!options.pgo_threshold){
+				fprintf(stderr, "Invalid number of calls %s\n", arg.c_str() + 6);
+				return false;
+			}
+			options.stub_calls = true;
+		}
+		else if (arg.compare(0, 17, "--parfor-threads=") == 0){
+			options.parfor_threads = std::atoi(arg.c_str() + 17);
+			if (!options.parfor_threads){
+				fprintf(stderr, "Invalid number of parfor threads %s\n", arg.c_str() + 17);
+				return false;
+			}
+		}
+		else if (arg.compare(0, 9, "--server=") == 0){
+			options.server = arg.substr(9);
+		}
+		else if (arg.compare(0, 17, "--server-threads=") == 0){
+			options.server_threads = std::atoi(arg.c_str() + 17);
+		}
+		else if (arg == "--pipelined" || arg.compare(0, 12, "--pipelined=") == 0){
+			options.pipelined = arg.size() > 12 ? std::atoi(arg.c_str() + 12) : 64;
+			if (!options.pipelined){
+				fprintf(stderr, "Invalid queue depth %s\n", arg.c_str() + 12);
+				return false;
+			}
+		}
+		else if (arg.compare(0, 6, "--log=") == 0){
+			options.log_level = parse_log_level(arg.substr(6));
+			if (options.log_level < 0){
+				fprintf(stderr, "Unknown log level %s\n", arg.c_str() + 6);
+				return false;
+			}
+		}
+		else if (arg.compare(0, 10, "--dump-ir=") == 0){
+			options.dump_ir = arg.substr(10);
+		}
+		else if (arg == "--stats"){
+			options.stats = true;
+		}
+		else if (arg == "--perf-map"){
+			options.perf_map = true;
+		}
+		else if (arg == "--jitdump"){
+			options.jitdump = true;
+		}
+		else if (arg == "-g"){
+			options.debug_lines = true;
+		}
+		else if (arg == "--profile" || arg.compare(0, 10, "--profile=") == 0){
+			options.call_profile = true;
+			if (arg.size() > 10)
+				options.profile_stacks = arg.substr(10);
+		}
+		else if (arg.compare(0, 8, "--trace=") == 0){
+			options.trace = arg.substr(8);
+		}
+		else if (arg.compare(0, 13, "--profile-in=") == 0){
+			options.profile_in = arg.substr(13);
+		}
+		else if (arg.compare(0, 14, "--profile-out=") == 0){
+			options.profile_out = arg.substr(14);
+		}
+		else if (arg == "-o" && i + 1 < argc){
+			options.output = argv[++i];
+		}
+		else if (arg[0] != '-' && options.script.empty()){
+			options.script = arg;
 		}
 		else{
-			init_val = ConstantFP::get(getGlobalContext(), APFloat(1.0));
+			fprintf(stderr, "Unknown option %s\n", arg.c_str());
+			return false;
 		}
-		AllocaInst* cur_alloca = CreateEntryBlockAlloca(theFunc, vars[i].first, init_val->getType());
-		Builder.CreateStore(init_val, cur_alloca);
-		namedValues[vars[i].first] = cur_alloca;
 	}
+	if (options.aot && options.script.empty()){
+		fprintf(stderr, "kppc needs a script\n");
+		return false;
+	}
+	if (options.aot && options.output.empty()){
+		//<script>.o, <script>.so or <script>
+		SmallString<128> output(options.script);
+		sys::path::replace_extension(output, options.emit_kind == AOTCompiler::EMIT_OBJECT ? "o" :
+			options.emit_kind == AOTCompiler::EMIT_SHARED ? "so" : "");
+		options.output = output.str().str();
+	}
+	//an executable of a script without extension would have the name of the script
+	bool same_file = false;
+	if (options.aot && (options.output == options.script || (!sys::fs::equivalent(options.output, options.script, same_file) && same_file))){
+		fprintf(stderr, "the output %s would overwrite the script, use -o <file>\n", options.output.c_str());
+		return false;
+	}
+	return true;
+}
 
-	Value* body_val = this->body->Codegen();
-
-	if (body_val == nullptr){
-		return nullptr;
+//kppc mode, compile the script to an object file, a shared library or an executable
+static int compile_script(const KppOptions& options){
+	std::ifstream script(options.script);
+	if (!script){
+		fprintf(stderr, "Could not open script %s\n", options.script.c_str());
+		return 1;
 	}
 
-	for (size_t i = 0; i < vars.size(); i++){
-		namedValues[vars[i].first] = old_bindings[i];
+	theSession->compiler = new AOTCompiler(getGlobalContext(), theSession->pipeline);
+	if (!theSession->compiler->isValid()){
+		return 1;
 	}
-	return body_val;
+	theSession->compiler->setProfile(theSession->profile);
+	theSession->codegen = theSession->compiler;
+
+	mainloop(script);
+	return theSession->compiler->emit(options.output, options.emit_kind) ? 0 : 1;
 }
 
+#ifdef __linux__
+//****************************************
+//kpp --server=<socket>, a Unix socket server with a session per client
+//****************************************
 
-Function* PrototypeAST::Codegen(){
+//a line sent by a client is a request: definitions, externs, top-level expressions or ':' commands
+//the reply is a line, "ok" and the values of the expressions, or "error" and the last error
+//	:latency		the latency of the requests of the client, count, mean, p50, p99 and max in microseconds
+struct ServerRequest{
+	std::string line;
+	std::chrono::steady_clock::time_point received;
+};
 
-	std::vector<Type*> array_type(this->func_args.size(), Type::getDoubleTy(getGlobalContext()));
+struct ServerClient{
+	int fd;					//-1 once the connection is gone
+	unsigned id;
+	std::string input;		//received, not a whole line yet; the event loop only
+	std::string output;		//replies not sent yet
+	std::deque<ServerRequest> requests;
+	bool input_closed;		//the client shut down its side, it is dropped after the last reply
+	bool busy;				//a worker runs its requests, one worker at a time
+	kpp::Session* session;	//created by the worker of the first request, used by one worker at a time
+
+	//from a request received to its reply, in microseconds
+	uint64_t request_count;
+	uint64_t fast_calls;	//calls of compiled functions, run without the compiler
+	double total_us, max_us;
+	std::vector<double> recent_us;	//a ring of the last latency_window requests, for the percentiles
+
+	static const size_t latency_window = 4096;
+
+	ServerClient(int _fd, unsigned _id) :fd(_fd), id(_id), input_closed(false), busy(false), session(nullptr), request_count(0), fast_calls(0),
+		total_us(0), max_us(0){}
+	void addLatency(double us);
+	std::string formatLatency()const;
+};
 
-	FunctionType *Func_type = FunctionType::get(Type::getDoubleTy(getGlobalContext()), array_type, false);
+void ServerClient::addLatency(double us){
+	if (recent_us.size() < latency_window)
+		recent_us.push_back(us);
+	else
+		recent_us[request_count % latency_window] = us;
+	++request_count;
+	total_us += us;
+	max_us = std::max(max_us, us);
+}
 
+std::string ServerClient::formatLatency()const{
+	std::vector<double> sorted(recent_us);
+	std::sort(sorted.begin(), sorted.end());
+	auto percentile = [&sorted](double p){ return sorted.empty() ? 0.0 : sorted[(size_t)(p * (sorted.size() - 1))]; };
+	char text[256];
+	snprintf(text, sizeof(text), "count=%llu fast=%llu mean=%.1f p50=%.1f p99=%.1f max=%.1f us",
+		(unsigned long long)request_count, (unsigned long long)fast_calls, request_count ? total_us / request_count : 0.0,
+		percentile(0.5), percentile(0.99), max_us);
+	return text;
+}
 
-	std::cout << "Current register function name is " << func_name << std::endl;
+//an event loop on the calling thread does the socket I/O, the workers compile and run the requests
+//the requests of a client run in order on one worker at a time, the clients run in parallel
+class KppServer{
+	std::string path;
+	const kpp::EngineOptions& options;
+	SharedObjectCache cache;
+	int listen_fd;
+	int wake_fds[2];		//a worker writes a byte when it has a reply for the event loop to send
+
+	std::mutex lock;
+	std::condition_variable ready_cond;
+	std::deque<ServerClient*> ready;	//clients with requests and no worker
+	std::vector<ServerClient*> clients;
+	std::vector<std::thread> workers;
+	bool stopping;
+	unsigned next_id;
+
+	void acceptClients();
+	bool readClient(ServerClient* client);
+	bool writeClient(ServerClient* client);
+	void dropClient(ServerClient* client);
+	void destroyClient(ServerClient* client);
+	void workerLoop();
+	std::string runRequest(ServerClient* client, const std::string& line);
+
+public:
+	KppServer(const std::string& socket_path, const kpp::EngineOptions& opts);
+	~KppServer();
+	bool start(unsigned threads);
+	void run();
+};
 
+static volatile sig_atomic_t server_interrupted = 0;
 
-	Module *current_module = theHelper->getModuleForNewFunction();
+static void server_signal(int){
+	server_interrupted = 1;
+}
 
-	Function* func = Function::Create(Func_type, Function::ExternalLinkage, func_name, current_module);
+KppServer::KppServer(const std::string& socket_path, const kpp::EngineOptions& opts)
+	:path(socket_path), options(opts), cache(opts.cache_size << 20), listen_fd(-1), stopping(false), next_id(0){
+	wake_fds[0] = wake_fds[1] = -1;
+}
 
-	if (func == nullptr){
-		Error("Fail to construct a function proto");
-		return nullptr;
+KppServer::~KppServer(){
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
 	}
+	ready_cond.notify_all();
+	//a worker finishes the request it runs
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	for (ServerClient* client : clients) {
+		if (client->fd >= 0)
+			close(client->fd);
+		destroyClient(client);
+	}
+	if (listen_fd >= 0){
+		close(listen_fd);
+		unlink(path.c_str());
+	}
+	if (wake_fds[0] >= 0){
+		close(wake_fds[0]);
+		close(wake_fds[1]);
+	}
+	if (KPP_LOG_ENABLED(LOG_INFO))
+		cache.printStats();
+}
 
-	if (func->getName() != func_name){
-		func->eraseFromParent();
-
-		//theHelperбJIT(Modules vector)ûJIT(openModule)Modulesвfunc
-		func = theHelper->getFunction(func_name);
+bool KppServer::start(unsigned threads){
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)){
+		KPP_LOG(LOG_ERROR, "Socket path too long %s", path.c_str());
+		return false;
+	}
+	strcpy(address.sun_path, path.c_str());
 
-		if (!func->empty()){
-			ErrorF("redefinition of function");
-			return nullptr;
-		}
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0 || pipe2(wake_fds, O_NONBLOCK | O_CLOEXEC) != 0){
+		KPP_LOG(LOG_ERROR, "Could not create the server socket: %s", strerror(errno));
+		return false;
+	}
+	//a socket left by a server that is gone
+	unlink(path.c_str());
+	if (bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, 64) != 0){
+		KPP_LOG(LOG_ERROR, "Could not listen on %s: %s", path.c_str(), strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return false;
+	}
 
-		if (func->arg_size() != func_args.size()){
-			ErrorF("Differenct arguments given");
-			return nullptr;
-		}
+	if (!threads)
+		threads = std::max(std::thread::hardware_concurrency(), 1u);
+	for (unsigned i = 0; i < threads; ++i) {
+		workers.emplace_back(&KppServer::workerLoop, this);
 	}
-	unsigned Idx = 0;
-	for (Function::arg_iterator AI = func->arg_begin(); Idx != this->func_args.size();
-		++AI, ++Idx)
-		AI->setName(this->func_args[Idx]);
 
-	return func;
+	//no SA_RESTART, poll returns on SIGINT and SIGTERM
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = server_signal;
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+	KPP_LOG(LOG_INFO, "kpp server listening on %s, %u worker threads", path.c_str(), threads);
+	return true;
 }
 
-void PrototypeAST::CreateArgumentAllocas(Function *func){
+void KppServer::run(){
+	std::vector<pollfd> fds;
+	std::vector<ServerClient*> polled;
+	while (!server_interrupted){
+		fds.clear();
+		polled.clear();
+		fds.push_back(pollfd{ listen_fd, POLLIN, 0 });
+		fds.push_back(pollfd{ wake_fds[0], POLLIN, 0 });
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			for (ServerClient* client : clients) {
+				if (client->fd < 0)
+					continue;
+				short events = client->input_closed ? 0 : POLLIN;
+				if (!client->output.empty())
+					events |= POLLOUT;
+				fds.push_back(pollfd{ client->fd, events, 0 });
+				polled.push_back(client);
+			}
+		}
+		if (poll(fds.data(), fds.size(), -1) < 0){
+			if (errno == EINTR)
+				continue;
+			KPP_LOG(LOG_ERROR, "poll failed: %s", strerror(errno));
+			return;
+		}
 
-	Function::arg_iterator arg_iter = func->arg_begin();
-	Type* default_type = Type::getDoubleTy(getGlobalContext());
-	for (uint32_t i = 0; i != func_args.size(); ++i) {
-		AllocaInst *cur_alloca = CreateEntryBlockAlloca(func, func_args[i], default_type);
-		Builder.CreateStore(arg_iter++, cur_alloca);
-		namedValues[func_args[i]] = cur_alloca;
+		if (fds[1].revents & POLLIN){
+			char drain[256];
+			while (read(wake_fds[0], drain, sizeof(drain)) > 0) {}
+		}
+		//polled only changes here, a client is not destroyed before it is dropped by this loop
+		for (size_t i = 0; i < polled.size(); ++i) {
+			ServerClient* client = polled[i];
+			short events = fds[i + 2].revents;
+			bool alive = !(events & POLLERR) && !(client->input_closed && (events & POLLHUP));
+			if (alive && (events & (POLLIN | POLLHUP)))
+				alive = readClient(client);
+			if (alive && (events & POLLOUT))
+				alive = writeClient(client);
+			if (alive && client->input_closed){
+				std::lock_guard<std::mutex> guard(lock);
+				alive = client->busy || !client->requests.empty() || !client->output.empty();
+			}
+			if (!alive)
+				dropClient(client);
+		}
+		if (fds[0].revents & POLLIN)
+			acceptClients();
 	}
+	KPP_LOG(LOG_INFO, "kpp server stopped");
 }
 
-Function *FunctionAST::Codegen(){
-	namedValues.clear();
-	Function* theFunc = this->func_proto->Codegen();
-	if (theFunc == nullptr){
-		DEBUG_CERR("Failed in Prototype generation");
-		return nullptr;
+void KppServer::acceptClients(){
+	while (true){
+		int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		std::lock_guard<std::mutex> guard(lock);
+		clients.push_back(new ServerClient(fd, ++next_id));
 	}
-	DEBUG_CERR("Function prototype generation successs\n");
-
-	BasicBlock *BB = BasicBlock::Create(getGlobalContext(), "entry", theFunc);
-	Builder.SetInsertPoint(BB);
-
-	this->func_proto->CreateArgumentAllocas(theFunc);
-
-	if (Value *ret_value = this->body->Codegen()){
+}
 
+//false when the connection is gone
+bool KppServer::readClient(ServerClient* client){
+	char buffer[4096];
+	bool alive = true;
+	while (true){
+		ssize_t count = read(client->fd, buffer, sizeof(buffer));
+		if (count > 0){
+			client->input.append(buffer, count);
+			continue;
+		}
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (count < 0 && errno == EINTR)
+			continue;
+		//the requests received before the end of the input are still run and replied
+		if (count == 0)
+			client->input_closed = true;
+		else
+			alive = false;
+		break;
+	}
 
+	auto now = std::chrono::steady_clock::now();
+	size_t begin = 0, end;
+	std::lock_guard<std::mutex> guard(lock);
+	while ((end = client->input.find('\n', begin)) != std::string::npos) {
+		client->requests.push_back(ServerRequest{ client->input.substr(begin, end - begin), now });
+		begin = end + 1;
+	}
+	client->input.erase(0, begin);
+	if (!client->busy && !client->requests.empty()){
+		client->busy = true;
+		ready.push_back(client);
+		ready_cond.notify_one();
+	}
+	return alive;
+}
 
-		if (this->func_proto->isBinary()){
-			binary_op_precedence[func_proto->getOperatorName()] = func_proto->getBinaryProceence();
+bool KppServer::writeClient(ServerClient* client){
+	std::lock_guard<std::mutex> guard(lock);
+	while (!client->output.empty()){
+		ssize_t count = send(client->fd, client->output.data(), client->output.size(), MSG_NOSIGNAL);
+		if (count > 0){
+			client->output.erase(0, count);
+			continue;
 		}
-		Builder.CreateRet(ret_value);
-		verifyFunction(*theFunc);
-
-		return theFunc;
+		if (count < 0 && errno == EINTR)
+			continue;
+		return count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
 	}
+	return true;
+}
 
-	DEBUG_CERR("Failed in function body codegen\n");
-	theFunc->eraseFromParent();
-	return nullptr;
+//the connection is closed now, the client is destroyed once no worker runs it
+void KppServer::dropClient(ServerClient* client){
+	close(client->fd);
+	std::unique_lock<std::mutex> guard(lock);
+	client->fd = -1;
+	client->requests.clear();
+	clients.erase(std::find(clients.begin(), clients.end(), client));
+	if (client->busy)
+		return;
+	guard.unlock();
+	destroyClient(client);
 }
 
+void KppServer::destroyClient(ServerClient* client){
+	KPP_LOG(LOG_INFO, "client %u: %s", client->id, client->formatLatency().c_str());
+	if (client->session){
+		SessionScope scope(client->session);
+		delete client->session;
+	}
+	delete client;
+}
 
-static void HandleDefinition(std::istream& input){
-	std::cout << "Handing definition" << std::endl;
-	if (FunctionAST* func_ast = ParseDefinition(input)){
-		if (Function* func = func_ast->Codegen()){
-			fprintf(stderr, "Read the function definition:");
-			func->dump();
+void KppServer::workerLoop(){
+	std::unique_lock<std::mutex> guard(lock);
+	while (true){
+		ready_cond.wait(guard, [this](){ return stopping || !ready.empty(); });
+		if (stopping)
+			return;
+		ServerClient* client = ready.front();
+		ready.pop_front();
+
+		while (!client->requests.empty() && client->fd >= 0){
+			ServerRequest request = std::move(client->requests.front());
+			client->requests.pop_front();
+			guard.unlock();
+			std::string reply = runRequest(client, request.line);
+			double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - request.received).count();
+			guard.lock();
+			client->addLatency(us);
+			client->output += reply;
+			client->output += '\n';
+			if (write(wake_fds[1], "", 1) < 0) {}
 		}
-		else{
-			fprintf(stderr, "failed in FunctionAST codegen");
+		client->busy = false;
+		//dropped by the event loop while it ran
+		if (client->fd < 0){
+			guard.unlock();
+			destroyClient(client);
+			guard.lock();
 		}
 	}
-	else{
-		fprintf(stderr, "Invalid definition syntax");
-		get_next_tok(input);
-	}
 }
 
-
-static void HandleExtern(std::istream& input){
-	if (PrototypeAST* proto = ParseExtern(input)){
-		if (Function* func = proto->Codegen()){
-			fprintf(stderr, "Read extern: ");
-			func->dump();
+//a call of a compiled function with constant arguments, name(1, 2.5), is run without the parser and the compiler
+static bool parse_constant_call(const std::string& line, std::string& name, std::vector<double>& args){
+	size_t pos = line.find_first_not_of(" \t\r");
+	if (pos == std::string::npos || !isalpha(line[pos]))
+		return false;
+	size_t name_end = pos;
+	while (name_end < line.size() && isalnum(line[name_end]))
+		++name_end;
+	name = line.substr(pos, name_end - pos);
+	const char* cur = line.c_str() + name_end;
+	while (*cur == ' ' || *cur == '\t')
+		++cur;
+	if (*cur++ != '(')
+		return false;
+	args.clear();
+	while (true){
+		while (*cur == ' ' || *cur == '\t')
+			++cur;
+		if (*cur == ')' && args.empty())
+			break;
+		//the numbers of the lexer only, digits and at most one '.'; 1e3, -1, inf or 0x10 go to the compiler, which rejects them
+		const char* number_end = cur;
+		unsigned digits = 0, dots = 0;
+		for (; isdigit(*number_end) || *number_end == '.'; ++number_end) {
+			if (*number_end == '.')
+				++dots;
+			else
+				++digits;
 		}
+		//an integer the lexer reads with stoi
+		if (!digits || dots > 1 || (!dots && digits > 9))
+			return false;
+		args.push_back(strtod(std::string(cur, number_end).c_str(), nullptr));
+		cur = number_end;
+		while (*cur == ' ' || *cur == '\t')
+			++cur;
+		if (*cur == ')')
+			break;
+		if (*cur++ != ',')
+			return false;
 	}
-	else{
-		get_next_tok(input);
-	}
+	++cur;
+	while (*cur == ' ' || *cur == '\t' || *cur == ';' || *cur == '\r')
+		++cur;
+	return *cur == '\0';
 }
 
-static void HandleToplevelExpression(std::istream& input){
-	typedef double(*anony_func_type)();
-	if (FunctionAST *top_func_expr = ParseToplevelExpr(input)){
-		if (Function* top_func = top_func_expr->Codegen()){
-			anony_func_type anony_func = (anony_func_type)theHelper->getPointerToFunction(top_func);
-			fprintf(stderr, "Evaluated to %lf\n", anony_func());
-		}
-	}
-	else{
-		get_next_tok(input);
+static bool call_compiled_function(void* address, const std::vector<double>& args, double& result){
+	typedef double(*F0)();
+	typedef double(*F1)(double);
+	typedef double(*F2)(double, double);
+	typedef double(*F3)(double, double, double);
+	typedef double(*F4)(double, double, double, double);
+	switch (args.size())
+	{
+	case 0:
+		result = ((F0)address)();
+		return true;
+	case 1:
+		result = ((F1)address)(args[0]);
+		return true;
+	case 2:
+		result = ((F2)address)(args[0], args[1]);
+		return true;
+	case 3:
+		result = ((F3)address)(args[0], args[1], args[2]);
+		return true;
+	case 4:
+		result = ((F4)address)(args[0], args[1], args[2], args[3]);
+		return true;
+	default:
+		return false;
 	}
 }
 
-
-static void mainloop(std::istream& input){
-	fprintf(stderr, "ready>");
-	get_next_tok(input);
-	while (true) {
-		switch (cur_tok)
-		{
-		case TOK::DEF_TOK:
-			HandleDefinition(input);
-			break;
-		case TOK::EXTERN_TOK:
-			HandleExtern(input);
-			break;
-		case ';':
-			get_next_tok(input);
-			break;
-		case TOK::EOF_TOK:
-			fprintf(stderr, "token eof");
-			return;
-		default:
-			HandleToplevelExpression(input);
-			break;
+std::string KppServer::runRequest(ServerClient* client, const std::string& line){
+	if (line == ":latency")
+		return "ok " + client->formatLatency();
+
+	if (!client->session){
+		client->session = new kpp::Session();
+		SessionScope scope(client->session);
+		client->session->echo = false;
+		client->session->keep_results = true;
+		if (!start_session(options, true, &cache))
+			client->session->codegen = nullptr;
+	}
+	SessionScope scope(client->session);
+	if (!client->session->codegen)
+		return "error could not start the JIT";
+
+	char value[32];
+	std::string name;
+	std::vector<double> args;
+	if (parse_constant_call(line, name, args)){
+		client->session->helper->atSafePoint();
+		void* address = client->session->helper->getFunctionAddress(name, args.size());
+		double result;
+		if (address && call_compiled_function(address, args, result)){
+			++client->fast_calls;
+			snprintf(value, sizeof(value), "%.17g", result);
+			return std::string("ok ") + value;
 		}
-		fprintf(stderr, "ready>");
 	}
-}
 
-//===----------------------------------------------------------------------===//
-// "Library" functions that can be "extern'd" from user code.
-//===----------------------------------------------------------------------===//
-/// putchard - putchar that takes a double and returns 0.
-extern "C" double putchard(double X) {
-	putchar((char)X);
-	return 0;
+	if (!compile_source(line))
+		return "error " + client->session->last_error;
+	std::string reply = "ok";
+	for (double result : client->session->results) {
+		snprintf(value, sizeof(value), " %.17g", result);
+		reply += value;
+	}
+	return reply;
 }
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-double printd(double X) {
-	printf("%f\n", X);
+
+static int run_server(const std::string& path, unsigned threads, const kpp::EngineOptions& options){
+	KppServer server(path, options);
+	if (!server.start(threads))
+		return 1;
+	server.run();
 	return 0;
 }
-
-void init_buildin_operator(){
-	binary_op_precedence['='] = 2;
-	binary_op_precedence['<'] = 10;
-	binary_op_precedence['+'] = 20;
-	binary_op_precedence['-'] = 20;
-	binary_op_precedence['*'] = 40;
-	binary_op_precedence['/'] = 40;
+#endif	//__linux__
+
+//the reports at exit: compile time of --stats, the trace file of --trace, the calls of --profile
+static void finish_reports(const KppOptions& options){
+	if (options.call_profile){
+		CallProfiler::get()->print();
+		if (!options.profile_stacks.empty())
+			CallProfiler::get()->writeStacks(options.profile_stacks);
+	}
+	if (!compile_stats)
+		return;
+	if (options.stats)
+		compile_stats->print();
+	if (!options.trace.empty())
+		compile_stats->writeTrace(options.trace);
 }
 
-int main(){
-
-	///InitializeNativeTarget - The main program should call this function to
-	/// initialize the native target corresponding to the host.  This is useful 
-	/// for JIT applications to ensure that the target gets linked in correctly.
-	/// It is legal for a client to make multiple calls to this function.
-	InitializeNativeTarget();
-
-	/// InitializeNativeTargetAsmPrinter - The main program should call
-	/// this function to initialize the native target asm printer.
-	InitializeNativeTargetAsmPrinter();
-
-	/// InitializeNativeTargetAsmParser - The main program should call
-	/// this function to initialize the native target asm parser.
-	InitializeNativeTargetAsmParser();
-
-	LLVMContext &Context = getGlobalContext();
-
-
-	llvm::sys::DynamicLibrary::AddSymbol("printd", &printd);
-
-	init_buildin_operator();
-
-	theHelper = new MCJITHelper(Context);
-
-	std::unique_ptr<Module> Owner = make_unique<Module>("my cool jit", Context);
-	TheModule = Owner.get();
-	TheModule->setTargetTriple("i686-pc-windows-msvc-elf");
-	// Create the JIT.  This takes ownership of the module.
-	std::string ErrStr;
-	TheExecutionEngine =
-		EngineBuilder(std::move(Owner))
-		.setErrorStr(&ErrStr)
-		.setMCJITMemoryManager(llvm::make_unique<SectionMemoryManager>())
-		.create();
+int main(int argc, char** argv){
 
+	KppOptions options;
+	if (!parse_args(argc, argv, options)){
+		print_usage(argv[0]);
+		return 1;
+	}
 
+	//the REPL prints its prompt, the values and what it logs at LOG_INFO; scripts and pipes are silent but for warnings
+	bool interactive = !options.aot && options.server.empty() && options.script.empty() && sys::Process::StandardInIsUserInput();
+	if (options.log_level < 0)
+		options.log_level = interactive || !options.server.empty() ? LOG_INFO : LOG_WARN;
+	kpp_log_level = std::min(options.log_level, (int)KPP_LOG_MAX_LEVEL);
+	if (!options.dump_ir.empty() && !open_ir_dump(options.dump_ir))
+		return 1;
+	//before the first pipeline, the pass timers are registered when it is built
+	if (options.stats || !options.trace.empty())
+		compile_stats = new CompileStats(!options.trace.empty());
+
+	initialize_llvm();
+	theSession = new kpp::Session();
+	theSession->echo = interactive;
+	if (!options.script.empty()){
+		//the line table of -g names the script
+		SmallString<128> directory;
+		if (!sys::fs::current_path(directory))
+			theSession->debug_info.directory = directory.str().str();
+		theSession->debug_info.file = options.script;
+	}
 
-	if (!TheExecutionEngine){
-		fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
-		exit(1);
+	//LLVM reports the remarks through the default diagnostic handler of the context
+	if (!options.pass_remarks.empty()){
+		std::string remarks = "-pass-remarks=" + options.pass_remarks;
+		std::string missed_remarks = "-pass-remarks-missed=" + options.pass_remarks;
+		std::string analysis_remarks = "-pass-remarks-analysis=" + options.pass_remarks;
+		const char* llvm_argv[] = { argv[0], remarks.c_str(), missed_remarks.c_str(), analysis_remarks.c_str() };
+		cl::ParseCommandLineOptions(4, llvm_argv);
 	}
 
+	if (!options.profile_in.empty()){
+		theSession->profile = new ProfileData();
+		if (!theSession->profile->load(options.profile_in))
+			return 1;
+	}
 
-	// Prime the first token.
-	//	fprintf(stderr, "ready> ");
-	//get_next_tok(std::cin);
-	// Make the module, which holds all the code.
+	if (options.aot){
+		if (options.call_profile){
+			KPP_LOG(LOG_WARN, "kppc has no call profiler, --profile is ignored");
+			options.call_profile = false;
+		}
+		if (!start_session(options, false))
+			return 1;
+		int status = compile_script(options);
+		finish_reports(options);
+		return status;
+	}
 
+	if (!options.server.empty()){
+#ifdef __linux__
+		//the workers compile the requests of different clients in parallel, each session compiles lazily
+		if (options.jit_threads < 0)
+			options.jit_threads = 0;
+		int status = run_server(options.server, options.server_threads, options);
+		finish_reports(options);
+		return status;
+#else
+		fprintf(stderr, "--server needs Unix sockets\n");
+		return 1;
+#endif
+	}
 
-	/*if (TheExecutionEngine->isSymbolSearchingDisabled ()){
-	fprintf(stdout, "SymbolSearchingDisabled\n");
+	//the REPL waits for the user most of the time, a definition is compiled before the next line is typed
+	//a script calls few of its functions, lazy compilation does less work
+	//--pipelined compiles the definitions on a thread of their own while the next statements are parsed
+	if (options.jit_threads < 0)
+		options.jit_threads = (options.script.empty() && sys::Process::StandardInIsUserInput()) || options.pipelined ? 1 : 0;
+	if (!start_session(options, true)){
+		return 1;
 	}
-	else{
-	fprintf(stdout, "Able\n");
+	if (!options.script.empty()){
+		//a script is read much faster than it is compiled, its definitions are grouped in bigger modules
+		theSession->helper->setDefinitionsPerModule(32);
 	}
-	*/
-
-
-	legacy::FunctionPassManager OurFPM(TheModule);
 
-	TheModule->setDataLayout(TheExecutionEngine->getDataLayout());
-
-	OurFPM.add(createBasicAliasAnalysisPass());
-	// Promote allocas to registers.
-	OurFPM.add(createPromoteMemoryToRegisterPass());
-	// Do simple "peephole" optimizations and bit-twiddling optzns.
-	OurFPM.add(createInstructionCombiningPass());
-	// Reassociate expressions.
-	OurFPM.add(createReassociatePass());
-	// Eliminate Common SubExpressions.
-	OurFPM.add(createGVNPass());
-	// Simplify the control flow graph (deleting unreachable blocks, etc).
-	OurFPM.add(createCFGSimplificationPass());
-	OurFPM.doInitialization();
-	// Set the global so the code gen can use this.
-	TheFuncPM = &OurFPM;
 	// Run the main "interpreter loop" now.
-	mainloop(std::cin);
-	TheFuncPM = 0;
+	if (!options.script.empty()){
+		std::ifstream script(options.script);
+		if (!script){
+			fprintf(stderr, "Could not open script %s\n", options.script.c_str());
+			return 1;
+		}
+		theSession->batch_mode = true;
+		if (options.pipelined)
+			pipelined_mainloop(script, options.pipelined);
+		else
+			mainloop(script);
+		if (!options.profile_out.empty())
+			save_profile(options.profile_out);
+		theSession->stopJIT();
+		if (theSession->object_cache){
+			if (KPP_LOG_ENABLED(LOG_INFO))
+				theSession->object_cache->printStats();
+			theSession->object_cache->prune();
+		}
+		finish_reports(options);
+		delete theSession;
+		return 0;
+	}
+
+	if (options.pipelined)
+		pipelined_mainloop(std::cin, options.pipelined);
+	else
+		mainloop(std::cin);
 	// Print out all of the generated code.
-	TheModule->dump();
+	{
+		std::lock_guard<std::mutex> lock(ir_dump_lock);
+		if (raw_ostream* out = get_ir_dump())
+			theSession->helper->dump(*out);
+	}
+	if (!options.profile_out.empty())
+		save_profile(options.profile_out);
+	theSession->stopJIT();
+	if (theSession->object_cache){
+		theSession->object_cache->prune();
+	}
+	finish_reports(options);
+	delete theSession;
 
 
 
@@ -1802,4 +7378,6 @@ int main(){
 	std::cin.get();
 	std::cin.get();
 	return 0;
-}
\ No newline at end of file
+}
+
+#endif	//KPP_EMBEDDED
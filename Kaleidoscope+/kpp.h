@@ -0,0 +1,129 @@
+#ifndef _KALEIDOSCOPE_ENGINE
+#define _KALEIDOSCOPE_ENGINE
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+//kpp embedded in a C++ program
+//build Kaleidoscope+.cpp with KPP_EMBEDDED defined, it has no main then
+//
+//	kpp::Engine engine;
+//	engine.compile("def add(x y) x + y;");
+//	auto add = engine.lookup<double(double, double)>("add");
+//	double z = add(1, 2);
+namespace kpp{
+
+	struct Session;
+
+	//options of an engine, the same as the kpp command line options of the same names
+	struct EngineOptions{
+		unsigned opt_level;		//-O0 ... -O3
+		std::string pipeline;	//--passes=<pipeline>
+		std::string mcpu;		//--mcpu=<cpu>
+		std::string mattr;		//--mattr=<+feature,-feature>
+		std::string cache_dir;	//--cache-dir=<dir>, disabled if empty
+		uint64_t cache_size;	//--cache-size=<MB>
+		int jit_threads;		//--jit-threads=<n>, 0 for lazy compilation on the calling thread
+		uint64_t jit_slab_size;	//--jit-slab-size=<KB>, 0 for SectionMemoryManager
+		bool jit_huge_pages;	//--jit-huge-pages
+		bool stub_calls;		//--calls=stub, the functions can be redefined
+		uint64_t code_budget;	//--jit-budget, in bytes, implies stub_calls
+		uint64_t pgo_threshold;	//--pgo=<calls>, implies stub_calls
+		unsigned parfor_threads;	//--parfor-threads=<n>, 0 for one per core; the pool is shared by the process, sized by its first user
+		bool perf_map;			//--perf-map, the JIT symbols in /tmp/perf-<pid>.map for perf report
+		bool jitdump;			//--jitdump, a jitdump file for perf inject --jit, with the line table of debug_lines
+		bool debug_lines;		//-g, DWARF line tables in the code
+		bool call_profile;		//--profile, count the calls and time of every function, reported by the ':profile' command
+
+		EngineOptions() :opt_level(2), cache_size(256), jit_threads(0), jit_slab_size(1024), jit_huge_pages(false),
+			stub_calls(false), code_budget(0), pgo_threshold(0), parfor_threads(0), perf_map(false), jitdump(false), debug_lines(false),
+			call_profile(false){}
+	};
+
+	namespace detail{
+		template <typename T> struct AsDouble{ typedef double type; };
+		template <typename T> struct AsColumn{ typedef const double* type; };
+
+		//kpp functions take and return doubles
+		template <typename Signature> struct KppSignature{
+			static const bool valid = false;
+			static const unsigned arity = 0;
+			typedef void* batch_type;
+		};
+		template <typename... Args> struct KppSignature<double(Args...)>{
+			static const bool valid = std::is_same<double(Args...), double(typename AsDouble<Args>::type...)>::value;
+			static const unsigned arity = sizeof...(Args);
+			//out[i] = f(col0[i], col1[i], ...) for i < n
+			typedef void(*batch_type)(typename AsColumn<Args>::type..., double* out, size_t n);
+		};
+	}
+
+	//a kpp session of its own: LLVM context, lexer and parser state, optimizer and JIT
+	//an engine is used by one thread at a time, the functions looked up can be called from any thread
+	//the code replaced by a redefinition or a --pgo tier up is kept until collect, so the functions looked up can keep running
+	//during compile and eval; with code_budget the cold code is only evicted by collect too
+	//engines on different threads compile and run in parallel, each has its own LLVMContext and locks
+	class Engine{
+		Session* session;
+
+		void* lookupAddress(const std::string& name, unsigned arity);
+		void* lookupBatchAddress(const std::string& name, unsigned arity);
+
+	public:
+		explicit Engine(const EngineOptions& options = EngineOptions());
+		~Engine();
+		Engine(const Engine&) = delete;
+		Engine& operator=(const Engine&) = delete;
+
+		bool isValid()const;
+
+		//definitions, externs, top-level expressions and ':' commands, the expressions are run
+		//returns false if any of them failed, getError tells the last error
+		bool compile(const std::string& source);
+
+		//compile source, result is the value of its last top-level expression
+		bool eval(const std::string& source, double& result);
+
+		//the code of a kpp function, nullptr if there is no function name with the arguments of Signature
+		//the pointer is valid as long as the engine, a stubbed function called through it sees its redefinitions
+		//after the compile that made them
+		template <typename Signature>
+		Signature* lookup(const std::string& name){
+			static_assert(detail::KppSignature<Signature>::valid, "kpp functions take and return double");
+			return reinterpret_cast<Signature*>(lookupAddress(name, detail::KppSignature<Signature>::arity));
+		}
+
+		//a kernel running name over columns of arguments, with the body of name inlined into a vectorized loop
+		//	auto score = engine.lookupBatch<double(double, double)>("score");
+		//	score(col0, col1, out, n);
+		//the kernel keeps the definition it was built from, a redefinition gets a new kernel at the next lookup
+		template <typename Signature>
+		typename detail::KppSignature<Signature>::batch_type lookupBatch(const std::string& name){
+			static_assert(detail::KppSignature<Signature>::valid, "kpp functions take and return double");
+			typedef typename detail::KppSignature<Signature>::batch_type batch_type;
+			return reinterpret_cast<batch_type>(lookupBatchAddress(name, detail::KppSignature<Signature>::arity));
+		}
+
+		//the kernel of name over columns[0] ... columns[arity - 1], the rows split among threads
+		bool evalBatch(const std::string& name, const double* const* columns, double* out, size_t n, unsigned threads = 1);
+
+		//the array name of the kpp code, a[i], sum(a), dot(a, b) ..., reads length doubles at data
+		//the memory stays the host's, it must outlive the code using it or be bound again; binding again needs no recompilation
+		bool bindArray(const std::string& name, const double* data, size_t length);
+
+		//free the code replaced since the last collect and evict the cold code above code_budget
+		//no thread may be running a function of the engine meanwhile
+		void collect();
+
+		const std::string& getError()const;
+
+		//what the last compile or eval wrote: the log lines, errors included, and the output of the ':' commands
+		//an engine writes nothing to stderr, but for the errors of code compiled on other threads: the compile threads of jit_threads,
+		//or the host threads calling a stubbed function not compiled yet
+		const std::string& getOutput()const;
+	};
+
+}
+
+#endif	//_KALEIDOSCOPE_ENGINE
@@ -0,0 +1,49 @@
+#!/bin/sh
+# batch evaluation benchmark
+# times the batch kernels of batch_eval.kpp, a call per row through the function pointer,
+# and the same loops written in C
+#
+# usage: batch_eval.sh [path to kpp]
+KPP=${1:-./toy}
+DIR=$(dirname "$0")
+CC=${CC:-cc}
+TMP=${TMPDIR:-/tmp}/batch_eval.$$
+
+cat > "$TMP.c" <<'CEOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#define ROWS 4000000
+static double now(void){ struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t); return t.tv_sec * 1e3 + t.tv_nsec / 1e6; }
+static void score(const double* restrict a, const double* restrict b, const double* restrict c, double* restrict out, long n){
+	for (long i = 0; i < n; ++i) out[i] = a[i] < b[i] ? a[i] * b[i] + c[i] : (a[i] - b[i]) * c[i];
+}
+static void poly(const double* restrict x, double* restrict out, long n){
+	for (long i = 0; i < n; ++i) out[i] = ((x[i] * 0.5 + 1.5) * x[i] - 2) * x[i] + 3;
+}
+int main(void){
+	double* col[3];
+	double* out = malloc(ROWS * sizeof(double));
+	for (int j = 0; j < 3; ++j) {
+		col[j] = malloc(ROWS * sizeof(double));
+		for (long i = 0; i < ROWS; ++i) col[j][i] = (double)(i % 1024) / 1024 + j;
+	}
+	score(col[0], col[1], col[2], out, ROWS);
+	double start = now();
+	score(col[0], col[1], col[2], out, ROWS);
+	double ms = now() - start;
+	printf("C score: %d rows, %.3f ms (%.1f Mrows/s)\n", ROWS, ms, ROWS / ms / 1000);
+	poly(col[0], out, ROWS);
+	start = now();
+	poly(col[0], out, ROWS);
+	ms = now() - start;
+	printf("C poly: %d rows, %.3f ms (%.1f Mrows/s)\n", ROWS, ms, ROWS / ms / 1000);
+	return out[ROWS / 2] < 0;
+}
+CEOF
+
+echo "== kpp"
+"$KPP" -O3 "$DIR/batch_eval.kpp" 2>&1 | sed 's/ready>//g' | grep -a -E "rows"
+echo "== $CC -O3 -march=native"
+"$CC" -O3 -march=native -o "$TMP" "$TMP.c" && "$TMP"
+rm -f "$TMP" "$TMP.c"
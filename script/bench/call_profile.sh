@@ -0,0 +1,31 @@
+#!/bin/sh
+# the cost of --profile: a program of small and large functions with and without the call profiler
+# prints both wall times, the profile table and the first lines of the collapsed stacks
+#
+# usage: call_profile.sh <kpp> [fib argument]
+KPP=${1:?usage: call_profile.sh <kpp> [fib argument]}
+N=${2:-30}
+OUT=${TMPDIR:-/tmp}/call_profile.$$
+
+# fib: a call every few ns, the worst case; spin: a loop of 10^7 iterations per call, about no cost
+cat > "$OUT.kpp" <<KPP
+def fib(n) if n < 2 then n else fib(n - 1) + fib(n - 2);
+def spin(n) var s = 0 in (for i = 0, i < n, 1 in s = s + i * i) + s;
+def spins(k) var s = 0 in (for j = 0, j < k, 1 in s = s + spin(10000000)) + s;
+fib($N);
+spins(10);
+KPP
+
+# run <options>, prints the wall time
+run(){
+	start=$(date +%s.%N)
+	"$KPP" "$@" "$OUT.kpp" 2> "$OUT.err" > /dev/null
+	end=$(date +%s.%N)
+	echo "$start $end" | awk '{ printf "%.3f s", $2 - $1 }'
+}
+
+echo "no profiler: $(run)"
+echo "--profile:   $(run --profile="$OUT.stacks")"
+cat "$OUT.err"
+head -5 "$OUT.stacks"
+rm -f "$OUT.kpp" "$OUT.err" "$OUT.stacks"
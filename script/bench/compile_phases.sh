@@ -0,0 +1,37 @@
+#!/bin/sh
+# where the compile time of a generated program goes, with --stats and --trace
+# prints the phase table, and the wall time with and without the timers; checks the trace is written
+#
+# usage: compile_phases.sh <kpp> [definitions]
+KPP=${1:?usage: compile_phases.sh <kpp> [definitions]}
+N=${2:-300}
+OUT=${TMPDIR:-/tmp}/compile_phases.$$
+
+awk -v n="$N" 'BEGIN {
+	for (i = 0; i < n; ++i) {
+		printf "def f%d(x) var s = 0 in (for j = 0, j < x, 1 in s = s + j * %d) + s;\n", i, i % 7 + 1
+		printf "f%d(1000);\n", i
+	}
+}' > "$OUT.kpp"
+
+# run <options>, prints the wall time
+run(){
+	start=$(date +%s.%N)
+	"$KPP" "$@" "$OUT.kpp" 2> "$OUT.err" > /dev/null
+	end=$(date +%s.%N)
+	echo "$start $end" | awk '{ printf "%.3f s", $2 - $1 }'
+}
+
+echo "$N definitions, $N expressions"
+echo "no timers: $(run)"
+echo "--stats:   $(run --stats --trace="$OUT.json")"
+cat "$OUT.err"
+if head -c 15 "$OUT.json" 2> /dev/null | grep -q traceEvents; then
+	echo "trace: $(grep -c '"ph":"X"' "$OUT.json") events"
+	STATUS=0
+else
+	echo "no trace written"
+	STATUS=1
+fi
+rm -f "$OUT.kpp" "$OUT.err" "$OUT.json"
+exit $STATUS
@@ -0,0 +1,103 @@
+/* the kernels of kernels.kpp in C, built by kernels.sh with $CC -O2
+ * the same operations in the same order, so the checksums are the same; the loop counters are integers, as C programmers write them
+ */
+#include <math.h>
+
+/* the arrays a and b of dot_builtin and sum_loop, set by the harness */
+const double* kernel_a;
+const double* kernel_b;
+long kernel_length;
+
+double c_fib(double n){
+	return n < 2 ? n : c_fib(n - 1) + c_fib(n - 2);
+}
+
+double c_nested(double n){
+	double s = 0;
+	for (long i = 0; i < (long)n; ++i)
+		for (long j = 0; j < (long)n; ++j)
+			s = s + (double)i * j + 1;
+	return s;
+}
+
+/* the kpp loop tests the condition after the body, with the counter before its increment */
+static double mandel_point(double cr, double ci){
+	double zr = 0, zi = 0, t, k = 0;
+	int it = 0, more;
+	do {
+		t = zr * zr - zi * zi + cr;
+		zi = 2 * zr * zi + ci;
+		zr = t;
+		k = k + 1;
+		more = it < 49 && zr * zr + zi * zi < 4;
+		++it;
+	} while (more);
+	return k;
+}
+
+double c_mandel(double n){
+	double s = 0;
+	for (long y = 0; y < (long)n; ++y)
+		for (long x = 0; x < (long)n; ++x)
+			s = s + mandel_point((double)x * 3 / n - 2, (double)y * 2 / n - 1);
+	return s;
+}
+
+double c_nbody(double n){
+	double x0 = 0, y0 = 0, z0 = 0, x1 = 1, y1 = 0, z1 = 0, x2 = 0, y2 = 1, z2 = 0.5;
+	double u0 = 0, v0 = 0, w0 = 0, u1 = 0, v1 = 0.5, w1 = 0, u2 = -0.5, v2 = 0, w2 = 0.1;
+	for (long step = 0; step < (long)n; ++step) {
+		double dx, dy, dz, d2, f;
+		dx = x0 - x1; dy = y0 - y1; dz = z0 - z1;
+		d2 = dx * dx + dy * dy + dz * dz + 0.01;
+		f = 0.001 / (d2 * sqrt(d2));
+		u0 = u0 - dx * 0.5 * f; v0 = v0 - dy * 0.5 * f; w0 = w0 - dz * 0.5 * f;
+		u1 = u1 + dx * f; v1 = v1 + dy * f; w1 = w1 + dz * f;
+
+		dx = x0 - x2; dy = y0 - y2; dz = z0 - z2;
+		d2 = dx * dx + dy * dy + dz * dz + 0.01;
+		f = 0.001 / (d2 * sqrt(d2));
+		u0 = u0 - dx * 0.25 * f; v0 = v0 - dy * 0.25 * f; w0 = w0 - dz * 0.25 * f;
+		u2 = u2 + dx * f; v2 = v2 + dy * f; w2 = w2 + dz * f;
+
+		dx = x1 - x2; dy = y1 - y2; dz = z1 - z2;
+		d2 = dx * dx + dy * dy + dz * dz + 0.01;
+		f = 0.001 / (d2 * sqrt(d2));
+		u1 = u1 - dx * 0.25 * f; v1 = v1 - dy * 0.25 * f; w1 = w1 - dz * 0.25 * f;
+		u2 = u2 + dx * 0.5 * f; v2 = v2 + dy * 0.5 * f; w2 = w2 + dz * 0.5 * f;
+
+		x0 = x0 + 0.001 * u0; y0 = y0 + 0.001 * v0; z0 = z0 + 0.001 * w0;
+		x1 = x1 + 0.001 * u1; y1 = y1 + 0.001 * v1; z1 = z1 + 0.001 * w1;
+		x2 = x2 + 0.001 * u2; y2 = y2 + 0.001 * v2; z2 = z2 + 0.001 * w2;
+	}
+	return x0 + y0 + z0 + x1 + y1 + z1 + x2 + y2 + z2;
+}
+
+double c_integrate(double n){
+	double h = 1 / n, s = 0;
+	for (long i = 0; i < (long)n; ++i)
+		s = s + 4 / (1 + ((i + 0.5) * h) * ((i + 0.5) * h));
+	return s * h;
+}
+
+double c_dot(double n){
+	double t = 0;
+	for (long k = 0; k < (long)n; ++k) {
+		double s = 0;
+		for (long i = 0; i < kernel_length; ++i)
+			s = s + kernel_a[i] * kernel_b[i];
+		t = t + s;
+	}
+	return t;
+}
+
+double c_sum_loop(double n){
+	double t = 0;
+	for (long k = 0; k < (long)n; ++k) {
+		double s = 0;
+		for (long i = 0; i < kernel_length; ++i)
+			s = s + kernel_a[i];
+		t = t + s;
+	}
+	return t;
+}
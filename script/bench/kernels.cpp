@@ -0,0 +1,163 @@
+// kernel benchmark: the kernels of kernels.kpp compiled by the JIT of kpp::Engine, against the same kernels in C (kernels.c)
+// every kernel is called twice to warm up (the first call compiles it), then timed reps times, on one pinned core;
+// prints the ns per operation of both, mean and relative standard deviation, their ratio, and whether the checksums agree
+//
+// build: see kernels.sh
+// usage: kernels <kernels.kpp> [reps] [core, -1 not to pin] [-O<level>]
+#include "kpp.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+extern "C" {
+	extern const double* kernel_a;
+	extern const double* kernel_b;
+	extern long kernel_length;
+	double c_fib(double n);
+	double c_nested(double n);
+	double c_mandel(double n);
+	double c_nbody(double n);
+	double c_integrate(double n);
+	double c_dot(double n);
+	double c_sum_loop(double n);
+}
+
+static const long array_length = 4096;	//a and b fit in the L1 cache
+
+struct Kernel{
+	const char* name;			//the kpp function
+	double size;				//its argument
+	double(*native)(double);
+	double ops;					//operations of a call: calls, iterations, points, steps or elements
+};
+
+struct Timing{
+	double mean_ns;				//per operation
+	double deviation;			//relative standard deviation of the reps
+	double result;
+};
+
+static double fib_calls(double n){
+	double a = 0, b = 1;	//fib(n + 1)
+	for (int i = 0; i < n; ++i) {
+		double c = a + b;
+		a = b;
+		b = c;
+	}
+	return 2 * b - 1;
+}
+
+static Timing time_kernel(double(*func)(double), double size, double ops, unsigned reps){
+	Timing timing = { 0, 0, 0 };
+	for (int i = 0; i < 2; ++i) {
+		timing.result = func(size);
+	}
+	std::vector<double> samples;
+	for (unsigned i = 0; i < reps; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		timing.result = func(size);
+		samples.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ops);
+	}
+	for (double sample : samples) {
+		timing.mean_ns += sample / reps;
+	}
+	double variance = 0;
+	for (double sample : samples) {
+		variance += (sample - timing.mean_ns) * (sample - timing.mean_ns) / reps;
+	}
+	timing.deviation = timing.mean_ns ? std::sqrt(variance) / timing.mean_ns : 0;
+	return timing;
+}
+
+static void pin_to_core(int core){
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0)
+		fprintf(stderr, "could not pin to core %d\n", core);
+#else
+	fprintf(stderr, "pinning needs Linux\n");
+#endif
+}
+
+int main(int argc, char** argv){
+	if (argc < 2){
+		fprintf(stderr, "usage: %s <kernels.kpp> [reps] [core] [-O<level>]\n", argv[0]);
+		return 1;
+	}
+	unsigned reps = argc > 2 ? std::atoi(argv[2]) : 10;
+	int core = argc > 3 ? std::atoi(argv[3]) : 0;
+	kpp::EngineOptions options;
+	if (argc > 4 && argv[4][0] == '-' && argv[4][1] == 'O')
+		options.opt_level = std::atoi(argv[4] + 2);
+	if (!reps)
+		reps = 1;
+	if (core >= 0)
+		pin_to_core(core);
+
+	std::ifstream file(argv[1]);
+	std::stringstream source;
+	source << file.rdbuf();
+	if (!file){
+		fprintf(stderr, "could not read %s\n", argv[1]);
+		return 1;
+	}
+
+	std::vector<double> a(array_length), b(array_length);
+	for (long i = 0; i < array_length; ++i) {
+		a[i] = (double)(i % 97) / 97;
+		b[i] = (double)(i % 89) / 89 - 0.5;
+	}
+	kernel_a = a.data();
+	kernel_b = b.data();
+	kernel_length = array_length;
+
+	//the arrays are bound before the code using them is compiled
+	kpp::Engine engine(options);
+	if (!engine.isValid() || !engine.bindArray("a", a.data(), a.size()) || !engine.bindArray("b", b.data(), b.size())
+		|| !engine.compile(source.str())){
+		fprintf(stderr, "could not compile %s: %s\n", argv[1], engine.getError().c_str());
+		return 1;
+	}
+
+	Kernel kernels[] = {
+		{ "fib", 30, c_fib, fib_calls(30) },
+		{ "nested", 2000, c_nested, 2000.0 * 2000 },
+		{ "mandel", 300, c_mandel, 300.0 * 300 },
+		{ "nbody", 200000, c_nbody, 200000 },
+		{ "integrate", 10000000, c_integrate, 10000000 },
+		{ "dot_builtin", 2000, c_dot, 2000.0 * array_length },
+		{ "sum_loop", 500, c_sum_loop, 500.0 * array_length },
+	};
+
+	printf("-O%u, %u reps, %s\n", options.opt_level, reps, core >= 0 ? ("core " + std::to_string(core)).c_str() : "not pinned");
+	printf("%-12s %12s %18s %18s %8s  %s\n", "kernel", "ops/call", "kpp ns/op", "C ns/op", "kpp/C", "checksum");
+	int wrong = 0;
+	for (const Kernel& kernel : kernels) {
+		auto func = engine.lookup<double(double)>(kernel.name);
+		if (!func){
+			printf("%-12s not defined\n", kernel.name);
+			++wrong;
+			continue;
+		}
+		Timing jit = time_kernel(func, kernel.size, kernel.ops, reps);
+		Timing native = time_kernel(kernel.native, kernel.size, kernel.ops, reps);
+		//the builtin reductions add in another order
+		bool same = std::fabs(jit.result - native.result) <= 1e-9 * std::fmax(1.0, std::fabs(native.result));
+		if (!same)
+			++wrong;
+		printf("%-12s %12.0f %10.3f ±%5.1f%% %10.3f ±%5.1f%% %8.2f  %s\n", kernel.name, kernel.ops,
+			jit.mean_ns, jit.deviation * 100, native.mean_ns, native.deviation * 100,
+			native.mean_ns ? jit.mean_ns / native.mean_ns : 0.0, same ? "same" : ("differs: " + std::to_string(jit.result) + " " + std::to_string(native.result)).c_str());
+	}
+	return wrong ? 1 : 0;
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+# kernel benchmark, see kernels.cpp: the kernels of kernels.kpp in the JIT against kernels.c built with clang -O2
+# builds the harness with Kaleidoscope+.cpp as a library; exits with 1 if a checksum differs, so it can guard against regressions
+# CC picks the C compiler (clang, cc if there is no clang), CFLAGS its flags
+#
+# usage: kernels.sh [reps] [core, -1 not to pin] [-O<level> of the JIT]
+DIR=$(dirname "$0")
+SRC="$DIR/../../Kaleidoscope+"
+CXX=${CXX:-c++}
+CC=${CC:-clang}
+CFLAGS=${CFLAGS:--O2}
+OUT=${TMPDIR:-/tmp}/kernels
+
+if ! command -v "$CC" > /dev/null 2>&1; then
+	echo "$CC not found, the C kernels are built with cc $CFLAGS"
+	CC=cc
+fi
+"$CC" $CFLAGS -c "$DIR/kernels.c" -o "$OUT.o" || exit 1
+"$CXX" -std=c++17 -O2 -w -DKPP_EMBEDDED -I"$SRC" "$DIR/kernels.cpp" "$SRC/Kaleidoscope+.cpp" "$OUT.o" \
+	$(llvm-config --cxxflags --ldflags --system-libs --libs all) -fexceptions -lpthread -o "$OUT" || exit 1
+"$OUT" "$DIR/kernels.kpp" "$@"
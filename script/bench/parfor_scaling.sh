@@ -0,0 +1,22 @@
+#!/bin/sh
+# parfor scaling benchmark
+# runs parfor_scaling.kpp with 1 to N parfor threads, N is the number of cores by default,
+# prints the run time, the speedup over 1 thread and how the loops were split and stolen
+#
+# usage: parfor_scaling.sh [path to kpp] [N]
+KPP=${1:-./toy}
+DIR=$(dirname "$0")
+N=${2:-$(nproc 2>/dev/null || echo 4)}
+
+base=0
+threads=1
+while [ "$threads" -le "$N" ]; do
+	start=$(date +%s%N)
+	out=$("$KPP" -O2 --parfor-threads=$threads "$DIR/parfor_scaling.kpp" 2>&1 | sed 's/ready>//g' | grep -a "parfor:")
+	end=$(date +%s%N)
+	ms=$(( (end - start) / 1000000 ))
+	[ "$base" -eq 0 ] && base=$ms
+	echo "threads $threads: $ms ms, speedup $(( base * 100 / (ms ? ms : 1) ))%"
+	echo "$out"
+	threads=$((threads + 1))
+done
@@ -0,0 +1,37 @@
+#!/bin/sh
+# perf report of a kpp script, the samples in JIT code attributed to kpp functions and source lines
+# without perf installed only checks that kpp writes the perf map and the jitdump
+#
+# usage: perf_jit.sh <kpp> [script.kpp], a recursive fib and a loop by default
+KPP=${1:?usage: perf_jit.sh <kpp> [script.kpp]}
+OUT=${TMPDIR:-/tmp}/perf_jit.$$
+mkdir -p "$OUT"
+SCRIPT=$2
+if [ -z "$SCRIPT" ]; then
+	SCRIPT=$OUT/fib.kpp
+	cat > "$SCRIPT" <<'KPP'
+def fib(n) if n < 2 then n else fib(n - 1) + fib(n - 2);
+def spin(n) var s = 0 in (for i = 0, i < n, 1 in s = s + i * i) + s;
+fib(32);
+spin(100000000);
+KPP
+fi
+
+if ! command -v perf > /dev/null 2>&1; then
+	JITDUMPDIR="$OUT" "$KPP" -g --perf-map --jitdump --log=info "$SCRIPT" 2> "$OUT/err" > /dev/null
+	MAP=$(grep -ao "/tmp/perf-[0-9]*.map" "$OUT/err" | head -1)
+	DUMP=$(find "$OUT" -name "jit-*.dump" | head -1)
+	echo "perf not found"
+	echo "perf map: ${MAP:-none}, $(cat "$MAP" 2> /dev/null | wc -l) functions"
+	echo "jitdump: ${DUMP:-none}"
+	STATUS=1
+	[ -n "$MAP" ] && [ -n "$DUMP" ] && STATUS=0
+	rm -rf "$OUT" "$MAP"
+	exit $STATUS
+fi
+
+# -k 1: the timestamps of the samples and of the jitdump records are both CLOCK_MONOTONIC
+JITDUMPDIR="$OUT" perf record -k 1 -q -o "$OUT/perf.data" "$KPP" -g --jitdump "$SCRIPT" > /dev/null
+perf inject --jit -i "$OUT/perf.data" -o "$OUT/perf.jit.data"
+perf report -i "$OUT/perf.jit.data" --stdio --sort sym,srcline 2> /dev/null | grep -v "^#" | grep -v "^$" | head -20
+rm -rf "$OUT" ~/.debug/jit/llvm-IR-jit-* 2> /dev/null
@@ -0,0 +1,45 @@
+#!/bin/sh
+# a generated program streamed into kpp, with mainloop and with --pipelined
+# every definition is followed by expressions calling it, so parsing, codegen, compilation and the runs alternate;
+# prints the wall time of both, and of the same program run as a script file (batched, not streamed),
+# and checks that they evaluate to the same values; all three compile on one JIT thread
+#
+# usage: pipeline_stream.sh <kpp> [definitions] [expressions per definition]
+KPP=${1:?usage: pipeline_stream.sh <kpp> [definitions] [expressions per definition]}
+N=${2:-500}
+M=${3:-4}
+OUT=${TMPDIR:-/tmp}/pipeline_stream.$$
+
+awk -v n="$N" -v m="$M" 'BEGIN {
+	for (i = 0; i < n; ++i) {
+		printf "def f%d(x) var s = 0 in (for j = 0, j < x, 1 in s = s + j * %d) + s;\n", i, i % 7 + 1
+		for (k = 0; k < m; ++k)
+			printf "f%d(%d);\n", i, 1000 + k * 100
+	}
+}' > "$OUT.kpp"
+
+# run <tag> <options>
+run(){
+	tag=$1
+	shift
+	start=$(date +%s.%N)
+	"$KPP" --log=info "$@" < "$OUT.kpp" 2> "$OUT.err" > /dev/null
+	end=$(date +%s.%N)
+	grep -ao "Evaluated to [-0-9.a-z]*" "$OUT.err" > "$OUT.values.$tag"
+	echo "$start $end" | awk '{ printf "%.3f s", $2 - $1 }'
+}
+
+echo "$N definitions, $((N * M)) expressions"
+echo "mainloop:    $(run 1 --jit-threads=1)"
+echo "--pipelined: $(run 2 --pipelined)"
+grep -a "^pipeline:" "$OUT.err"
+echo "script file: $(run 3 --jit-threads=1 "$OUT.kpp")"
+if cmp -s "$OUT.values.1" "$OUT.values.2" && cmp -s "$OUT.values.1" "$OUT.values.3"; then
+	echo "same values"
+	STATUS=0
+else
+	echo "values differ"
+	STATUS=1
+fi
+rm -f "$OUT.kpp" "$OUT.err" "$OUT.values.1" "$OUT.values.2" "$OUT.values.3"
+exit $STATUS
@@ -0,0 +1,30 @@
+#!/bin/sh
+# reduction builtins benchmark
+# runs every reduction of reductions.kpp as a builtin and as a for loop, prints the time of each
+# without the time of the same script running no reduction, and the value, which must be the same up to rounding
+#
+# usage: reductions.sh [path to kpp] [reps]
+KPP=${1:-./toy}
+DIR=$(dirname "$0")
+REPS=${2:-20000}
+TMP=${TMPDIR:-/tmp}/reductions.$$.kpp
+
+run(){
+	cp "$DIR/reductions.kpp" "$TMP"
+	echo "$1;" >> "$TMP"
+	start=$(date +%s%N)
+	value=$("$KPP" -O3 --log=info "$TMP" 2>&1 | sed 's/ready>//g' | grep -a "Evaluated" | tail -1)
+	end=$(date +%s%N)
+	echo "$(( (end - start) / 1000000 )) $value"
+}
+
+base=$(run 0 | cut -d' ' -f1)
+for reduction in sum dot maxv norm2; do
+	for kind in builtin loop; do
+		set -- $(run "${reduction}_$kind($REPS)")
+		ms=$1
+		shift
+		echo "$reduction $kind: $(( ms - base )) ms, $*"
+	done
+done
+rm -f "$TMP"
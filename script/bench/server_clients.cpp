@@ -0,0 +1,107 @@
+// kpp --server clients
+// every client thread connects, sends the same definitions and then calls them, checking every reply
+// the first client compiles the definitions, the others load the objects from the shared cache
+// prints the round trip latency seen by the clients and the :latency of the server for the first client
+//
+// usage: server_clients <socket> [clients] [calls per client]
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int connect_server(const char* path){
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0){
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//send a request line, wait for the reply line
+static std::string request(int fd, const std::string& line){
+	std::string out = line + "\n";
+	if (write(fd, out.data(), out.size()) != (ssize_t)out.size())
+		return "";
+	std::string reply;
+	char ch;
+	while (read(fd, &ch, 1) == 1 && ch != '\n')
+		reply += ch;
+	return reply;
+}
+
+int main(int argc, char** argv){
+	if (argc < 2){
+		fprintf(stderr, "usage: %s <socket> [clients] [calls per client]\n", argv[0]);
+		return 1;
+	}
+	const char* path = argv[1];
+	int clients = argc > 2 ? atoi(argv[2]) : 8;
+	int calls = argc > 3 ? atoi(argv[3]) : 1000;
+
+	std::atomic<int> wrong(0);
+	std::vector<std::vector<double>> latencies(clients);
+	std::vector<double> setup_ms(clients);
+	std::string server_latency;
+	std::vector<std::thread> threads;
+	for (int c = 0; c < clients; ++c) {
+		threads.emplace_back([&, c](){
+			int fd = connect_server(path);
+			if (fd < 0){
+				fprintf(stderr, "could not connect to %s\n", path);
+				wrong += calls;
+				return;
+			}
+			auto start = std::chrono::steady_clock::now();
+			if (request(fd, "def fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2);") != "ok")
+				++wrong;
+			if (request(fd, "def poly(x y) x * x + 3 * x * y + y;") != "ok")
+				++wrong;
+			//the first call compiles the function, or loads it from the shared cache
+			if (request(fd, "fib(10) + poly(1, 2)") != "ok 64")
+				++wrong;
+			setup_ms[c] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			for (int i = 0; i < calls; ++i) {
+				auto begin = std::chrono::steady_clock::now();
+				std::string reply = request(fd, i % 2 ? "fib(15)" : "poly(2, 3)");
+				latencies[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+				if (reply != (i % 2 ? "ok 610" : "ok 25"))
+					++wrong;
+			}
+			if (c == 0)
+				server_latency = request(fd, ":latency");
+			close(fd);
+		});
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	std::vector<double> all;
+	for (auto& client : latencies) {
+		all.insert(all.end(), client.begin(), client.end());
+	}
+	std::sort(all.begin(), all.end());
+	std::sort(setup_ms.begin(), setup_ms.end());
+	if (!all.empty())
+		printf("%d clients x %d calls: round trip p50 %.1f us, p99 %.1f us, max %.1f us\n", clients, calls,
+			all[all.size() / 2], all[(size_t)(0.99 * (all.size() - 1))], all.back());
+	printf("definitions and first call: fastest client %.2f ms, slowest %.2f ms\n", setup_ms.front(), setup_ms.back());
+	printf("server :latency of client 1: %s\n", server_latency.c_str());
+	printf("%d wrong\n", wrong.load());
+	return wrong ? 1 : 0;
+}
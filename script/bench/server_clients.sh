@@ -0,0 +1,21 @@
+#!/bin/sh
+# kpp --server with several clients, see server_clients.cpp
+# starts kpp as a server on a socket in $TMPDIR, runs the clients against it and stops it;
+# the summary of every client and the shared object cache are printed by the server at the end
+#
+# usage: server_clients.sh <kpp> [clients] [calls per client] [server threads]
+KPP=${1:?usage: server_clients.sh <kpp> [clients] [calls per client] [server threads]}
+DIR=$(dirname "$0")
+CXX=${CXX:-c++}
+OUT=${TMPDIR:-/tmp}/server_clients
+SOCKET=${TMPDIR:-/tmp}/kpp_server.$$
+
+"$CXX" -std=c++11 -O2 "$DIR/server_clients.cpp" -lpthread -o "$OUT" || exit 1
+"$KPP" --server="$SOCKET" --server-threads=${4:-0} &
+PID=$!
+while [ ! -S "$SOCKET" ]; do sleep 0.1; done
+"$OUT" "$SOCKET" ${2:-8} ${3:-1000}
+STATUS=$?
+kill -INT $PID
+wait $PID
+exit $STATUS
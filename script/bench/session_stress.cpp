@@ -0,0 +1,59 @@
+// session stress test
+// every thread creates kpp::Engine sessions one after the other, compiles a prelude and runs an expression in each,
+// for 1 to N threads; prints the sessions per second, the speedup over 1 thread and the wrong results
+//
+// build: see session_stress.sh
+// usage: session_stress [N] [sessions per thread]
+#include "kpp.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char* prelude =
+	"def fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2);"
+	"def poly(x) ((x*0.5 + 1.5)*x - 2)*x + 3;"
+	"def sumto(n) var s = 0 in (for i = 0, i < n - 1, 1 in s = s + poly(i)) + s;";
+
+static void run_sessions(unsigned id, unsigned sessions, std::atomic<unsigned>& failures){
+	kpp::EngineOptions options;
+	options.opt_level = 1;
+	for (unsigned i = 0; i < sessions; ++i) {
+		kpp::Engine engine(options);
+		double result;
+		//every session defines a function of its own too
+		std::string source = std::string(prelude) + "def own(x) x + " + std::to_string(id) + ";" + "fib(15) + sumto(100) + own(0);";
+		if (!engine.isValid() || !engine.eval(source, result) || result != 610 + 12734175 + id)
+			++failures;
+	}
+}
+
+int main(int argc, char** argv){
+	unsigned max_threads = argc > 1 ? std::atoi(argv[1]) : std::thread::hardware_concurrency();
+	unsigned sessions = argc > 2 ? std::atoi(argv[2]) : 20;
+	if (!max_threads)
+		max_threads = 1;
+
+	double base = 0;
+	for (unsigned threads = 1; threads <= max_threads; ++threads) {
+		std::atomic<unsigned> failures(0);
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < threads; ++t) {
+			workers.emplace_back(run_sessions, t, sessions, std::ref(failures));
+		}
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double rate = threads * sessions / seconds;
+		if (threads == 1)
+			base = rate;
+		printf("threads %u: %u sessions in %.2f s, %.1f sessions/s, speedup %.2f, %u wrong\n",
+			threads, threads * sessions, seconds, rate, rate / base, failures.load());
+	}
+	return 0;
+}
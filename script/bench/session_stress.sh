@@ -0,0 +1,13 @@
+#!/bin/sh
+# session stress test, see session_stress.cpp
+# builds session_stress with Kaleidoscope+.cpp as a library and runs it; the sessions' debug output goes to /dev/null
+#
+# usage: session_stress.sh [N] [sessions per thread]
+DIR=$(dirname "$0")
+SRC="$DIR/../../Kaleidoscope+"
+CXX=${CXX:-c++}
+OUT=${TMPDIR:-/tmp}/session_stress
+
+"$CXX" -std=c++17 -O2 -w -DKPP_EMBEDDED -I"$SRC" "$DIR/session_stress.cpp" "$SRC/Kaleidoscope+.cpp" \
+	$(llvm-config --cxxflags --ldflags --system-libs --libs all) -fexceptions -lpthread -o "$OUT" || exit 1
+"$OUT" "$@" 2> /dev/null
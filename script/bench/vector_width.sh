@@ -0,0 +1,17 @@
+#!/bin/sh
+# vector width benchmark
+# runs the loop kernels of vector_width.kpp for a generic x86-64 target and for the host CPU,
+# prints the vector width of each target, what the loop and SLP vectorizers did, and the run time
+#
+# usage: vector_width.sh [path to kpp]
+KPP=${1:-./toy}
+DIR=$(dirname "$0")
+
+for target in "--mcpu=x86-64" "--mcpu=native"; do
+	echo "== $target"
+	start=$(date +%s%N)
+	"$KPP" -O3 --log=info $target --pass-remarks='loop-vectorize|slp-vectorizer' "$DIR/vector_width.kpp" 2>&1 \
+		| sed 's/ready>//g' | grep -a -E "^(triple|vector width)|remark:|Evaluated"
+	end=$(date +%s%N)
+	echo "time $(( (end - start) / 1000000 )) ms"
+done
@@ -0,0 +1,28 @@
+#!/bin/sh
+# operator precedence regression: an operator binding tighter than the one before it takes only its own operands,
+# the operators after them belong to the outer expression; prints every expression with its value, exits 1 on a wrong one
+#
+# usage: precedence.sh <kpp>
+KPP=${1:?usage: precedence.sh <kpp>}
+TMP=${TMPDIR:-/tmp}/precedence.$$.kpp
+wrong=0
+
+# check <expression> <value>
+check(){
+	echo "def f(a b c d) $1; f(1, 2, 3, 4);" > "$TMP"
+	value=$("$KPP" --log=info "$TMP" 2>&1 | grep -ao "Evaluated to [-0-9.a-z]*" | tail -1 | cut -d' ' -f3)
+	if [ "$value" = "$2" ]; then
+		echo "ok     $1 = $value"
+	else
+		echo "wrong  $1 = $value, not $2"
+		wrong=1
+	fi
+}
+
+check "a + b*c + d" 11.000000
+check "a - b*c - d" -9.000000
+check "1*1 + 3*3 < 4" 0.000000
+check "b*c - d/b - a" 3.000000
+check "a < b + c*d" 1.000000
+rm -f "$TMP"
+exit $wrong